@@ -0,0 +1,94 @@
+/*
+  ack.c
+  Acknowledgement Coalescing of the Receiver
+*/
+
+#include <time.h>
+#include "packet.h"
+#include "ack.h"
+
+long ack_usec();
+
+void ack_init(struct acker *a, long every, long window){
+  // a sender whose window is full waits for an ACK, so one never covers more than a quarter of it
+  a->every = every < window/4 ? every : window/4;
+  if(a->every < 1)
+    a->every = 1;
+  a->unacked = 0;
+  a->repeated = 0;
+  a->last = 0;
+  a->response = REACKTIME;
+}
+
+int ack_packet(struct acker *a, long advanced, int complete){
+  // a packet moved the next needed sequence number by advanced, returns 1 if the ACK should go now: for a
+  // filled gap, for the first packet after a gap or a duplicate, at the end and once every a->every packets,
+  // the others wait until every queued packet is read, see ack_wait
+  int now = advanced > 1 || complete;
+  if(advanced == 1)
+    a->repeated = 0;
+  else if(advanced == 0 && !a->repeated){
+    a->repeated = 1;
+    now = 1;
+  }
+  a->unacked++;
+  return now || a->unacked >= a->every;
+}
+
+void ack_sent(struct acker *a, int repeat){
+  a->unacked = 0;
+  a->last = repeat ? 0 : ack_usec();
+}
+
+long ack_wait(struct acker *a){
+  // microseconds until the next ACK is due, -1 if none is, a window limited sender waits for the ACK of the packets
+  // it sent last, so it goes out as soon as they are read, and once more if no packet follows it in time, as it
+  // is the only one the sender gets
+  long wait;
+  if(a->unacked > 0)
+    return 0;
+  if(a->last == 0)
+    return -1;
+  wait = 2*a->response > MINREACK ? 2*a->response : MINREACK;
+  wait = a->last + wait - ack_usec();
+  return wait > 0 ? wait : 0;
+}
+
+void ack_answered(struct acker *a){
+  // a packet arrived after every packet was acknowledged, the time it took is how long the sender may need,
+  // a sender that waited for the ACK takes a round trip and one that did not much less, so the long times count
+  long sample;
+  if(a->unacked == 0 && a->last > 0){
+    sample = ack_usec() - a->last;
+    a->response = sample > a->response ? sample : a->response - (a->response - sample) / 8;
+  }
+}
+
+int make_sack(char *buffer, uint32_t session, long req_num, long *slot_seq, long window, long highest){
+  // builds a CUMULATIVE ACK that requests req_num and lists the ranges of packets held in slot_seq up to highest
+  struct header h;
+  struct sack sack;
+  long i;
+  sack.count = 0;
+  if(highest >= req_num+window)
+    highest = req_num+window-1;
+  for(i=req_num+1; i<=highest && sack.count < MAXSACKS; i++){
+    if(slot_seq[i%window] != i)
+      continue;
+    sack.first[sack.count] = i;
+    while(i < highest && slot_seq[(i+1)%window] == i+1)
+      i++;
+    sack.length[sack.count] = i - sack.first[sack.count] + 1;
+    sack.count++;
+  }
+  h.flags = CUMULATIVE;
+  h.session = session;
+  h.seq_num = req_num;
+  return mult_ack(buffer,&h,&sack);
+}
+
+long ack_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
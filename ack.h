@@ -0,0 +1,32 @@
+/*
+  ack.h
+  Acknowledgement Coalescing of the Receiver
+*/
+
+#ifndef ACK_H
+#define ACK_H
+
+#include <stdint.h>
+
+// constant values
+#define ACKEVERY 16 // packets one ACK covers at most, never more than a quarter of the window
+#define REACKTIME 1000 // microseconds from an ACK to the next packet until the first one is measured
+#define MINREACK 100 // an ACK no packet follows is sent again after twice that time, but not sooner than this
+
+// when the receiver of one stream owes its sender an ACK, go-back-n and selective repeat only
+struct acker {
+  long every; // packets one ACK covers at most
+  long unacked; // packets received since the last ACK
+  int repeated; // the last ACK already told the sender of a gap or a duplicate
+  long last; // when the last ACK was sent in microseconds, 0 once it was repeated
+  long response; // how long the sender may take to answer an ACK with a packet
+};
+
+void ack_init(struct acker *a, long every, long window);
+int ack_packet(struct acker *a, long advanced, int complete);
+void ack_sent(struct acker *a, int repeat);
+long ack_wait(struct acker *a);
+void ack_answered(struct acker *a);
+int make_sack(char *buffer, uint32_t session, long req_num, long *slot_seq, long window, long highest);
+
+#endif
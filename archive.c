@@ -0,0 +1,433 @@
+/*
+  archive.c
+  Directory Transfers in One Session
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "checksum.h"
+
+/*
+  The stream starts with the manifest: the magic, the size of the manifest
+  (64 bits) and the number of entries (64 bits), then for each entry its
+  type (8 bits), permission bits (16 bits), size (64 bits), the length of
+  its path (16 bits) and the path, all big endian. A directory comes before
+  everything inside it. The contents of the files follow in the order of
+  their entries, with nothing in between, so small files share packets.
+*/
+#define ENTRYBYTES 13 // entry without its path
+
+void error (char *e);
+int walk(struct archive *a, const char *dir);
+void add_entry(struct archive *a, int type, struct stat *st, const char *path);
+int open_manifest(struct archive *a);
+int parse_manifest(struct archive *a);
+void next_entry(struct archive *a);
+void extract_failed(struct archive *a, const char *path);
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+
+int archive_open(struct archive *a, const char *root){
+  // builds the manifest of the tree under root, returns -1 if root is not a directory
+  struct digest d;
+  struct stat st;
+  uint64_t value;
+  uint16_t value16;
+  char *p;
+  long len;
+  long i;
+
+  if(stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+    return -1;
+  memset(a, 0, sizeof(*a));
+  a->root = strdup(root);
+  a->fd = -1;
+  a->fd_entry = -1;
+  if(a->root == NULL || walk(a, "") < 0)
+    error("Cannot read directory");
+
+  // manifest and the place of every file in the stream
+  a->manifest_size = MANIFESTHEADER;
+  for(i=0; i<a->count; i++)
+    a->manifest_size += ENTRYBYTES + strlen(a->entries[i].path);
+  a->manifest = malloc(a->manifest_size);
+  if(a->manifest == NULL)
+    error("Cannot create manifest!");
+  p = a->manifest;
+  memcpy(p, ARCHIVEMAGIC, 8);
+  value = htobe64(a->manifest_size);
+  memcpy(p+8, &value, sizeof(value));
+  value = htobe64(a->count);
+  memcpy(p+16, &value, sizeof(value));
+  p += MANIFESTHEADER;
+  a->size = a->manifest_size;
+  for(i=0; i<a->count; i++){
+    len = strlen(a->entries[i].path);
+    *p = a->entries[i].type;
+    value16 = htobe16(a->entries[i].mode);
+    memcpy(p+1, &value16, sizeof(value16));
+    value = htobe64(a->entries[i].size);
+    memcpy(p+3, &value, sizeof(value));
+    value16 = htobe16(len);
+    memcpy(p+11, &value16, sizeof(value16));
+    memcpy(p+ENTRYBYTES, a->entries[i].path, len);
+    p += ENTRYBYTES + len;
+    a->entries[i].offset = a->size;
+    a->size += a->entries[i].size;
+  }
+
+  // a file changed in place keeps its size, so the modification times are part of the key
+  digest_init(&d);
+  digest_update(&d, a->manifest, a->manifest_size);
+  for(i=0; i<a->count; i++)
+    digest_update(&d, &a->entries[i].mtime, sizeof(long));
+  a->key = digest_final(&d);
+  return 0;
+}
+
+int archive_read(struct archive *a, char *data, long size, long offset){
+  // copies size bytes of the stream from offset on, returns -1 if a file cannot be read
+  char path[PATH_MAX];
+  struct entry *e;
+  long lo = 0;
+  long hi = a->count;
+  long mid;
+  long n;
+
+  if(offset < a->manifest_size){
+    n = a->manifest_size - offset < size ? a->manifest_size - offset : size;
+    memcpy(data, a->manifest+offset, n);
+    data += n;
+    offset += n;
+    size -= n;
+  }
+
+  // first entry that ends after offset, the one whose contents hold it
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(a->entries[mid].offset + a->entries[mid].size <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for(; size > 0 && lo < a->count; lo++){
+    e = &a->entries[lo];
+    if(e->size == 0)
+      continue;
+    if(a->fd_entry != lo){ // reads are mostly in stream order, so one file is kept open
+      if(a->fd >= 0)
+        close(a->fd);
+      snprintf(path, sizeof(path), "%s/%s", a->root, e->path);
+      a->fd = open(path, O_RDONLY);
+      a->fd_entry = a->fd < 0 ? -1 : lo;
+      if(a->fd < 0)
+        return -1;
+    }
+    n = e->offset + e->size - offset < size ? e->offset + e->size - offset : size;
+    if(pread(a->fd, data, n, offset - e->offset) != n)
+      return -1;
+    data += n;
+    offset += n;
+    size -= n;
+  }
+  return size == 0 ? 0 : -1;
+}
+
+void archive_close(struct archive *a){
+  long i;
+  if(a->fd >= 0)
+    close(a->fd);
+  for(i=0; i<a->count; i++)
+    free(a->entries[i].path);
+  free(a->entries);
+  free(a->manifest);
+  free(a->root);
+  a->fd = -1;
+  a->entries = NULL;
+  a->manifest = NULL;
+  a->root = NULL;
+  a->count = 0;
+}
+
+struct archive *archive_extract(const char *root){
+  // starts extracting a stream into the directory root
+  struct archive *a = calloc(1, sizeof(struct archive));
+  if(a == NULL || (a->root = strdup(root)) == NULL)
+    error("Cannot create archive!");
+  a->fd = -1;
+  a->fd_entry = -1;
+  if(mkdir(root, 0755) < 0 && errno != EEXIST)
+    extract_failed(a, root);
+  return a;
+}
+
+void archive_feed(struct archive *a, const char *data, long size){
+  // extracts the next size bytes of the stream, the files are created and written as the stream reaches them
+  struct entry *e;
+  long n;
+  while(size > 0 && !a->failed){
+    if(a->manifest == NULL || a->pos < a->manifest_size){ // the manifest is collected first
+      if(a->manifest == NULL){
+        n = MANIFESTHEADER - a->pos < size ? MANIFESTHEADER - a->pos : size;
+        memcpy(a->header+a->pos, data, n);
+      }else{
+        n = a->manifest_size - a->pos < size ? a->manifest_size - a->pos : size;
+        memcpy(a->manifest+a->pos, data, n);
+      }
+      a->pos += n;
+      data += n;
+      size -= n;
+      if(a->manifest == NULL && a->pos == MANIFESTHEADER && open_manifest(a) < 0)
+        extract_failed(a, "manifest");
+      if(a->manifest != NULL && a->pos == a->manifest_size){
+        if(parse_manifest(a) < 0)
+          extract_failed(a, "manifest");
+        else
+          next_entry(a);
+      }
+      continue;
+    }
+    if(a->fd_entry < 0){ // every file is complete
+      extract_failed(a, "stream longer than its manifest");
+      return;
+    }
+    e = &a->entries[a->fd_entry];
+    n = e->offset + e->size - a->pos < size ? e->offset + e->size - a->pos : size;
+    if(write(a->fd, data, n) != n){
+      extract_failed(a, e->path);
+      return;
+    }
+    a->pos += n;
+    data += n;
+    size -= n;
+    if(a->pos == e->offset + e->size){
+      close(a->fd);
+      a->fd = -1;
+      a->fd_entry = -1;
+      a->next++;
+      next_entry(a);
+    }
+  }
+}
+
+int archive_finish(struct archive *a){
+  // returns 0 if every entry of the manifest was extracted, the permissions of the directories are
+  // set last, from the deepest up, so that none of them stops the files from being written
+  char path[PATH_MAX];
+  long i;
+  if(!a->failed && (a->manifest == NULL || a->pos < a->manifest_size || a->next < a->count))
+    extract_failed(a, "stream shorter than its manifest");
+  if(a->failed)
+    return -1;
+  for(i=a->count-1; i>=0; i--){
+    if(a->entries[i].type != ENTRYDIR)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", a->root, a->entries[i].path);
+    chmod(path, a->entries[i].mode);
+  }
+  printf("EXTRACTED %ld ENTRIES TO %s\n",a->count,a->root);
+  return 0;
+}
+
+void archive_remove(const char *root){
+  // deletes a tree that could not be extracted
+  nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int walk(struct archive *a, const char *dir){
+  // adds the entries under dir, in name order so that the same tree always gives the same manifest
+  struct dirent **names;
+  struct stat st;
+  char path[PATH_MAX];
+  char full[PATH_MAX];
+  int n;
+  int i;
+  int result = 0;
+
+  if(snprintf(full, sizeof(full), dir[0] != '\0' ? "%s/%s" : "%s", a->root, dir) >= (int)sizeof(full))
+    return -1;
+  n = scandir(full, &names, NULL, alphasort);
+  if(n < 0)
+    return -1;
+  for(i=0; i<n; i++){
+    if(strcmp(names[i]->d_name,".") == 0 || strcmp(names[i]->d_name,"..") == 0){
+      free(names[i]);
+      continue;
+    }
+    if(snprintf(path, sizeof(path), dir[0] != '\0' ? "%s/%s" : "%s%s", dir, names[i]->d_name) >= (int)sizeof(path)
+       || snprintf(full, sizeof(full), "%s/%s", a->root, path) >= (int)sizeof(full)){
+      // a cut path would name another file, or none
+      printf("SKIPPING %s/%s, THE PATH IS TOO LONG\n",dir,names[i]->d_name);
+      free(names[i]);
+      continue;
+    }
+    free(names[i]);
+    if(strlen(path) > UINT16_MAX || lstat(full, &st) < 0)
+      continue;
+    if(S_ISDIR(st.st_mode)){
+      add_entry(a, ENTRYDIR, &st, path);
+      if(result == 0)
+        result = walk(a, path);
+    }
+    else if(S_ISREG(st.st_mode))
+      add_entry(a, ENTRYFILE, &st, path);
+    else // links, devices and sockets have no contents to send
+      printf("SKIPPING %s\n",path);
+  }
+  free(names);
+  return result;
+}
+
+void add_entry(struct archive *a, int type, struct stat *st, const char *path){
+  struct entry *e;
+  if(a->count == a->capacity){
+    a->capacity = a->capacity > 0 ? 2*a->capacity : 256;
+    a->entries = realloc(a->entries, a->capacity*sizeof(struct entry));
+    if(a->entries == NULL)
+      error("Cannot create manifest!");
+  }
+  e = &a->entries[a->count++];
+  e->type = type;
+  e->mode = st->st_mode & 07777;
+  e->size = type == ENTRYFILE ? st->st_size : 0;
+  e->mtime = st->st_mtim.tv_sec*1000000000L + st->st_mtim.tv_nsec;
+  e->path = strdup(path);
+  if(e->path == NULL)
+    error("Cannot create manifest!");
+}
+
+int open_manifest(struct archive *a){
+  // checks the header of the manifest and makes room for the rest of it
+  uint64_t value;
+  long count;
+  if(memcmp(a->header, ARCHIVEMAGIC, 8) != 0)
+    return -1;
+  memcpy(&value, a->header+8, sizeof(value));
+  a->manifest_size = be64toh(value);
+  memcpy(&value, a->header+16, sizeof(value));
+  count = be64toh(value);
+  if(a->manifest_size < MANIFESTHEADER || a->manifest_size > MAXMANIFEST
+     || count < 0 || count > (a->manifest_size - MANIFESTHEADER) / (ENTRYBYTES+1))
+    return -1;
+  a->manifest = malloc(a->manifest_size);
+  a->entries = calloc(count > 0 ? count : 1, sizeof(struct entry));
+  if(a->manifest == NULL || a->entries == NULL)
+    error("Cannot create archive!");
+  memcpy(a->manifest, a->header, MANIFESTHEADER);
+  a->count = count;
+  a->capacity = count;
+  return 0;
+}
+
+int parse_manifest(struct archive *a){
+  // reads the entries of a complete manifest, returns -1 if it is malformed or a path leaves the root
+  const unsigned char *p = (const unsigned char *)a->manifest + MANIFESTHEADER;
+  const unsigned char *end = (const unsigned char *)a->manifest + a->manifest_size;
+  struct entry *e;
+  uint64_t value;
+  uint16_t value16;
+  long count = a->count;
+  long len;
+  long i;
+
+  a->count = 0; // only the entries read so far are freed if the manifest is malformed
+  a->size = a->manifest_size;
+  for(i=0; i<count; i++){
+    if(end - p < ENTRYBYTES)
+      return -1;
+    e = &a->entries[i];
+    e->type = p[0];
+    memcpy(&value16, p+1, sizeof(value16));
+    e->mode = be16toh(value16) & 07777;
+    memcpy(&value, p+3, sizeof(value));
+    e->size = be64toh(value);
+    memcpy(&value16, p+11, sizeof(value16));
+    len = be16toh(value16);
+    if((e->type != ENTRYFILE && e->type != ENTRYDIR) || e->size < 0 || (e->type == ENTRYDIR && e->size != 0)
+       || len < 1 || len >= PATH_MAX || end - p - ENTRYBYTES < len)
+      return -1;
+    e->path = malloc(len+1);
+    if(e->path == NULL)
+      error("Cannot create archive!");
+    memcpy(e->path, p+ENTRYBYTES, len);
+    e->path[len] = '\0';
+    a->count++;
+    if(strlen(e->path) != (size_t)len || !safe_path(e->path))
+      return -1;
+    e->offset = a->size;
+    a->size += e->size;
+    p += ENTRYBYTES + len;
+  }
+  return p == end ? 0 : -1;
+}
+
+int safe_path(const char *path){
+  // a path stays inside the root if it is relative and none of its components is empty, . or ..
+  const char *p = path;
+  const char *slash;
+  long len;
+  while(1){
+    slash = strchr(p, '/');
+    len = slash != NULL ? slash - p : (long)strlen(p);
+    if(len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+      return 0;
+    if(slash == NULL)
+      return 1;
+    p = slash + 1;
+  }
+}
+
+void next_entry(struct archive *a){
+  // creates the directories and empty files the stream has reached and opens the next file with contents
+  char path[PATH_MAX];
+  struct entry *e;
+  while(a->next < a->count && !a->failed){
+    e = &a->entries[a->next];
+    snprintf(path, sizeof(path), "%s/%s", a->root, e->path);
+    if(e->type == ENTRYDIR){
+      if(mkdir(path, 0700) < 0 && errno != EEXIST)
+        extract_failed(a, e->path);
+      a->next++;
+      continue;
+    }
+    a->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    if(a->fd < 0 || fchmod(a->fd, e->mode) < 0){
+      extract_failed(a, e->path);
+      return;
+    }
+    if(e->size > 0){
+      a->fd_entry = a->next;
+      return;
+    }
+    close(a->fd);
+    a->fd = -1;
+    a->next++;
+  }
+}
+
+void extract_failed(struct archive *a, const char *path){
+  printf("CANNOT EXTRACT %s\n",path);
+  a->failed = 1;
+  if(a->fd >= 0)
+    close(a->fd);
+  a->fd = -1;
+  a->fd_entry = -1;
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw){
+  (void)st;
+  (void)flag;
+  (void)ftw;
+  remove(path);
+  return 0;
+}
@@ -0,0 +1,56 @@
+/*
+  archive.h
+  Directory Transfers in One Session
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+// constant values
+#define ARCHIVEMAGIC "UDPFTARC"
+#define MANIFESTHEADER 24 // magic, manifest size and number of entries
+#define MAXMANIFEST (256L*1024*1024) // largest manifest a receiver accepts
+#define ENTRYFILE 0
+#define ENTRYDIR 1
+
+// a file or directory of the tree, paths are relative to its root
+struct entry {
+  int type;
+  int mode; // permission bits
+  long size; // 0 for a directory
+  long offset; // where the contents start in the stream
+  long mtime;
+  char *path;
+};
+
+// a directory tree sent as its manifest followed by the contents of its files back to back,
+// the sender reads it from the tree and the receiver extracts it while the stream arrives in order
+struct archive {
+  char *root;
+  struct entry *entries;
+  long count;
+  long capacity;
+  char *manifest;
+  long manifest_size;
+  long size; // whole stream
+  uint64_t key; // digest of the manifest and the modification times, a resumed transfer must be of the same tree
+  int fd; // file being read or written
+  long fd_entry; // entry of fd, -1 if none is open
+  long pos; // receiver, stream bytes extracted so far
+  long next; // receiver, first entry that is not complete
+  char header[MANIFESTHEADER];
+  int failed; // receiver, the stream cannot be extracted
+};
+
+int archive_open(struct archive *a, const char *root);
+int archive_read(struct archive *a, char *data, long size, long offset);
+void archive_close(struct archive *a);
+struct archive *archive_extract(const char *root);
+void archive_feed(struct archive *a, const char *data, long size);
+int archive_finish(struct archive *a);
+void archive_remove(const char *root);
+int safe_path(const char *path);
+
+#endif
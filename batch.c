@@ -0,0 +1,321 @@
+/*
+  batch.c
+  Batched Datagram I/O with sendmmsg and recvmmsg
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include "packet.h"
+#include "batch.h"
+#include "metrics.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+// constant values
+#define GSOMAXSEGS 64
+#define GSOMAXBYTES 65000
+
+void error (char *e);
+int send_messages(int sock, int count);
+int packet_iov(int i, struct iovec *iov, int n);
+int batch_drain(int sock, char **payloads, int size);
+
+// largest packet of the transfer, set by batch_init
+int packet_size = 0;
+
+// outgoing packets collected for one sendmmsg call, stored back to back so runs can go out as one GSO buffer,
+// a packet whose payload stays where it is has only its header and checksum here
+char *send_area = NULL;
+int send_used = 0;
+char *send_start[BATCH];
+int send_len[BATCH];
+const char *send_payload[BATCH]; // NULL if the whole packet is at send_start
+struct sockaddr_in send_addr[BATCH];
+int send_count = 0;
+long send_bytes = 0;
+struct mmsghdr send_msgs[BATCH];
+struct iovec send_iov[3*BATCH];
+char send_control[BATCH][CMSG_SPACE(sizeof(uint16_t))];
+
+// incoming packets drained with one recvmmsg call, GRO buffers are split into packets
+char *small_area = NULL;
+char *gro_area = NULL;
+char *recv_batch[MAXRECV];
+char *recv_data[MAXRECV];
+int recv_size[MAXRECV];
+struct sockaddr_in recv_addr[MAXRECV];
+struct sockaddr_in recv_name[BATCH];
+struct mmsghdr recv_msgs[BATCH];
+struct iovec recv_iov[2*BATCH];
+char recv_header[BATCH][HEADERSIZE]; // headers of packets whose payload goes to a buffer of the caller
+char recv_control[BATCH][CMSG_SPACE(sizeof(int))];
+
+// segmentation offload state, set by batch_offload
+int gso = 0;
+int gro = 0;
+
+// counters for the average batch size
+long send_calls = 0;
+long send_packets = 0;
+long recv_calls = 0;
+long recv_packets = 0;
+
+void batch_init(int size){
+  // sizes the send and receive buffers for packets of at most size bytes
+  packet_size = size;
+  free(send_area);
+  free(small_area);
+  send_area = malloc(BATCH*size);
+  small_area = malloc(BATCH*size);
+  if(send_area == NULL || small_area == NULL)
+    error("Cannot create batch buffers!");
+  send_count = 0;
+  send_used = 0;
+  send_bytes = 0;
+}
+
+char *batch_buffer(){
+  // returns the buffer the next queued packet is built in
+  return send_area + send_used;
+}
+
+void batch_queue(int sock, struct sockaddr_in *address, int size){
+  // queues the packet built in batch_buffer(), a full batch is sent right away
+  batch_queue_split(sock, address, size, NULL);
+}
+
+void batch_queue_split(int sock, struct sockaddr_in *address, int size, const char *payload){
+  // queues a packet of size bytes, if payload is not NULL mult_split built only its header and checksum in
+  // batch_buffer() and the payload is read from where it is when the batch is sent, so it must stay until then
+  send_start[send_count] = send_area + send_used;
+  send_len[send_count] = size;
+  send_payload[send_count] = payload;
+  send_addr[send_count] = *address;
+  send_used = send_used + (payload != NULL ? OVERHEAD : size);
+  send_bytes = send_bytes + size;
+  send_count++;
+  if(send_count == BATCH)
+    batch_flush(sock);
+}
+
+void batch_flush(int sock){
+  // sends every queued packet, runs of equal sized packets to the same address become one GSO send
+  int i = 0;
+  int j;
+  int count = 0;
+  int bytes;
+  int iovs = 0;
+  int k;
+  struct cmsghdr *cm;
+  while(i < send_count){
+    memset(&send_msgs[count], 0, sizeof(struct mmsghdr));
+    j = i+1;
+    bytes = send_len[i];
+    if(gso) // only the last segment of a run may be shorter
+      while(j < send_count && j-i < GSOMAXSEGS && bytes + send_len[j] <= GSOMAXBYTES
+            && send_len[j-1] == send_len[i] && send_len[j] <= send_len[i]
+            && memcmp(&send_addr[j], &send_addr[i], sizeof(struct sockaddr_in)) == 0){
+        bytes = bytes + send_len[j];
+        j++;
+      }
+    send_msgs[count].msg_hdr.msg_name = &send_addr[i];
+    send_msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    send_msgs[count].msg_hdr.msg_iov = &send_iov[iovs];
+    for(k=i; k<j; k++)
+      send_msgs[count].msg_hdr.msg_iovlen = packet_iov(k, &send_iov[iovs], send_msgs[count].msg_hdr.msg_iovlen);
+    iovs = iovs + send_msgs[count].msg_hdr.msg_iovlen;
+    if(j-i > 1){ // let the kernel cut the run into send_len[i] sized datagrams
+      send_msgs[count].msg_hdr.msg_control = send_control[count];
+      send_msgs[count].msg_hdr.msg_controllen = sizeof(send_control[count]);
+      cm = CMSG_FIRSTHDR(&send_msgs[count].msg_hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cm) = send_len[i];
+    }
+    count++;
+    i = j;
+  }
+  if(send_messages(sock, count) < 0){
+    // the device refused segmentation offload, send the same packets one by one from now on
+    gso = 0;
+    iovs = 0;
+    for(i=0; i<send_count; i++){
+      memset(&send_msgs[i], 0, sizeof(struct mmsghdr));
+      send_msgs[i].msg_hdr.msg_name = &send_addr[i];
+      send_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      send_msgs[i].msg_hdr.msg_iov = &send_iov[iovs];
+      send_msgs[i].msg_hdr.msg_iovlen = packet_iov(i, &send_iov[iovs], 0);
+      iovs = iovs + send_msgs[i].msg_hdr.msg_iovlen;
+    }
+    if(send_messages(sock, send_count) < 0)
+      error("Cannot send package!");
+  }
+  send_packets = send_packets + send_count;
+  metric_add(PACKETSSENT,send_count);
+  metric_add(BYTESSENT,send_bytes);
+  send_count = 0;
+  send_used = 0;
+  send_bytes = 0;
+}
+
+int packet_iov(int i, struct iovec *iov, int n){
+  // appends the pieces of queued packet i to the n entries of iov and returns the new count,
+  // a piece that follows the last one in memory extends it
+  const char *piece[3];
+  int len[3];
+  int pieces = 1;
+  int k;
+  piece[0] = send_start[i];
+  len[0] = send_len[i];
+  if(send_payload[i] != NULL){
+    len[0] = HEADERSIZE;
+    piece[1] = send_payload[i];
+    len[1] = send_len[i] - OVERHEAD;
+    piece[2] = send_start[i] + HEADERSIZE;
+    len[2] = TRAILERSIZE;
+    pieces = 3;
+  }
+  for(k=0; k<pieces; k++){
+    if(n > 0 && (char *)iov[n-1].iov_base + iov[n-1].iov_len == piece[k])
+      iov[n-1].iov_len = iov[n-1].iov_len + len[k];
+    else{
+      iov[n].iov_base = (char *)piece[k];
+      iov[n].iov_len = len[k];
+      n++;
+    }
+  }
+  return n;
+}
+
+int send_messages(int sock, int count){
+  // sendmmsg may take the messages in several calls, returns -1 if segmentation offload failed
+  int done = 0;
+  int n;
+  while(done < count){
+    n = sendmmsg(sock, send_msgs+done, count-done, 0);
+    if(n < 0){
+      if(errno == EINTR)
+        continue;
+      if(gso && done == 0 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+        return -1;
+      error("Cannot send package!");
+    }
+    done = done + n;
+    send_calls++;
+  }
+  return 0;
+}
+
+int batch_receive(int sock){
+  // drains queued datagrams without blocking and returns how many packets arrived
+  return batch_drain(sock, NULL, 0);
+}
+
+int batch_receive_into(int sock, char **payloads, int size){
+  // like batch_receive, but the i-th datagram is received as a header in a buffer of its own and a
+  // payload of at most size bytes, checksum included, right into payloads[i], so the caller can keep it
+  // where it landed, GRO buffers hold many packets and are received as a whole
+  return batch_drain(sock, gro ? NULL : payloads, size);
+}
+
+int batch_drain(int sock, char **payloads, int size){
+  // receives into the batch buffers, or split into recv_header and payloads, and fills recv_batch with the
+  // packets, recv_data points at the payload of each
+  int i;
+  int n;
+  int count = 0;
+  int buffers = gro ? GROBATCH : BATCH;
+  int segment;
+  int offset;
+  struct cmsghdr *cm;
+  for(i=0; i<buffers; i++){
+    memset(&recv_msgs[i], 0, sizeof(struct mmsghdr));
+    recv_msgs[i].msg_hdr.msg_name = &recv_name[i];
+    recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iov[2*i];
+    recv_msgs[i].msg_hdr.msg_iovlen = payloads != NULL ? 2 : 1;
+    if(payloads != NULL){
+      recv_iov[2*i].iov_base = recv_header[i];
+      recv_iov[2*i].iov_len = HEADERSIZE;
+      recv_iov[2*i+1].iov_base = payloads[i];
+      recv_iov[2*i+1].iov_len = size;
+    }else{
+      recv_iov[2*i].iov_base = gro ? gro_area + i*GROBUFSIZE : small_area + i*packet_size;
+      recv_iov[2*i].iov_len = gro ? GROBUFSIZE : packet_size;
+    }
+    if(gro){
+      recv_msgs[i].msg_hdr.msg_control = recv_control[i];
+      recv_msgs[i].msg_hdr.msg_controllen = sizeof(recv_control[i]);
+    }
+  }
+  n = recvmmsg(sock, recv_msgs, buffers, MSG_DONTWAIT, NULL);
+  if(n < 0){
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+    error("Cannot receive packet");
+  }
+  for(i=0; i<n; i++){
+    // a coalesced buffer carries its segment size, every segment is one packet of the sender
+    segment = recv_msgs[i].msg_len;
+    if(gro)
+      for(cm = CMSG_FIRSTHDR(&recv_msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&recv_msgs[i].msg_hdr, cm))
+        if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+          segment = *(int *)CMSG_DATA(cm);
+    if(segment <= 0)
+      segment = recv_msgs[i].msg_len;
+    if(payloads != NULL && recv_msgs[i].msg_len > 0){
+      recv_batch[count] = recv_header[i];
+      recv_data[count] = payloads[i];
+      recv_size[count] = recv_msgs[i].msg_len;
+      recv_addr[count] = recv_name[i];
+      count++;
+    }
+    for(offset = 0; payloads == NULL && offset < (int)recv_msgs[i].msg_len && count < MAXRECV; offset = offset + segment){
+      recv_batch[count] = (char *)recv_iov[2*i].iov_base + offset;
+      recv_data[count] = recv_batch[count] + HEADERSIZE;
+      recv_size[count] = recv_msgs[i].msg_len - offset < segment ? recv_msgs[i].msg_len - offset : segment;
+      recv_addr[count] = recv_name[i];
+      count++;
+    }
+    metric_add(BYTESRECEIVED,recv_msgs[i].msg_len);
+  }
+  metric_add(PACKETSRECEIVED,count);
+  recv_calls++;
+  recv_packets = recv_packets + count;
+  return count;
+}
+
+int batch_offload(int sock){
+  // turns on UDP GSO and GRO for the socket, returns 0 if the kernel supports neither
+  int on = 1;
+  int segment = BASEPACKETSIZE;
+  if(setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0){
+    segment = 0; // the size is given per send, keep the socket default off
+    setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+    gso = 1;
+  }
+  if(setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0){
+    if(gro_area == NULL)
+      gro_area = malloc(GROBATCH*GROBUFSIZE);
+    gro = gro_area != NULL;
+  }
+  return gso || gro;
+}
+
+void batch_stats(){
+  // prints the average number of packets moved per system call
+  printf("Average batch size: %.1f sent, %.1f received\n",
+         send_calls > 0 ? (double)send_packets/send_calls : 0.0,
+         recv_calls > 0 ? (double)recv_packets/recv_calls : 0.0);
+  if(gso || gro)
+    printf("Segmentation offload: %s%s\n", gso ? "GSO " : "", gro ? "GRO" : "");
+}
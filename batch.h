@@ -0,0 +1,33 @@
+/*
+  batch.h
+  Batched Datagram I/O with sendmmsg and recvmmsg
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <netinet/in.h>
+
+// constant values
+#define BATCH 64
+#define GROBATCH 8
+#define GROBUFSIZE 65536
+#define MAXRECV (GROBATCH*64)
+
+// packets drained by the last batch_receive call
+extern char *recv_batch[MAXRECV];
+extern char *recv_data[MAXRECV]; // the payload of each, right after the header unless batch_receive_into split it off
+extern int recv_size[MAXRECV];
+extern struct sockaddr_in recv_addr[MAXRECV];
+
+void batch_init(int size);
+char *batch_buffer();
+void batch_queue(int sock, struct sockaddr_in *address, int size);
+void batch_queue_split(int sock, struct sockaddr_in *address, int size, const char *payload);
+void batch_flush(int sock);
+int batch_receive(int sock);
+int batch_receive_into(int sock, char **payloads, int size);
+int batch_offload(int sock);
+void batch_stats();
+
+#endif
@@ -0,0 +1,150 @@
+/*
+  cc.c
+  Congestion Control for the Sender
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "cc.h"
+
+// constant values
+#define INITCWND 4
+#define MINSSTHRESH 2
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+#define VEGAS_GAMMA 1
+#define PACEGAIN 1.25
+#define SSPACEGAIN 2.0
+
+void fixed_init(struct cc *cc);
+void fixed_ack(struct cc *cc, long acked, long rtt_sample);
+void fixed_loss(struct cc *cc);
+void reno_init(struct cc *cc);
+void reno_ack(struct cc *cc, long acked, long rtt_sample);
+void reno_loss(struct cc *cc);
+void reno_timeout(struct cc *cc);
+void vegas_ack(struct cc *cc, long acked, long rtt_sample);
+
+// static window of N packets, the behavior before congestion control
+const struct cc_ops cc_fixed = {"fixed", fixed_init, fixed_ack, fixed_loss, fixed_loss};
+// slow start and additive increase, multiplicative decrease on loss
+const struct cc_ops cc_reno = {"reno", reno_init, reno_ack, reno_loss, reno_timeout};
+// delay based, keeps a few packets queued at the bottleneck and backs off when the RTT grows
+const struct cc_ops cc_vegas = {"vegas", reno_init, vegas_ack, reno_loss, reno_timeout};
+
+const struct cc_ops *algorithms[] = {&cc_reno, &cc_vegas, &cc_fixed, NULL};
+
+const struct cc_ops *cc_find(const char *name){
+  // returns the algorithm with the given name or NULL
+  int i;
+  for(i=0; algorithms[i] != NULL; i++)
+    if(strcmp(algorithms[i]->name,name) == 0)
+      return algorithms[i];
+  return NULL;
+}
+
+void cc_init(struct cc *cc, const struct cc_ops *ops, long max_window){
+  memset(cc, 0, sizeof(*cc));
+  cc->ops = ops;
+  cc->max_window = max_window;
+  cc->ops->init(cc);
+}
+
+void cc_ack(struct cc *cc, long acked, long rtt_sample){
+  if(rtt_sample > 0){
+    cc->last_rtt = rtt_sample;
+    if(cc->base_rtt == 0 || rtt_sample < cc->base_rtt)
+      cc->base_rtt = rtt_sample;
+  }
+  cc->ops->on_ack(cc, acked, rtt_sample);
+}
+
+void cc_loss(struct cc *cc){
+  cc->ops->on_loss(cc);
+}
+
+void cc_timeout(struct cc *cc){
+  cc->ops->on_timeout(cc);
+}
+
+long cc_window(struct cc *cc){
+  // usable window in whole packets, between 1 and N
+  long w = (long)cc->cwnd;
+  if(w < 1)
+    w = 1;
+  if(w > cc->max_window)
+    w = cc->max_window;
+  return w;
+}
+
+long cc_pacing_gap(struct cc *cc, long srtt){
+  // spreads one window over a round trip, a little faster so that pacing is not the limit
+  double gain = cc->cwnd < cc->ssthresh ? SSPACEGAIN : PACEGAIN;
+  if(srtt <= 0)
+    return 0;
+  return (long)(srtt / (cc_window(cc) * gain));
+}
+
+void fixed_init(struct cc *cc){
+  cc->cwnd = cc->max_window;
+  cc->ssthresh = cc->max_window;
+}
+
+void fixed_ack(struct cc *cc, long acked, long rtt_sample){
+}
+
+void fixed_loss(struct cc *cc){
+}
+
+void reno_init(struct cc *cc){
+  cc->cwnd = INITCWND;
+  cc->ssthresh = cc->max_window;
+}
+
+void reno_ack(struct cc *cc, long acked, long rtt_sample){
+  // one packet per ACKed packet in slow start, one packet per window afterwards
+  if(cc->cwnd < cc->ssthresh)
+    cc->cwnd += acked;
+  else
+    cc->cwnd += (double)acked / cc->cwnd;
+  if(cc->cwnd > cc->max_window)
+    cc->cwnd = cc->max_window;
+}
+
+void reno_loss(struct cc *cc){
+  cc->ssthresh = cc->cwnd / 2;
+  if(cc->ssthresh < MINSSTHRESH)
+    cc->ssthresh = MINSSTHRESH;
+  cc->cwnd = cc->ssthresh;
+}
+
+void reno_timeout(struct cc *cc){
+  cc->ssthresh = cc->cwnd / 2;
+  if(cc->ssthresh < MINSSTHRESH)
+    cc->ssthresh = MINSSTHRESH;
+  cc->cwnd = 1;
+}
+
+void vegas_ack(struct cc *cc, long acked, long rtt_sample){
+  // diff estimates how many of our packets sit in queues: cwnd * (1 - base_rtt / rtt)
+  double diff;
+  if(cc->last_rtt == 0 || cc->base_rtt == 0){
+    reno_ack(cc, acked, rtt_sample);
+    return;
+  }
+  diff = cc->cwnd * (1.0 - (double)cc->base_rtt / cc->last_rtt);
+  if(cc->cwnd < cc->ssthresh){
+    if(diff > VEGAS_GAMMA) // queues start to build, leave slow start
+      cc->ssthresh = cc->cwnd;
+    else
+      cc->cwnd += acked;
+  }
+  else if(diff < VEGAS_ALPHA)
+    cc->cwnd += (double)acked / cc->cwnd;
+  else if(diff > VEGAS_BETA)
+    cc->cwnd -= (double)acked / cc->cwnd;
+  if(cc->cwnd < 1)
+    cc->cwnd = 1;
+  if(cc->cwnd > cc->max_window)
+    cc->cwnd = cc->max_window;
+}
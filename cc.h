@@ -0,0 +1,36 @@
+/*
+  cc.h
+  Congestion Control for the Sender
+*/
+
+#ifndef CC_H
+#define CC_H
+
+// congestion controller state, windows are counted in packets and times in microseconds
+struct cc {
+  const struct cc_ops *ops;
+  double cwnd; // congestion window
+  double ssthresh; // slow start threshold
+  long max_window; // window N given on the command line, cwnd never exceeds it
+  long base_rtt; // smallest RTT seen, used by delay based controllers
+  long last_rtt; // latest RTT sample
+};
+
+// a congestion control algorithm, selected by name with -c
+struct cc_ops {
+  const char *name;
+  void (*init)(struct cc *cc);
+  void (*on_ack)(struct cc *cc, long acked, long rtt_sample); // acked packets left the network, rtt_sample is 0 if there is none
+  void (*on_loss)(struct cc *cc); // a single packet was lost while others still arrive
+  void (*on_timeout)(struct cc *cc); // nothing arrived for a whole retransmission timeout
+};
+
+const struct cc_ops *cc_find(const char *name);
+void cc_init(struct cc *cc, const struct cc_ops *ops, long max_window);
+void cc_ack(struct cc *cc, long acked, long rtt_sample);
+void cc_loss(struct cc *cc);
+void cc_timeout(struct cc *cc);
+long cc_window(struct cc *cc);
+long cc_pacing_gap(struct cc *cc, long srtt);
+
+#endif
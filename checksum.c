@@ -0,0 +1,210 @@
+/*
+  checksum.c
+  Packet Checksums and the File Digest
+*/
+
+#include <string.h>
+#include "checksum.h"
+
+// CRC-32C (Castagnoli) polynomial, reflected
+#define CRC32C_POLY 0x82f63b78
+
+// XXH64 primes
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, long size);
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, long size);
+uint64_t xxh64_round(uint64_t acc, uint64_t input);
+uint64_t xxh64_merge(uint64_t acc, uint64_t value);
+uint64_t read64(const unsigned char *p);
+uint32_t read32(const unsigned char *p);
+
+// slicing by 8 tables for the portable path, filled on first use
+uint32_t crc_tables[8][256];
+int crc_ready = 0;
+
+// the implementation picked for this CPU
+uint32_t (*crc_impl)(uint32_t crc, const unsigned char *p, long size) = NULL;
+
+uint32_t crc32c(const void *data, long size){
+  // checksum of size bytes, the SSE4.2 instruction is used when the CPU has it
+  return crc32c_extend(0, data, size);
+}
+
+uint32_t crc32c_extend(uint32_t crc, const void *data, long size){
+  // checksum of the bytes crc is the checksum of followed by size more bytes, so the parts of
+  // a packet need not be next to each other
+  if(crc_impl == NULL){
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2"))
+      crc_impl = crc32c_sse42;
+    else
+#endif
+      crc_impl = crc32c_table;
+  }
+  return ~crc_impl(~crc, data, size);
+}
+
+const char *crc32c_impl(){
+  // name of the implementation in use, for the benchmark
+  crc32c("", 0);
+  return crc_impl == crc32c_table ? "table" : "sse4.2";
+}
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, long size){
+  // portable slicing by 8, eight table lookups per 8 bytes
+  uint32_t c;
+  uint64_t word;
+  int i;
+  int k;
+  if(!crc_ready){
+    for(i=0; i<256; i++){
+      c = i;
+      for(k=0; k<8; k++)
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      crc_tables[0][i] = c;
+    }
+    for(i=0; i<256; i++)
+      for(k=1; k<8; k++)
+        crc_tables[k][i] = (crc_tables[k-1][i] >> 8) ^ crc_tables[0][crc_tables[k-1][i] & 0xff];
+    crc_ready = 1;
+  }
+  for(; size >= 8; size -= 8, p += 8){
+    word = read64(p) ^ crc;
+    crc = crc_tables[7][word & 0xff] ^ crc_tables[6][(word >> 8) & 0xff] ^
+          crc_tables[5][(word >> 16) & 0xff] ^ crc_tables[4][(word >> 24) & 0xff] ^
+          crc_tables[3][(word >> 32) & 0xff] ^ crc_tables[2][(word >> 40) & 0xff] ^
+          crc_tables[1][(word >> 48) & 0xff] ^ crc_tables[0][word >> 56];
+  }
+  for(; size > 0; size--, p++)
+    crc = (crc >> 8) ^ crc_tables[0][(crc ^ *p) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, long size){
+  // one crc32 instruction per 8 bytes
+  uint64_t c = crc;
+  for(; size >= 8; size -= 8, p += 8)
+    c = __builtin_ia32_crc32di(c, read64(p));
+  crc = c;
+  for(; size > 0; size--, p++)
+    crc = __builtin_ia32_crc32qi(crc, *p);
+  return crc;
+}
+#else
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, long size){
+  return crc32c_table(crc, p, size);
+}
+#endif
+
+void digest_init(struct digest *d){
+  // XXH64 with seed 0
+  d->acc[0] = PRIME64_1 + PRIME64_2;
+  d->acc[1] = PRIME64_2;
+  d->acc[2] = 0;
+  d->acc[3] = -PRIME64_1;
+  d->total = 0;
+  d->used = 0;
+}
+
+void digest_update(struct digest *d, const void *data, long size){
+  // hashes 32 byte stripes as they complete, the rest waits in the buffer
+  const unsigned char *p = data;
+  int fill;
+  d->total += size;
+  if(d->used > 0){
+    fill = 32 - d->used < size ? 32 - d->used : size;
+    memcpy(d->buffer + d->used, p, fill);
+    d->used += fill;
+    p += fill;
+    size -= fill;
+    if(d->used < 32)
+      return;
+    d->acc[0] = xxh64_round(d->acc[0], read64(d->buffer));
+    d->acc[1] = xxh64_round(d->acc[1], read64(d->buffer+8));
+    d->acc[2] = xxh64_round(d->acc[2], read64(d->buffer+16));
+    d->acc[3] = xxh64_round(d->acc[3], read64(d->buffer+24));
+    d->used = 0;
+  }
+  for(; size >= 32; size -= 32, p += 32){
+    d->acc[0] = xxh64_round(d->acc[0], read64(p));
+    d->acc[1] = xxh64_round(d->acc[1], read64(p+8));
+    d->acc[2] = xxh64_round(d->acc[2], read64(p+16));
+    d->acc[3] = xxh64_round(d->acc[3], read64(p+24));
+  }
+  memcpy(d->buffer, p, size);
+  d->used = size;
+}
+
+uint64_t digest_final(struct digest *d){
+  // folds the accumulators and the buffered tail into the 64 bit digest
+  const unsigned char *p = d->buffer;
+  int left = d->used;
+  uint64_t h;
+  if(d->total >= 32){
+    h = ((d->acc[0] << 1) | (d->acc[0] >> 63)) + ((d->acc[1] << 7) | (d->acc[1] >> 57)) +
+        ((d->acc[2] << 12) | (d->acc[2] >> 52)) + ((d->acc[3] << 18) | (d->acc[3] >> 46));
+    h = xxh64_merge(h, d->acc[0]);
+    h = xxh64_merge(h, d->acc[1]);
+    h = xxh64_merge(h, d->acc[2]);
+    h = xxh64_merge(h, d->acc[3]);
+  }else
+    h = PRIME64_5;
+  h += d->total;
+  for(; left >= 8; left -= 8, p += 8){
+    h ^= xxh64_round(0, read64(p));
+    h = ((h << 27) | (h >> 37)) * PRIME64_1 + PRIME64_4;
+  }
+  if(left >= 4){
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = ((h << 23) | (h >> 41)) * PRIME64_2 + PRIME64_3;
+    left -= 4;
+    p += 4;
+  }
+  for(; left > 0; left--, p++){
+    h ^= *p * PRIME64_5;
+    h = ((h << 11) | (h >> 53)) * PRIME64_1;
+  }
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input){
+  acc += input * PRIME64_2;
+  acc = (acc << 31) | (acc >> 33);
+  return acc * PRIME64_1;
+}
+
+uint64_t xxh64_merge(uint64_t acc, uint64_t value){
+  acc ^= xxh64_round(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t read64(const unsigned char *p){
+  // little endian load, both algorithms are defined on little endian words
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+uint32_t read32(const unsigned char *p){
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
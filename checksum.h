@@ -0,0 +1,26 @@
+/*
+  checksum.h
+  Packet Checksums and the File Digest
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+// streaming XXH64 state, the digest of everything passed to digest_update
+struct digest {
+  uint64_t acc[4];
+  uint64_t total; // bytes hashed so far
+  unsigned char buffer[32]; // input that does not fill a stripe yet
+  int used;
+};
+
+uint32_t crc32c(const void *data, long size);
+uint32_t crc32c_extend(uint32_t crc, const void *data, long size);
+const char *crc32c_impl();
+void digest_init(struct digest *d);
+void digest_update(struct digest *d, const void *data, long size);
+uint64_t digest_final(struct digest *d);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+  compress.c
+  Block Compression of the Data Stream
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "compress.h"
+
+/*
+  Blocks are compressed in the LZ4 block format: a sequence of a token (the
+  literal length in its high nibble, the match length minus 4 in its low
+  nibble, 15 meaning more length bytes follow), the literals, a 16 bit little
+  endian offset back to the match and the extra match length bytes. The last
+  sequence has literals only. The compressor is the greedy single hash table
+  search of the reference implementation.
+*/
+#define MINMATCH 4
+#define LASTLITERALS 5 // the last bytes of a block are always literals
+#define MFLIMIT 12 // no match starts closer to the end
+#define MAXOFFSET 65535
+#define HASHLOG 12
+#define SAMPLES 4096 // bytes looked at to guess if a block is compressible
+#define MAXENTROPY 7.5 // bits per byte above which a block is sent as it is
+
+uint32_t read32le(const unsigned char *p);
+int put_length(unsigned char *dst, int op, int cap, int len);
+
+long compress_chunks(long datasize){
+  // chunks per compressed block, 0 if the chunks are too small to carry pieces
+  long chunks = COMPRESSBLOCK / datasize < MAXBLOCKCHUNKS ? COMPRESSBLOCK / datasize : MAXBLOCKCHUNKS;
+  if(datasize <= 2*PIECEHEADER)
+    return 0;
+  return chunks;
+}
+
+int compress_block(const char *src, int size, char *dst, int cap){
+  // compresses size bytes into at most cap bytes and returns the compressed size,
+  // or 0 if the block looks random or would not fit, so that it is sent as it is
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  int table[1 << HASHLOG];
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+  int ref;
+  int literals;
+  int len;
+  int h;
+
+  if(looks_random(src,size))
+    return 0;
+  memset(table, 0, sizeof(table)); // positions are stored plus one, 0 is empty
+  while(ip <= size - MFLIMIT){
+    h = (read32le(in+ip) * 2654435761u) >> (32 - HASHLOG);
+    ref = table[h] - 1;
+    table[h] = ip + 1;
+    if(ref < 0 || ip - ref > MAXOFFSET || read32le(in+ref) != read32le(in+ip)){
+      ip += 1 + ((ip - anchor) >> 6); // skip faster through data that does not match
+      continue;
+    }
+    while(ip > anchor && ref > 0 && in[ip-1] == in[ref-1]){ // extend backwards
+      ip--;
+      ref--;
+    }
+    len = MINMATCH;
+    while(ip + len < size - LASTLITERALS && in[ip+len] == in[ref+len])
+      len++;
+
+    // token, literals, offset and match length
+    literals = ip - anchor;
+    if(op + 1 + literals/255 + 1 + literals + 2 + (len-MINMATCH)/255 + 1 > cap)
+      return 0;
+    out[op++] = ((literals < 15 ? literals : 15) << 4) | (len-MINMATCH < 15 ? len-MINMATCH : 15);
+    if(literals >= 15)
+      op = put_length(out, op, cap, literals - 15);
+    memcpy(out+op, in+anchor, literals);
+    op += literals;
+    out[op++] = (ip - ref) & 0xff;
+    out[op++] = (ip - ref) >> 8;
+    if(len - MINMATCH >= 15)
+      op = put_length(out, op, cap, len - MINMATCH - 15);
+    ip += len;
+    anchor = ip;
+  }
+
+  // the rest of the block as literals
+  literals = size - anchor;
+  if(op + 1 + literals/255 + 1 + literals > cap)
+    return 0;
+  out[op++] = (literals < 15 ? literals : 15) << 4;
+  if(literals >= 15)
+    op = put_length(out, op, cap, literals - 15);
+  memcpy(out+op, in+anchor, literals);
+  return op + literals;
+}
+
+int decompress_block(const char *src, int size, char *dst, int cap){
+  // expands a compressed block into at most cap bytes, returns its size or -1 if it is malformed
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  int ip = 0;
+  int op = 0;
+  int token;
+  int len;
+  int offset;
+  int b;
+
+  while(ip < size){
+    token = in[ip++];
+    len = token >> 4;
+    if(len == 15)
+      do{
+        if(ip >= size)
+          return -1;
+        b = in[ip++];
+        len += b;
+      }while(b == 255);
+    if(len > size - ip || len > cap - op)
+      return -1;
+    memcpy(out+op, in+ip, len);
+    ip += len;
+    op += len;
+    if(ip == size) // the last sequence has no match
+      break;
+    if(ip + 2 > size)
+      return -1;
+    offset = in[ip] | (in[ip+1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > op)
+      return -1;
+    len = token & 0x0f;
+    if(len == 15)
+      do{
+        if(ip >= size)
+          return -1;
+        b = in[ip++];
+        len += b;
+      }while(b == 255);
+    len += MINMATCH;
+    if(len > cap - op)
+      return -1;
+    for(; len>0; len--, op++) // the match may overlap what it copies
+      out[op] = out[op-offset];
+  }
+  return op;
+}
+
+int looks_random(const char *src, int size){
+  // estimates the entropy of the block from an even sample of its bytes, already compressed
+  // media and encrypted data come close to 8 bits per byte and are not worth compressing
+  int count[256];
+  int step = size / SAMPLES > 0 ? size / SAMPLES : 1;
+  int n = 0;
+  double entropy = 0;
+  double p;
+  int i;
+  memset(count, 0, sizeof(count));
+  for(i=0; i<size; i+=step, n++)
+    count[(unsigned char)src[i]]++;
+  for(i=0; i<256; i++){
+    if(count[i] == 0)
+      continue;
+    p = (double)count[i] / n;
+    entropy -= p * log2(p);
+  }
+  return n >= 256 && entropy > MAXENTROPY;
+}
+
+uint32_t read32le(const unsigned char *p){
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int put_length(unsigned char *dst, int op, int cap, int len){
+  // writes the extra length bytes of a literal run or a match
+  for(; len >= 255 && op < cap; len -= 255)
+    dst[op++] = 255;
+  if(op < cap)
+    dst[op++] = len;
+  return op;
+}
@@ -0,0 +1,19 @@
+/*
+  compress.h
+  Block Compression of the Data Stream
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// constant values
+#define COMPRESSBLOCK 65536 // bytes compressed together, split across the packets of their chunks
+#define MAXBLOCKCHUNKS 64 // most chunks per compressed block
+#define PIECEHEADER 4 // compressed size of the block in front of every piece
+
+long compress_chunks(long datasize);
+int compress_block(const char *src, int size, char *dst, int cap);
+int decompress_block(const char *src, int size, char *dst, int cap);
+int looks_random(const char *src, int size);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+  daemon.c
+  Multi-Session Receiver Daemon
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/socket.h>
+#include "packet.h"
+#include "batch.h"
+#include "daemon.h"
+#include "resume.h"
+#include "checksum.h"
+#include "archive.h"
+#include "writer.h"
+#include "metrics.h"
+#include "ack.h"
+#include "event.h"
+
+// output file shared by the streams of one transfer
+struct output {
+  int fd;
+  long filesize;
+  int writers; // sessions still writing to the file
+  int refs; // sessions not reaped yet
+  char name[NAMESIZE+16];
+  char part[NAMESIZE+24]; // partial file, empty if the transfer of a file cannot be resumed
+  struct archive *archive; // extraction of a directory into name, NULL for a file
+  struct resume resume;
+  struct initack ack; // repeated if INIT comes again
+  struct digest digest; // fed while chunks arrive in file order
+  long digest_pos;
+  uint64_t expected; // digest of the complete file
+  int digested; // set by the writer thread once expected is known and the file is closed
+  int verdict; // -1 until FIN is checked, then 1 if the digest matched
+};
+
+// receive state of one stream, found by sender address and session id
+struct session {
+  uint32_t id;
+  struct sockaddr_in address; // latest source of the session's packets, ACKs go there
+  int mode;
+  int selective;
+  long datasize;
+  long first; // index of the first chunk of the stream in the file
+  long total_packets;
+  long req_num; // smallest sequence number not received yet
+  long *slot_seq; // selective repeat, sequence number received in each window slot
+  long highest; // selective repeat, highest sequence number held in the window
+  struct acker acker; // go-back-n and selective repeat, when the sender is owed an ACK
+  struct output *out;
+  int done; // every packet is written, only retransmissions are answered
+  long expires; // idle or linger deadline in microseconds
+  struct timer timer; // at expires, or sooner when the last ACK is to be repeated, see session_timer
+  int owing; // received packets no ACK covered yet, the session is in the owing list
+  struct session *next_owing;
+  struct session *next;
+};
+
+// shared with receiver.c
+void error (char *e);
+int open_output(const char *filename, long filesize, int keep);
+void write_packet(struct writer *w, int fd, long offset, const char *data, int size, long filesize, long chunk, void *context);
+void close_output(int fd, long filesize);
+int make_ack(char *buffer, uint32_t session, long seq_num);
+void digest_written(struct digest *d, long *pos, long offset, const char *data, int size, long filesize, struct archive *a);
+uint64_t digest_output(int fd, struct digest *d, long pos, long filesize, struct archive *a);
+extern struct writer writer;
+extern struct events events;
+extern int ack_every;
+
+struct session **find_session(struct sockaddr_in *address, uint32_t id);
+void start_session(int sock, struct sockaddr_in *address, const char *packet, int size, int mode, int selective);
+void session_data(int sock, struct session *s, struct header *h, const char *packet);
+void session_store(struct session *s, long seq_num, const char *data, int size);
+void session_ack(int sock, struct session *s, int repeat);
+void owed_acks(int sock);
+void session_timer(struct session *s);
+void session_expired(int sock, struct session *s);
+void session_written(struct write_request *r);
+void queue_mark(struct output *out, int fd, int mark);
+void finish_session(struct session *s);
+void session_fin(int sock, struct session *s, struct header *h, const char *packet);
+void linger_streams(struct sockaddr_in *address, uint32_t id, int streams);
+void release_output(struct output *out);
+void reap_session(struct session *s);
+
+struct session *sessions[SESSIONBUCKETS];
+struct session *owing = NULL; // sessions that owe their sender an ACK once the batch is read
+int active = 0;
+int daemon_port; // announced as the port of every stream
+
+void serve(int sock, int mode, int selective, struct in_addr *allowed){
+  // serves any number of transfers on one socket until the process is killed, mode 0 accepts any mode
+  struct session **s;
+  struct timer *t;
+  struct header h;
+  struct sigblock sb;
+  char *packet;
+  int ready;
+  int count;
+  int size;
+  int k;
+  struct sockaddr_in address;
+  socklen_t len = sizeof(address);
+  int bufsize = SOCKBUFSIZE;
+
+  if(getsockname(sock, (struct sockaddr *) &address, &len) < 0)
+    error("Cannot read socket address");
+  daemon_port = ntohs(address.sin_port);
+
+  // one socket queues the packets of every session
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  // the timers of every session share one wheel, so a wake up only touches the sessions that are due
+  event_open(&events,sock);
+
+  // the log of a long running process is read while it runs
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  // sessions negotiate their own chunk size, the buffers fit the largest
+  batch_init(MAXPACKETSIZE);
+  writer_start(&writer,MAXDATASIZE,session_written); // one writer serves every session
+  printf("Waiting for senders\n");
+
+  while(1){
+    // sleep until a packet arrives or the earliest session timer expires
+    ready = event_wait(&events);
+
+    count = ready & EVENTREAD ? batch_receive(sock) : 0;
+    for(k=0; k<count; k++){
+      packet = recv_batch[k];
+      size = recv_size[k];
+      if(demult(packet,size,&h) < 0)
+        continue;
+      if(allowed != NULL && recv_addr[k].sin_addr.s_addr != allowed->s_addr)
+        continue; // only the designated host is served
+      if(h.type == PROBE){
+        // tell the sender which size arrived, the answer itself stays small
+        h.len = 0;
+        h.seq_num = size;
+        size = mult(batch_buffer(),&h,NULL);
+        batch_queue(sock,&recv_addr[k],size);
+        continue;
+      }
+      if(h.type == SIGNATURE){
+        // the daemon keeps no copies to build a delta against, so the sender sends the whole file
+        sb.blocksize = 0;
+        sb.blocks = 0;
+        sb.count = 0;
+        h.flags = 0;
+        size = mult_sigblock(batch_buffer(),&h,&sb);
+        batch_queue(sock,&recv_addr[k],size);
+        continue;
+      }
+      if(h.type == INIT){
+        start_session(sock,&recv_addr[k],packet,size,mode,selective);
+        continue;
+      }
+      if(h.type != DATA && h.type != FIN)
+        continue;
+      s = find_session(&recv_addr[k],h.session);
+      if(*s == NULL) // not ours, or already reaped
+        continue;
+      (*s)->address = recv_addr[k];
+      if(h.type == FIN)
+        session_fin(sock,*s,&h,packet);
+      else
+        session_data(sock,*s,&h,packet);
+    }
+    owed_acks(sock);
+    while((t = timer_expired(&events)) != NULL)
+      session_expired(sock,(struct session *)((char *)t - offsetof(struct session, timer)));
+    batch_flush(sock); // the ACKs of every session leave together
+  }
+}
+
+struct session **find_session(struct sockaddr_in *address, uint32_t id){
+  // returns the link that points to the session, or to the NULL at the end of its bucket
+  struct session **s = &sessions[(address->sin_addr.s_addr ^ id) % SESSIONBUCKETS];
+  while(*s != NULL && ((*s)->id != id || (*s)->address.sin_addr.s_addr != address->sin_addr.s_addr))
+    s = &(*s)->next;
+  return s;
+}
+
+void start_session(int sock, struct sockaddr_in *address, const char *packet, int size, int mode, int selective){
+  // creates the sessions of a new transfer, or repeats the ACK of an INIT whose ACK was lost
+  struct header h;
+  struct init in;
+  struct output *out;
+  struct session **link;
+  struct session *s;
+  long total_packets;
+  long datasize;
+  long first;
+  long last;
+  int streams;
+  int resumed;
+  int i;
+
+  if(demult(packet,size,&h) < 0 || demult_init(packet,&h,&in) < 0 || in.datasize < 1 || in.window < 1)
+    return;
+  if(mode > 0 && (in.window != mode || ((h.flags & SRMODE) != 0) != selective)){
+    printf("%08x Incompatible modes!\n",h.session);
+    return;
+  }
+  if(!safe_path(in.filename)){ // a name from the network must not reach outside the working directory
+    printf("%08x Unsafe file name %s!\n",h.session,in.filename);
+    h.type = ACK;
+    h.flags = REFUSED;
+    h.len = 0;
+    size = mult(batch_buffer(),&h,NULL);
+    batch_queue(sock,address,size);
+    return;
+  }
+
+  // a repeated INIT gets the same answer, its ACK was lost
+  link = find_session(address,h.session);
+  if(*link != NULL){
+    if(in.window > 1 || (h.flags & SRMODE))
+      h.seq_num = 1;
+    h.flags = 0;
+    size = mult_initack(batch_buffer(),&h,&(*link)->out->ack);
+    batch_queue(sock,address,size);
+    return;
+  }
+
+  // same negotiation as a single transfer, every stream shares this socket
+  out = malloc(sizeof(struct output));
+  if(out == NULL)
+    error("Cannot create session!");
+  datasize = in.datasize < MAXDATASIZE ? in.datasize : MAXDATASIZE;
+  snprintf(out->name,sizeof(out->name),"%s%u",in.filename,h.session);
+  snprintf(out->part,sizeof(out->part),"%s.part",in.filename);
+  resumed = resume_open(&out->resume,out->part,in.filesize,in.mtime,&datasize);
+  if(resumed < 0 && (h.flags & ARCHIVE)) // another transfer of the same tree is running
+    snprintf(out->part,sizeof(out->part),"%s.archive",out->name);
+  if(resumed < 0 && !(h.flags & ARCHIVE)){ // another transfer of the same file is running
+    out->part[0] = '\0';
+    out->fd = open_output(out->name,in.filesize,0);
+  }else
+    out->fd = open_output(out->part,in.filesize,resumed > 0);
+  out->archive = (h.flags & ARCHIVE) ? archive_extract(out->name) : NULL;
+  out->resume.data_fd = out->fd;
+  out->filesize = in.filesize;
+  digest_init(&out->digest);
+  out->digest_pos = 0;
+  out->verdict = -1;
+  out->digested = 0;
+  if(resumed > 0)
+    resume_missing(&out->resume,&out->ack.missing);
+  else
+    ranges_all(&out->ack.missing,(long)ceil((double)in.filesize/(double)datasize));
+  total_packets = ranges_total(&out->ack.missing);
+
+  streams = in.streams;
+  if(streams > MAXSTREAMS)
+    streams = MAXSTREAMS;
+  if(streams > total_packets)
+    streams = total_packets;
+  if(streams < 1)
+    streams = 1;
+  out->writers = streams;
+  out->refs = streams;
+
+  // the ACK of INIT, every stream is sent to the daemon port
+  out->ack.datasize = datasize;
+  out->ack.streams = streams;
+  for(i=0; i<streams; i++)
+    out->ack.ports[i] = daemon_port;
+
+  for(i=0; i<streams; i++){
+    first = total_packets*i/streams;
+    last = total_packets*(i+1)/streams;
+    s = calloc(1, sizeof(struct session));
+    if(s == NULL)
+      error("Cannot create session!");
+    s->id = h.session + i;
+    s->address = *address;
+    s->mode = in.window;
+    s->selective = (h.flags & SRMODE) != 0;
+    s->datasize = datasize;
+    s->first = first;
+    s->total_packets = last - first;
+    s->req_num = 1;
+    s->out = out;
+    s->expires = event_usec() + IDLETIMEOUT;
+    ack_init(&s->acker,ack_every,s->mode);
+    session_timer(s);
+    if(s->selective){
+      s->slot_seq = calloc(s->mode, sizeof(long));
+      if(s->slot_seq == NULL)
+        error("Cannot create window!");
+    }
+    link = find_session(address,s->id);
+    s->next = *link;
+    *link = s;
+    active++;
+  }
+  printf("%08x <- INIT %s, %ld BYTES, %ld PACKETS, %d STREAMS, %d ACTIVE\n",h.session,in.filename,in.filesize,total_packets,streams,active);
+
+  if(in.window > 1 || (h.flags & SRMODE)) // the receiver requests the first packet
+    h.seq_num = 1;
+  h.flags = 0;
+  size = mult_initack(batch_buffer(),&h,&out->ack);
+  batch_queue(sock,address,size);
+
+  // streams without packets are done right away
+  for(i=0; i<streams; i++){
+    s = *find_session(address,h.session + i);
+    if(s->total_packets == 0)
+      finish_session(s);
+  }
+}
+
+void session_data(int sock, struct session *s, struct header *h, const char *packet){
+  // handles a DATA packet of the session, stop and wait and finished sessions answer it at once, the others
+  // leave their ACK to owed_acks unless the sender must hear of it now
+  long seq_num = h->seq_num;
+  long before = s->req_num;
+  long ack_num;
+  int size;
+
+  if(s->done){ // the ACK was lost, answer the retransmission
+    if(seq_num < 1 || seq_num > s->total_packets)
+      return;
+    metric_add(DUPPACKETS,1);
+    ack_num = (s->mode > 1 && !s->selective) ? s->total_packets + 1 : seq_num;
+    s->expires = event_usec() + LINGERTIME;
+    session_timer(s);
+  }
+  else if(s->selective){
+    if(seq_num >= s->req_num && seq_num < s->req_num+s->mode && seq_num <= s->total_packets){ // inside the window
+      if(s->slot_seq[seq_num%s->mode] != seq_num){ // not a duplicate
+        s->slot_seq[seq_num%s->mode] = seq_num;
+        if(seq_num > s->highest)
+          s->highest = seq_num;
+        session_store(s,seq_num,packet+HEADERSIZE,h->len);
+      }
+      else
+        metric_add(DUPPACKETS,1);
+      while(s->req_num <= s->total_packets && s->slot_seq[s->req_num%s->mode] == s->req_num)
+        s->req_num++;
+    }
+    else if(seq_num < s->req_num-s->mode || seq_num >= s->req_num) // outside the window and not a lost ACK
+      return;
+    else
+      metric_add(DUPPACKETS,1);
+    ack_answered(&s->acker);
+    ack_num = -1;
+    s->expires = event_usec() + IDLETIMEOUT; // a later deadline, the timer moves when it fires
+  }
+  else{ // go-back-n and stop and wait accept packets in order only
+    if(seq_num == s->req_num){
+      session_store(s,seq_num,packet+HEADERSIZE,h->len);
+      s->req_num++;
+    }
+    else if(seq_num >= 1 && seq_num < s->req_num)
+      metric_add(DUPPACKETS,1);
+    if(s->mode == 1){ // stop and wait acknowledges the packet itself
+      if(seq_num >= s->req_num)
+        return;
+      ack_num = seq_num;
+    }else{
+      ack_answered(&s->acker);
+      ack_num = -1;
+    }
+    s->expires = event_usec() + IDLETIMEOUT; // a later deadline, the timer moves when it fires
+  }
+
+  if(ack_num >= 0){
+    size = make_ack(batch_buffer(),s->id,ack_num);
+    batch_queue(sock,&s->address,size);
+  }
+  else if(ack_packet(&s->acker,s->req_num-before,s->req_num > s->total_packets))
+    session_ack(sock,s,0);
+  else if(!s->owing){
+    s->owing = 1;
+    s->next_owing = owing;
+    owing = s;
+  }
+  if(!s->done && s->req_num > s->total_packets)
+    finish_session(s);
+}
+
+void session_store(struct session *s, long seq_num, const char *data, int size){
+  // writes the payload of a DATA packet of the session to its chunk and records it in the bitmap
+  struct output *out = s->out;
+  long chunk = ranges_chunk(&out->ack.missing,s->first+seq_num-1);
+  write_packet(&writer,out->fd,chunk*s->datasize,data,size,out->filesize,chunk,out);
+}
+
+void session_ack(int sock, struct session *s, int repeat){
+  // queues a CUMULATIVE ACK, go-back-n keeps no packets after a gap so it lists no ranges
+  int size = make_sack(batch_buffer(),s->id,s->req_num,s->slot_seq,s->mode,s->selective ? s->highest : 0);
+  batch_queue(sock,&s->address,size);
+  ack_sent(&s->acker,repeat);
+  session_timer(s);
+}
+
+void session_written(struct write_request *r){
+  // runs on the writer thread once a chunk is in the file of its output, or every chunk before a mark,
+  // so the loop never waits for the disk to read back, close or free an output
+  struct output *out = r->context;
+  if(r->chunks == 0 && r->chunk == MARKDIGEST){
+    out->expected = digest_output(r->fd,&out->digest,out->digest_pos,out->filesize,out->archive);
+    close_output(r->fd,out->filesize);
+    __atomic_store_n(&out->digested, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if(r->chunks == 0 && r->chunk == MARKCLOSE){
+    resume_close(&out->resume);
+    if(r->fd >= 0)
+      close(r->fd);
+    return;
+  }
+  if(r->chunks == 0 && r->chunk == MARKFREE){ // a tree that was not completed is extracted again next time
+    if(out->archive != NULL){
+      if(out->verdict != 1)
+        archive_remove(out->name);
+      archive_close(out->archive);
+      free(out->archive);
+    }
+    free(out);
+    return;
+  }
+  metric_add(GOODBYTES,r->size);
+  digest_written(&out->digest,&out->digest_pos,r->offset,r->data,r->size,out->filesize,out->archive);
+  resume_mark(&out->resume,r->chunk);
+}
+
+void finish_session(struct session *s){
+  // every packet is written, the session waits for FIN and answers retransmissions whose ACK was lost
+  struct output *out = s->out;
+  s->done = 1;
+  s->expires = event_usec() + IDLETIMEOUT;
+  printf("%08x Transmission complete\n",s->id);
+  if(--out->writers > 0)
+    return;
+  queue_mark(out,out->fd,MARKDIGEST);
+  out->fd = -1;
+}
+
+void queue_mark(struct output *out, int fd, int mark){
+  // leaves work on the output to the writer thread, behind every write queued for it so far
+  writer_buffer(&writer);
+  writer_queue(&writer,fd,out->filesize,0,mark,0,out);
+}
+
+void session_fin(int sock, struct session *s, struct header *h, const char *packet){
+  // checks the file against the digest in FIN once every stream is done and answers with the result
+  struct output *out = s->out;
+  uint64_t received;
+  int size;
+  if(out->writers > 0 || !__atomic_load_n(&out->digested, __ATOMIC_SEQ_CST) || demult_fin(packet,h,&received) < 0)
+    return; // the sender repeats FIN until the digest is known
+  if(out->verdict < 0){
+    out->verdict = received == out->expected && (out->archive == NULL || archive_finish(out->archive) == 0);
+    if(!out->verdict){ // a file that does not match is of no use for a later attempt either
+      unlink(out->part[0] != '\0' ? out->part : out->name);
+      if(out->archive != NULL)
+        archive_remove(out->name);
+      printf("%08x File digest mismatch!\n",s->id);
+    }
+    else if(out->archive != NULL){ // the tree was extracted while its stream arrived
+      unlink(out->part);
+      printf("%08x %s extracted\n",s->id,out->name);
+    }
+    else if(out->part[0] != '\0' && rename(out->part,out->name) < 0)
+      printf("%08x Cannot rename file\n",s->id);
+    else
+      printf("%08x %s written\n",s->id,out->name);
+    resume_finish(&out->resume);
+    linger_streams(&s->address,s->id,out->ack.streams);
+  }
+  h->flags = out->verdict ? 0 : BADDIGEST;
+  h->len = 0;
+  size = mult(batch_buffer(),h,NULL);
+  batch_queue(sock,&s->address,size);
+}
+
+void linger_streams(struct sockaddr_in *address, uint32_t id, int streams){
+  // the transfer is over, its sessions only answer retransmissions for a while
+  struct session *s;
+  int i;
+  for(i=0; i<streams; i++)
+    if((s = *find_session(address,id + i)) != NULL){
+      s->expires = event_usec() + LINGERTIME;
+      session_timer(s);
+    }
+}
+
+void release_output(struct output *out){
+  // the writer thread frees the output once no session refers to it and the writes queued for it are done
+  if(--out->refs > 0)
+    return;
+  queue_mark(out,-1,MARKFREE);
+}
+
+void reap_session(struct session *s){
+  // frees a lingering session that is quiet or drops a transfer whose sender went away
+  struct session **link = &sessions[(s->address.sin_addr.s_addr ^ s->id) % SESSIONBUCKETS];
+  if(!s->done){
+    printf("%08x Receiver time out...\n",s->id);
+    if(--s->out->writers == 0){ // the partial file and its bitmap stay for the next attempt
+      queue_mark(s->out,s->out->fd,MARKCLOSE);
+      s->out->fd = -1;
+    }
+  }
+  else if(s->out->writers == 0 && s->out->verdict < 0 && s->out->refs == 1){ // FIN never came, the file stays partial
+    printf("%08x Receiver time out...\n",s->id);
+    queue_mark(s->out,-1,MARKCLOSE);
+  }
+  release_output(s->out);
+  while(*link != s)
+    link = &(*link)->next;
+  *link = s->next;
+  timer_stop(&events,&s->timer);
+  free(s->slot_seq);
+  free(s);
+  active--;
+}
+
+void owed_acks(int sock){
+  // every queued packet is read, the sessions that received some acknowledge the packets they kept quiet about
+  struct session *s;
+  while((s = owing) != NULL){
+    owing = s->next_owing;
+    s->owing = 0;
+    if(!s->done && s->acker.unacked > 0)
+      session_ack(sock,s,0);
+  }
+}
+
+void session_timer(struct session *s){
+  // moves the timer of the session to its deadline, or to when an ACK no packet followed is repeated if that is
+  // sooner, a deadline that only grew is left to session_expired, so a packet costs no timer update
+  long deadline = s->expires;
+  long wait;
+  if(!s->done && (s->mode > 1 || s->selective) && (wait = ack_wait(&s->acker)) >= 0 && event_usec() + wait < deadline)
+    deadline = event_usec() + wait;
+  if(!s->timer.armed || deadline < s->timer.expires)
+    timer_set(&events,&s->timer,deadline);
+}
+
+void session_expired(int sock, struct session *s){
+  // the timer of the session fired, the last ACK is repeated if no packet followed it in time, and the session
+  // is reaped once it is past its deadline
+  if(!s->done && (s->mode > 1 || s->selective) && s->acker.last > 0 && ack_wait(&s->acker) == 0)
+    session_ack(sock,s,1);
+  if(s->expires <= event_usec())
+    reap_session(s);
+  else
+    session_timer(s);
+}
@@ -0,0 +1,24 @@
+/*
+  daemon.h
+  Multi-Session Receiver Daemon
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <netinet/in.h>
+
+// constant values
+#define SESSIONBUCKETS 1024
+#define IDLETIMEOUT 30000000 // microseconds without packets before a session is dropped
+#define LINGERTIME 1000000 // microseconds a finished session keeps answering retransmissions
+#define SOCKBUFSIZE (8*1024*1024) // socket buffer shared by every session, the kernel may cap it
+
+// requests without data that the loop queues behind the writes of an output, the writer thread acts on them
+#define MARKDIGEST 0 // every stream is done, the digest is completed from the file and the file is closed
+#define MARKCLOSE 1 // the transfer was dropped, the partial file and its bitmap stay for the next attempt
+#define MARKFREE 2 // no session refers to the output anymore
+
+void serve(int sock, int mode, int selective, struct in_addr *allowed);
+
+#endif
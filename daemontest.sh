@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+#  daemontest.sh
+#  Concurrent Transfers to One Daemon
+#
+#  usage: ./daemontest.sh <senders> <port>
+#  starts a receiver daemon and that many senders at once in every mode, then compares the copies,
+#  all files are written under a temporary directory that is removed afterwards
+
+senders=${1:-20}
+port=${2:-9300}
+bin=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'kill $daemon 2>/dev/null; rm -rf "$dir"' EXIT
+
+cd "$dir" || exit 1
+"$bin/receiver" -p "$port" -d > d.log 2>&1 &
+daemon=$!
+sleep 0.3
+
+set -- "-m 1" "-m 8" "-m sr:16" "-m 4 -j 3" "-m sr:8 -j 4 -s 3000" "-m 1 -j 2"
+pids=""
+i=1
+while [ $i -le "$senders" ]; do
+  head -c $((i * 97531 % 2000000)) /dev/urandom > src$i.bin
+  eval "mode=\${$((i % 6 + 1))}"
+  timeout 90 "$bin/sender" -p "$port" -h 127.0.0.1 -f src$i.bin $mode > s$i.log 2>&1 &
+  pids="$pids $!"
+  i=$((i + 1))
+done
+wait $pids
+sleep 1.5
+
+failed=0
+i=1
+while [ $i -le "$senders" ]; do
+  copy=$(ls src$i.bin[0-9]* 2>/dev/null | head -n 1)
+  if [ -z "$copy" ] || ! cmp -s src$i.bin "$copy"; then
+    echo "FAILED: sender $i, $(tail -n 1 s$i.log)"
+    failed=1
+  fi
+  i=$((i + 1))
+done
+[ $failed -eq 0 ] && echo "OK: $senders transfers"
+exit $failed
@@ -0,0 +1,367 @@
+/*
+  delta.c
+  Delta Transfers against the Receiver's Copy of a File
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "delta.h"
+#include "checksum.h"
+#include "archive.h"
+
+/*
+  A delta stream starts with the magic, the size of the new file (64 bits),
+  its XXH64 digest (64 bits) and the signature block size (32 bits), all big
+  endian. Records follow until the end of the stream:
+
+    LITERAL  length (32 bits) and that many bytes of the new file
+    COPY     first block of the receiver's copy (64 bits) and the number of
+             consecutive blocks (32 bits)
+*/
+#define HEADERBYTES 28
+#define LITERAL 0
+#define COPY 1
+#define MAXLITERAL (1024*1024) // longest literal record
+#define IOSIZE 65536
+
+// buffered sequential writer of the delta stream
+struct writer {
+  int fd;
+  long total;
+  int used;
+  char buffer[IOSIZE];
+};
+
+void error (char *e);
+uint32_t weak_checksum(const unsigned char *p, long len);
+void put(struct writer *w, const void *data, long len);
+void put_literal(struct writer *w, const char *data, long len);
+void put_copy(struct writer *w, long block, long count);
+void flush_writer(struct writer *w);
+
+long delta_block_size(long filesize){
+  // about sqrt(file size) bytes per block balances the signatures against the literal data of a change
+  long size = (long)sqrt((double)filesize);
+  size = (size + 63) / 64 * 64;
+  if(size < MINBLOCKSIZE)
+    size = MINBLOCKSIZE;
+  if(size > MAXBLOCKSIZE)
+    size = MAXBLOCKSIZE;
+  return size;
+}
+
+int delta_signatures(struct signatures *s, const char *name){
+  // computes the signatures of every full block of the file, returns -1 if there is no such file, the name
+  // comes from the sender, so only regular files below the working directory count
+  struct digest d;
+  struct stat st;
+  char *block;
+  long size;
+  long i;
+  int fd;
+
+  delta_free(s);
+  s->blocksize = 0;
+  strncpy(s->name,name,NAMESIZE);
+  s->name[NAMESIZE] = '\0';
+  if(!safe_path(name))
+    return -1;
+  fd = open(name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+  if(fd < 0)
+    return -1;
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+    close(fd);
+    return -1;
+  }
+  size = st.st_size;
+  s->blocksize = delta_block_size(size);
+  s->blocks = size / s->blocksize;
+  s->weak = malloc((s->blocks+1)*sizeof(uint32_t));
+  s->strong = malloc((s->blocks+1)*sizeof(uint64_t));
+  block = malloc(s->blocksize);
+  if(s->weak == NULL || s->strong == NULL || block == NULL)
+    error("Cannot create signatures!");
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+  for(i=0; i<s->blocks; i++){
+    if(pread(fd, block, s->blocksize, i*s->blocksize) != s->blocksize)
+      error("Cannot read file");
+    s->weak[i] = weak_checksum((unsigned char *)block, s->blocksize);
+    digest_init(&d);
+    digest_update(&d, block, s->blocksize);
+    s->strong[i] = digest_final(&d);
+  }
+  free(block);
+  close(fd);
+  return 0;
+}
+
+void delta_free(struct signatures *s){
+  free(s->weak);
+  free(s->strong);
+  s->weak = NULL;
+  s->strong = NULL;
+  s->blocks = 0;
+}
+
+long delta_encode(int fd, const char *data, long filesize, struct signatures *s){
+  // writes the delta stream of data against the signatures to fd, rsync style: a rolling checksum
+  // finds candidate blocks at every offset and their XXH64 confirms them, returns the stream size
+  struct writer *w;
+  struct digest d;
+  const unsigned char *p = (const unsigned char *)data;
+  long bs = s->blocksize;
+  long buckets = 1;
+  long *head;
+  long *next;
+  long pos = 0;
+  long literal = 0; // start of the bytes not covered by a record yet
+  long run_first = -1; // pending run of consecutive blocks
+  long run_count = 0;
+  long i;
+  long match;
+  int strong_done;
+  uint64_t strong = 0;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint64_t value;
+  uint32_t value32;
+
+  w = malloc(sizeof(struct writer));
+  if(w == NULL)
+    error("Cannot create delta!");
+  w->fd = fd;
+  w->total = 0;
+  w->used = 0;
+
+  // header with the digest of the file the receiver has to end up with
+  digest_init(&d);
+  digest_update(&d, data, filesize);
+  put(w, DELTAMAGIC, 8);
+  value = htobe64(filesize);
+  put(w, &value, sizeof(value));
+  value = htobe64(digest_final(&d));
+  put(w, &value, sizeof(value));
+  value32 = htobe32(bs);
+  put(w, &value32, sizeof(value32));
+
+  // chained hash table of the blocks by rolling checksum
+  while(buckets < 2*s->blocks)
+    buckets *= 2;
+  head = malloc(buckets*sizeof(long));
+  next = malloc((s->blocks+1)*sizeof(long));
+  if(head == NULL || next == NULL)
+    error("Cannot create delta!");
+  for(i=0; i<buckets; i++)
+    head[i] = -1;
+  for(i=s->blocks-1; i>=0; i--){ // chains list lower blocks first
+    next[i] = head[s->weak[i] & (buckets-1)];
+    head[s->weak[i] & (buckets-1)] = i;
+  }
+
+  // a and b are the two halves of the rolling checksum of the window at pos
+  if(filesize >= bs)
+    for(i=0; i<bs; i++){
+      a += p[i];
+      b += (bs - i) * p[i];
+    }
+  while(s->blocks > 0 && pos + bs <= filesize){
+    match = -1;
+    strong_done = 0;
+    for(i=head[((a & 0xffff) | (b << 16)) & (buckets-1)]; i>=0; i=next[i]){
+      if(s->weak[i] != ((a & 0xffff) | (b << 16)))
+        continue;
+      if(!strong_done){
+        digest_init(&d);
+        digest_update(&d, p+pos, bs);
+        strong = digest_final(&d);
+        strong_done = 1;
+      }
+      if(s->strong[i] != strong)
+        continue;
+      if(match < 0 || i == run_first + run_count) // prefer the block that extends the run
+        match = i;
+      if(match == run_first + run_count)
+        break;
+    }
+    if(match >= 0){
+      if(literal < pos || (run_count > 0 && match != run_first + run_count)){
+        put_copy(w, run_first, run_count);
+        run_count = 0;
+      }
+      put_literal(w, data+literal, pos-literal);
+      if(run_count == 0)
+        run_first = match;
+      run_count++;
+      pos += bs;
+      literal = pos;
+      a = 0;
+      b = 0;
+      if(pos + bs <= filesize)
+        for(i=0; i<bs; i++){
+          a += p[pos+i];
+          b += (bs - i) * p[pos+i];
+        }
+      continue;
+    }
+    if(pos + bs >= filesize)
+      break;
+    a += p[pos+bs] - p[pos];
+    b += a - bs*p[pos];
+    pos++;
+  }
+  put_copy(w, run_first, run_count);
+  put_literal(w, data+literal, filesize-literal);
+  flush_writer(w);
+  free(head);
+  free(next);
+  pos = w->total;
+  free(w);
+  return pos;
+}
+
+int delta_apply(int fd, long size, int basis_fd, int out_fd){
+  // rebuilds the new file from the delta stream in fd and the receiver's copy, returns 0 if the
+  // result has the digest recorded in the stream and -1 otherwise
+  struct digest d;
+  char header[HEADERBYTES];
+  char *buffer;
+  long filesize;
+  uint64_t digest;
+  long bs;
+  long offset = HEADERBYTES;
+  long written = 0;
+  long block;
+  long len;
+  long n;
+  uint64_t value;
+  uint32_t value32;
+  unsigned char type;
+  int ok = -1;
+
+  if(size < HEADERBYTES || pread(fd, header, HEADERBYTES, 0) != HEADERBYTES || memcmp(header, DELTAMAGIC, 8) != 0)
+    return -1;
+  memcpy(&value, header+8, sizeof(value));
+  filesize = be64toh(value);
+  memcpy(&value, header+16, sizeof(value));
+  digest = be64toh(value);
+  memcpy(&value32, header+24, sizeof(value32));
+  bs = be32toh(value32);
+  if(bs < MINBLOCKSIZE || bs > MAXBLOCKSIZE) // no signatures have such blocks
+    return -1;
+  buffer = malloc(IOSIZE > bs ? IOSIZE : bs);
+  if(buffer == NULL)
+    error("Cannot create delta!");
+  digest_init(&d);
+  if(ftruncate(out_fd, 0) < 0)
+    error("Cannot truncate file");
+
+  while(offset < size){
+    if(pread(fd, &type, 1, offset) != 1)
+      goto done;
+    offset++;
+    if(type == LITERAL){
+      if(pread(fd, &value32, sizeof(value32), offset) != sizeof(value32))
+        goto done;
+      offset += sizeof(value32);
+      len = be32toh(value32);
+      if(len > MAXLITERAL || offset + len > size)
+        goto done;
+      for(; len > 0; len -= n){
+        n = len < IOSIZE ? len : IOSIZE;
+        if(pread(fd, buffer, n, offset) != n || write(out_fd, buffer, n) != n)
+          goto done;
+        digest_update(&d, buffer, n);
+        offset += n;
+        written += n;
+      }
+    }
+    else if(type == COPY){
+      if(pread(fd, &value, sizeof(value), offset) != sizeof(value)
+         || pread(fd, &value32, sizeof(value32), offset+sizeof(value)) != sizeof(value32))
+        goto done;
+      offset += sizeof(value) + sizeof(value32);
+      block = be64toh(value);
+      for(n=be32toh(value32); n>0; n--, block++){
+        if(pread(basis_fd, buffer, bs, block*bs) != bs || write(out_fd, buffer, bs) != bs)
+          goto done;
+        digest_update(&d, buffer, bs);
+        written += bs;
+      }
+    }
+    else
+      goto done;
+  }
+  if(written == filesize && digest_final(&d) == digest)
+    ok = 0;
+done:
+  free(buffer);
+  return ok;
+}
+
+uint32_t weak_checksum(const unsigned char *p, long len){
+  // the rsync rolling checksum, a plain sum and a sum weighted by the distance to the end
+  uint32_t a = 0;
+  uint32_t b = 0;
+  long i;
+  for(i=0; i<len; i++){
+    a += p[i];
+    b += (len - i) * p[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+void put(struct writer *w, const void *data, long len){
+  // appends to the stream through the buffer
+  const char *p = data;
+  long n;
+  while(len > 0){
+    n = IOSIZE - w->used < len ? IOSIZE - w->used : len;
+    memcpy(w->buffer + w->used, p, n);
+    w->used += n;
+    w->total += n;
+    p += n;
+    len -= n;
+    if(w->used == IOSIZE)
+      flush_writer(w);
+  }
+}
+
+void put_literal(struct writer *w, const char *data, long len){
+  // bytes of the new file that no block of the receiver's copy matched
+  unsigned char type = LITERAL;
+  uint32_t value32;
+  long n;
+  while(len > 0){
+    n = len < MAXLITERAL ? len : MAXLITERAL;
+    value32 = htobe32(n);
+    put(w, &type, 1);
+    put(w, &value32, sizeof(value32));
+    put(w, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+void put_copy(struct writer *w, long block, long count){
+  // a run of consecutive blocks of the receiver's copy
+  unsigned char type = COPY;
+  uint64_t value = htobe64(block);
+  uint32_t value32 = htobe32(count);
+  if(count == 0)
+    return;
+  put(w, &type, 1);
+  put(w, &value, sizeof(value));
+  put(w, &value32, sizeof(value32));
+}
+
+void flush_writer(struct writer *w){
+  if(w->used > 0 && write(w->fd, w->buffer, w->used) != w->used)
+    error("Cannot write delta");
+  w->used = 0;
+}
@@ -0,0 +1,32 @@
+/*
+  delta.h
+  Delta Transfers against the Receiver's Copy of a File
+*/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include "packet.h"
+
+// constant values
+#define DELTAMAGIC "UDPFTDLT"
+#define MINBLOCKSIZE 1024 // signature block size bounds, sqrt(file size) in between
+#define MAXBLOCKSIZE (128*1024)
+
+// block signatures of the receiver's copy
+struct signatures {
+  char name[NAMESIZE+1]; // file the signatures were computed for
+  long blocksize;
+  long blocks; // full blocks only, a short last block is never matched
+  uint32_t *weak; // rolling checksum of each block
+  uint64_t *strong; // XXH64 of each block
+};
+
+long delta_block_size(long filesize);
+int delta_signatures(struct signatures *s, const char *name);
+void delta_free(struct signatures *s);
+long delta_encode(int fd, const char *data, long filesize, struct signatures *s);
+int delta_apply(int fd, long size, int basis_fd, int out_fd);
+
+#endif
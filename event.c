@@ -0,0 +1,259 @@
+/*
+  event.c
+  Event Loop with a Hierarchical Timer Wheel
+*/
+
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "event.h"
+
+void error (char *e);
+void timer_link(struct timer **head, struct timer *t);
+void timer_unlink(struct timer *t);
+void wheel_insert(struct events *e, struct timer *t);
+void wheel_cascade(struct events *e, int level, int index);
+void wheel_expire(struct events *e, int index, long now);
+void wheel_advance(struct events *e, long now);
+int wheel_next_slot(struct events *e, int level, int from);
+long wheel_next_expiry(struct events *e);
+
+void event_open(struct events *e, int sock){
+  // watches sock and a timerfd, the wheel starts at the current tick
+  struct epoll_event ev;
+  memset(e, 0, sizeof(struct events));
+  e->ep = epoll_create1(EPOLL_CLOEXEC);
+  e->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(e->ep < 0 || e->tfd < 0)
+    error("Cannot create event loop");
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if(epoll_ctl(e->ep, EPOLL_CTL_ADD, sock, &ev) < 0)
+    error("Cannot watch socket");
+  ev.data.fd = e->tfd;
+  if(epoll_ctl(e->ep, EPOLL_CTL_ADD, e->tfd, &ev) < 0)
+    error("Cannot watch timer");
+  e->tick = event_usec() >> TICKSHIFT;
+}
+
+void event_close(struct events *e){
+  close(e->tfd);
+  close(e->ep);
+}
+
+int event_wait(struct events *e){
+  // runs until the socket is readable or a timer expires, returns EVENTREAD and EVENTTIMER as they happened,
+  // or 0 when the timerfd only woke the loop to move timers down the wheel
+  struct epoll_event ev[2];
+  struct itimerspec its;
+  uint64_t fired;
+  long next;
+  int ready = 0;
+  int n;
+  int i;
+
+  wheel_advance(e, event_usec());
+  if(e->expired == NULL){
+    // the timerfd keeps the microseconds that the timeout of epoll_wait would round to milliseconds
+    next = wheel_next_expiry(e);
+    if(next != e->armed_at){
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = next / 1000000;
+      its.it_value.tv_nsec = next % 1000000 * 1000;
+      if(timerfd_settime(e->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        error("Cannot set timer");
+      e->armed_at = next;
+    }
+  }
+  n = epoll_wait(e->ep, ev, 2, e->expired != NULL ? 0 : -1);
+  if(n < 0 && errno != EINTR)
+    error("Epoll error");
+  for(i=0; i<n; i++){
+    if(ev[i].data.fd == e->tfd){
+      if(read(e->tfd, &fired, sizeof(fired)) > 0)
+        e->armed_at = 0;
+    }else
+      ready = EVENTREAD;
+  }
+  wheel_advance(e, event_usec());
+  return ready | (e->expired != NULL ? EVENTTIMER : 0);
+}
+
+int event_read(struct events *e, long usec){
+  // waits up to usec microseconds for the socket to become readable, returns 1 if it did and 0 otherwise,
+  // for the exchanges around a transfer that wait for one answer at a time
+  struct timer deadline;
+  int ready = 0;
+  memset(&deadline, 0, sizeof(deadline));
+  timer_set(e, &deadline, event_usec() + usec);
+  while(!ready && deadline.armed)
+    ready = event_wait(e) & EVENTREAD;
+  timer_stop(e, &deadline);
+  return ready;
+}
+
+void timer_set(struct events *e, struct timer *t, long expires){
+  // arms t at expires, or moves it there if it is armed or expired and not handled yet
+  timer_stop(e, t);
+  t->expires = expires;
+  wheel_insert(e, t);
+  e->count++;
+}
+
+void timer_stop(struct events *e, struct timer *t){
+  if(t->armed)
+    e->count--;
+  t->armed = 0;
+  timer_unlink(t);
+}
+
+struct timer *timer_expired(struct events *e){
+  // the next timer that fired, NULL once every one is handled
+  struct timer *t = e->expired;
+  if(t != NULL)
+    timer_unlink(t);
+  return t;
+}
+
+void timer_link(struct timer **head, struct timer *t){
+  t->next = *head;
+  if(t->next != NULL)
+    t->next->link = &t->next;
+  t->link = head;
+  *head = t;
+}
+
+void timer_unlink(struct timer *t){
+  if(t->link == NULL)
+    return;
+  *t->link = t->next;
+  if(t->next != NULL)
+    t->next->link = t->link;
+  t->next = NULL;
+  t->link = NULL;
+}
+
+void wheel_insert(struct events *e, struct timer *t){
+  // a timer goes to the lowest level whose slots still separate it from the current tick, level L covers
+  // 256^(L+1) ticks, so it falls through the levels as the wheel turns, see wheel_cascade, a timer past the end
+  // of the current turn sits in its last level slot of the next turn, at or before the current one
+  long tick = t->expires >> TICKSHIFT;
+  int level;
+  int index;
+  if(tick < e->tick)
+    tick = e->tick;
+  if(tick - e->tick >= 1L << (WHEELBITS*WHEELLEVELS)) // beyond the wheel, it waits in the last slot and is inserted again
+    tick = e->tick + (1L << (WHEELBITS*WHEELLEVELS)) - 1;
+  for(level=0; level<WHEELLEVELS-1; level++)
+    if((tick ^ e->tick) >> (WHEELBITS*(level+1)) == 0)
+      break;
+  index = (tick >> (WHEELBITS*level)) & (WHEELSLOTS-1);
+  timer_link(&e->slots[level][index], t);
+  e->used[level][index/64] |= 1UL << (index%64);
+  t->armed = 1;
+}
+
+void wheel_cascade(struct events *e, int level, int index){
+  // the wheel reached the slot's first tick, its timers move to the levels below
+  struct timer *t;
+  while((t = e->slots[level][index]) != NULL){
+    timer_unlink(t);
+    wheel_insert(e, t);
+  }
+  e->used[level][index/64] &= ~(1UL << (index%64));
+}
+
+void wheel_expire(struct events *e, int index, long now){
+  // timers of the current tick that are due move to the expired list, the others are inserted again
+  struct timer *list = e->slots[0][index];
+  struct timer *t;
+  e->slots[0][index] = NULL;
+  e->used[0][index/64] &= ~(1UL << (index%64));
+  if(list != NULL)
+    list->link = &list;
+  while((t = list) != NULL){
+    timer_unlink(t);
+    if(t->expires <= now){
+      t->armed = 0;
+      e->count--;
+      timer_link(&e->expired, t);
+    }else
+      wheel_insert(e, t);
+  }
+}
+
+void wheel_advance(struct events *e, long now){
+  // processes every tick up to now, empty slots are skipped over with the bitmaps
+  long target = now >> TICKSHIFT;
+  long next;
+  int level;
+  int index;
+  while(1){
+    for(level=WHEELLEVELS-1; level>0; level--)
+      if((e->tick & ((1L << (WHEELBITS*level)) - 1)) == 0)
+        wheel_cascade(e, level, (e->tick >> (WHEELBITS*level)) & (WHEELSLOTS-1));
+    wheel_expire(e, e->tick & (WHEELSLOTS-1), now);
+    if(e->tick >= target)
+      break;
+    index = wheel_next_slot(e, 0, (e->tick & (WHEELSLOTS-1)) + 1);
+    next = index < 0 ? (e->tick | (WHEELSLOTS-1)) + 1 : (e->tick & ~(long)(WHEELSLOTS-1)) + index;
+    e->tick = next < target ? next : target;
+  }
+}
+
+int wheel_next_slot(struct events *e, int level, int from){
+  // first slot at or after from that holds timers, -1 if there is none
+  uint64_t bits;
+  int index;
+  while(from < WHEELSLOTS){
+    bits = e->used[level][from/64] >> (from%64);
+    if(bits == 0){
+      from = (from/64 + 1) * 64;
+      continue;
+    }
+    index = from + __builtin_ctzll(bits);
+    if(e->slots[level][index] != NULL)
+      return index;
+    e->used[level][index/64] &= ~(1UL << (index%64)); // its timers were stopped
+    from = index + 1;
+  }
+  return -1;
+}
+
+long wheel_next_expiry(struct events *e){
+  // time of the earliest timer in the lowest level, or the first tick of the next slot to cascade, 0 if there is none
+  struct timer *t;
+  long earliest = 0;
+  long shift;
+  int level;
+  int index;
+  if(e->count == 0)
+    return 0;
+  index = wheel_next_slot(e, 0, e->tick & (WHEELSLOTS-1));
+  if(index >= 0){
+    for(t=e->slots[0][index]; t!=NULL; t=t->next)
+      if(earliest == 0 || t->expires < earliest)
+        earliest = t->expires;
+    return earliest;
+  }
+  for(level=1; level<WHEELLEVELS; level++){
+    shift = WHEELBITS*level;
+    index = wheel_next_slot(e, level, ((e->tick >> shift) & (WHEELSLOTS-1)) + 1);
+    if(index >= 0)
+      return ((e->tick >> (shift+WHEELBITS) << WHEELBITS | index) << shift) << TICKSHIFT;
+  }
+  shift = WHEELBITS*(WHEELLEVELS-1);
+  index = wheel_next_slot(e, WHEELLEVELS-1, 0); // the slots of the next turn
+  if(index >= 0)
+    return ((((e->tick >> (shift+WHEELBITS)) + 1) << WHEELBITS | index) << shift) << TICKSHIFT;
+  return (e->tick + (1L << (WHEELBITS*WHEELLEVELS)) - 1) << TICKSHIFT; // unreachable while count is right
+}
+
+long event_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
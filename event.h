@@ -0,0 +1,48 @@
+/*
+  event.h
+  Event Loop with a Hierarchical Timer Wheel
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+// constant values
+#define TICKSHIFT 4 // a tick of the wheel is 16 microseconds
+#define WHEELBITS 8
+#define WHEELSLOTS (1 << WHEELBITS)
+#define WHEELLEVELS 3 // 4 ms, 1 s and 268 s of ticks, later timers wait at the end of the last level
+#define EVENTREAD 1 // the socket is readable
+#define EVENTTIMER 2 // timers expired, see timer_expired
+
+// a deadline in microseconds of the monotonic clock, embedded in the state it belongs to
+struct timer {
+  long expires;
+  int armed; // waits in the wheel
+  struct timer *next;
+  struct timer **link; // the pointer that points to it, NULL if it is in no list
+};
+
+// readiness of one socket and the timers of one transfer, woken by a timerfd set to the earliest timer
+struct events {
+  int ep;
+  int tfd;
+  long tick; // every slot before this tick is processed
+  long armed_at; // expiry the timerfd is set to, 0 if it is disarmed
+  int count; // timers in the wheel
+  struct timer *slots[WHEELLEVELS][WHEELSLOTS];
+  uint64_t used[WHEELLEVELS][WHEELSLOTS/64]; // one bit per slot that may hold timers
+  struct timer *expired; // timers that fired and were not handled yet
+};
+
+void event_open(struct events *e, int sock);
+void event_close(struct events *e);
+int event_wait(struct events *e);
+int event_read(struct events *e, long usec);
+void timer_set(struct events *e, struct timer *t, long expires);
+void timer_stop(struct events *e, struct timer *t);
+struct timer *timer_expired(struct events *e);
+long event_usec();
+
+#endif
@@ -0,0 +1,93 @@
+/*
+  eventtest.c
+  Timer Wheel on a Simulated Clock
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event.h"
+
+// constant values
+#define TIMERS 4000
+#define TICK (1L << TICKSHIFT)
+#define TURN (1L << (WHEELBITS*WHEELLEVELS)) // ticks of one turn of the last level
+
+// internals of event.c driven without the timerfd
+void wheel_advance(struct events *e, long now);
+long wheel_next_expiry(struct events *e);
+
+// function definitions
+int run(long start, long *delays, int count);
+void error (char *e);
+
+int main(int argc, char **argv){
+  long delays[TIMERS];
+  long starts[] = {TURN - 10, TURN - 1, 2*TURN - 300, 5*TURN - 70000, 12345};
+  int failed = 0;
+  int i;
+  int k;
+
+  // a few ticks across the turn of the wheel, the case that must not wait for the next turn
+  delays[0] = 15*TICK;
+  for(k=0; k<(int)(sizeof(starts)/sizeof(starts[0])); k++)
+    failed += run(starts[k]*TICK, delays, 1);
+
+  // timers on every level, some beyond the wheel, from starts just before a turn
+  srand(1);
+  for(i=0; i<TIMERS; i++)
+    switch(i % 4){
+      case 0: delays[i] = rand() % (256*TICK); break;
+      case 1: delays[i] = rand() % (65536*TICK); break;
+      case 2: delays[i] = (long)rand() * 4 % (TURN*TICK); break;
+      default: delays[i] = (long)rand() * 64 % (4*TURN*TICK); break;
+    }
+  for(k=0; k<(int)(sizeof(starts)/sizeof(starts[0])); k++)
+    failed += run(starts[k]*TICK, delays, TIMERS);
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed != 0;
+}
+
+int run(long start, long *delays, int count){
+  // arms count timers at start plus delays and moves the clock to every expiry the wheel asks for, every timer
+  // must fire within a tick of its time, and every wake up must expire a timer or move the wheel on
+  struct events *e = calloc(1, sizeof(struct events));
+  struct timer *timers = calloc(count, sizeof(struct timer));
+  struct timer *t;
+  long now = start;
+  long next;
+  long wakeups = 0;
+  int fired = 0;
+  int late = 0;
+  int i;
+
+  if(e == NULL || timers == NULL)
+    error("Cannot create timers");
+  e->tick = start >> TICKSHIFT;
+  for(i=0; i<count; i++)
+    timer_set(e, &timers[i], start + delays[i]);
+  while(fired < count){
+    next = wheel_next_expiry(e);
+    if(next == 0 || ++wakeups > 4L*count + 4096) // no timer to wait for, or the loop spins
+      break;
+    if(next > now)
+      now = next;
+    wheel_advance(e, now);
+    while((t = timer_expired(e)) != NULL){
+      if(now < t->expires || now - t->expires >= TICK)
+        late++;
+      fired++;
+    }
+  }
+  if(fired < count || late > 0)
+    printf("START %ld: %d OF %d TIMERS FIRED, %d NOT WITHIN A TICK, %ld WAKE UPS\n", start, fired, count, late, wakeups);
+  free(timers);
+  free(e);
+  return fired < count || late > 0;
+}
+
+void error (char *e){
+  printf("%s\n",e);
+  exit(1);
+}
@@ -0,0 +1,232 @@
+/*
+  fec.c
+  Forward Error Correction with a Reed-Solomon Code over GF(256)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "fec.h"
+
+// primitive polynomial of the field, x^8 + x^4 + x^3 + x^2 + 1
+#define GFPOLY 0x11d
+
+void error (char *e);
+void gf_init();
+int gf_mul(int a, int b);
+int gf_inv(int a);
+void muladd_table(char *dst, const char *src, int c, long len);
+void muladd_avx2(char *dst, const char *src, int c, long len);
+
+// logarithm and exponent tables, filled on first use
+int gf_log[256];
+int gf_exp[512];
+int gf_ready = 0;
+
+// the region kernel picked for this CPU
+void (*muladd_impl)(char *dst, const char *src, int c, long len) = NULL;
+
+int fec_coefficient(int index, int i){
+  // coefficient of data packet i in repair packet index, a Cauchy matrix whose columns are
+  // scaled so that the first repair packet is the plain XOR of the block
+  gf_init();
+  return gf_mul(gf_inv((MAXBLOCK + index) ^ i), MAXBLOCK ^ i);
+}
+
+void fec_muladd(char *dst, const char *src, int c, long len){
+  // dst += c * src over len bytes, AVX2 multiplies 32 bytes per step when the CPU has it
+  uint64_t a;
+  uint64_t b;
+  long i;
+  if(c == 0)
+    return;
+  if(c == 1){ // addition is XOR, done a word at a time
+    for(i=0; i+8<=len; i+=8){
+      memcpy(&a, dst+i, sizeof(a));
+      memcpy(&b, src+i, sizeof(b));
+      a ^= b;
+      memcpy(dst+i, &a, sizeof(a));
+    }
+    for(; i<len; i++)
+      dst[i] ^= src[i];
+    return;
+  }
+  if(muladd_impl == NULL){
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2"))
+      muladd_impl = muladd_avx2;
+    else
+#endif
+      muladd_impl = muladd_table;
+  }
+  muladd_impl(dst, src, c, len);
+}
+
+void fec_add(struct fec_block *b, long first, int index, const char *data, long len){
+  // keeps a repair packet of the block that starts at first, the slot of an older block is reused
+  int i;
+  if(b->first != first){
+    b->first = first;
+    b->count = 0;
+  }
+  for(i=0; i<b->count; i++)
+    if(b->index[i] == index) // a duplicate
+      return;
+  if(b->count == MAXREPAIR)
+    return;
+  if(b->repair[b->count] == NULL){
+    b->repair[b->count] = malloc(len);
+    if(b->repair[b->count] == NULL)
+      error("Cannot create repair buffer!");
+  }
+  memcpy(b->repair[b->count], data, len);
+  b->index[b->count] = index;
+  b->count++;
+}
+
+int fec_decode(struct fec_block *b, int k, char **chunks, const char *present, long len){
+  // rebuilds the chunks of a k packet block that are not present from its repair packets,
+  // returns the number rebuilt or -1 if there are fewer repair packets than lost chunks
+  int lost[MAXBLOCK];
+  int matrix[MAXREPAIR][MAXREPAIR];
+  char *rows[MAXREPAIR];
+  char *row;
+  int tmp[MAXREPAIR];
+  int m = 0;
+  int pivot;
+  int factor;
+  int r;
+  int t;
+  int u;
+  int i;
+
+  for(i=0; i<k; i++)
+    if(!present[i])
+      lost[m++] = i;
+  if(m == 0)
+    return 0;
+  if(m > b->count)
+    return -1;
+
+  // each repair packet minus the chunks that arrived leaves a combination of the lost ones
+  for(r=0; r<m; r++){
+    rows[r] = malloc(len);
+    if(rows[r] == NULL)
+      error("Cannot create repair buffer!");
+    memcpy(rows[r], b->repair[r], len);
+    for(i=0; i<k; i++)
+      if(present[i])
+        fec_muladd(rows[r], chunks[i], fec_coefficient(b->index[r],i), len);
+    for(t=0; t<m; t++)
+      matrix[r][t] = fec_coefficient(b->index[r],lost[t]);
+  }
+
+  // Gauss-Jordan elimination, every square part of a Cauchy matrix can be inverted
+  for(t=0; t<m; t++){
+    for(pivot=t; matrix[pivot][t] == 0; pivot++);
+    memcpy(tmp, matrix[pivot], sizeof(tmp));
+    memcpy(matrix[pivot], matrix[t], sizeof(tmp));
+    memcpy(matrix[t], tmp, sizeof(tmp));
+    row = rows[pivot];
+    rows[pivot] = rows[t];
+    rows[t] = row;
+
+    // scale the pivot row to 1
+    factor = gf_inv(matrix[t][t]);
+    for(u=0; u<m; u++)
+      matrix[t][u] = gf_mul(matrix[t][u], factor);
+    memset(chunks[lost[t]], 0, len);
+    fec_muladd(chunks[lost[t]], rows[t], factor, len);
+    memcpy(rows[t], chunks[lost[t]], len);
+
+    // clear the column in every other row
+    for(r=0; r<m; r++){
+      if(r == t || matrix[r][t] == 0)
+        continue;
+      factor = matrix[r][t];
+      for(u=0; u<m; u++)
+        matrix[r][u] ^= gf_mul(matrix[t][u], factor);
+      fec_muladd(rows[r], rows[t], factor, len);
+    }
+  }
+  for(t=0; t<m; t++){
+    memcpy(chunks[lost[t]], rows[t], len);
+    free(rows[t]);
+  }
+  return m;
+}
+
+void gf_init(){
+  int x = 1;
+  int i;
+  if(gf_ready)
+    return;
+  for(i=0; i<255; i++){
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if(x & 0x100)
+      x ^= GFPOLY;
+  }
+  for(i=255; i<512; i++) // products need no reduction of the summed logarithms
+    gf_exp[i] = gf_exp[i-255];
+  gf_ready = 1;
+}
+
+int gf_mul(int a, int b){
+  if(a == 0 || b == 0)
+    return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+int gf_inv(int a){
+  return gf_exp[255 - gf_log[a]];
+}
+
+void muladd_table(char *dst, const char *src, int c, long len){
+  // portable kernel, one lookup in the products of c per byte
+  unsigned char product[256];
+  long i;
+  gf_init();
+  for(i=0; i<256; i++)
+    product[i] = gf_mul(c, i);
+  for(i=0; i<len; i++)
+    dst[i] ^= product[(unsigned char)src[i]];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+void muladd_avx2(char *dst, const char *src, int c, long len){
+  // splits every byte into nibbles and looks up both products with a shuffle, 32 bytes per step
+  unsigned char low[16];
+  unsigned char high[16];
+  __m256i tlow;
+  __m256i thigh;
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  __m256i v;
+  __m256i p;
+  long i;
+  gf_init();
+  for(i=0; i<16; i++){
+    low[i] = gf_mul(c, i);
+    high[i] = gf_mul(c, i << 4);
+  }
+  tlow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+  thigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+  for(i=0; i+32<=len; i+=32){
+    v = _mm256_loadu_si256((const __m256i *)(src+i));
+    p = _mm256_xor_si256(_mm256_shuffle_epi8(tlow, _mm256_and_si256(v, mask)),
+                         _mm256_shuffle_epi8(thigh, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+    _mm256_storeu_si256((__m256i *)(dst+i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst+i)), p));
+  }
+  if(i < len)
+    muladd_table(dst+i, src+i, c, len-i);
+}
+#else
+void muladd_avx2(char *dst, const char *src, int c, long len){
+  muladd_table(dst, src, c, len);
+}
+#endif
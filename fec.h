@@ -0,0 +1,26 @@
+/*
+  fec.h
+  Forward Error Correction with a Reed-Solomon Code over GF(256)
+*/
+
+#ifndef FEC_H
+#define FEC_H
+
+// constant values
+#define MAXBLOCK 128 // most data packets per block
+#define MAXREPAIR 16 // most repair packets per block
+
+// repair packets received for one block of data packets
+struct fec_block {
+  long first; // sequence number of the first data packet of the block
+  int count;
+  int index[MAXREPAIR];
+  char *repair[MAXREPAIR];
+};
+
+int fec_coefficient(int index, int i);
+void fec_muladd(char *dst, const char *src, int c, long len);
+void fec_add(struct fec_block *b, long first, int index, const char *data, long len);
+int fec_decode(struct fec_block *b, int k, char **chunks, const char *present, long len);
+
+#endif
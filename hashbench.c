@@ -0,0 +1,86 @@
+/*
+  hashbench.c
+  Throughput of the Packet Checksum and the File Digest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "checksum.h"
+
+// constant values
+#define BENCHBYTES (1L << 30) // bytes hashed per measurement
+#define DIGESTBLOCK 65536 // read size of the digest catch-up
+
+// function definitions
+double now_sec();
+void bench_crc(const char *data, int size);
+void bench_digest(const char *data, int size);
+
+int main(int argc, char **argv){
+  char *data;
+  int i;
+
+  data = malloc(DIGESTBLOCK);
+  if(data == NULL){
+    printf("Cannot create buffer\n");
+    exit(1);
+  }
+  srand(time(NULL));
+  for(i=0; i<DIGESTBLOCK; i++)
+    data[i] = rand();
+
+  // the checksum covers one packet at a time, from the base size up to a jumbo frame
+  printf("CRC32C (%s)\n",crc32c_impl());
+  bench_crc(data, HEADERSIZE + DATASIZE);
+  bench_crc(data, BASEPACKETSIZE - TRAILERSIZE);
+  bench_crc(data, MAXPACKETSIZE - TRAILERSIZE);
+
+  // the digest is fed one chunk at a time while sending, and in large blocks when it catches up
+  printf("XXH64\n");
+  bench_digest(data, DATASIZE);
+  bench_digest(data, MAXDATASIZE);
+  bench_digest(data, DIGESTBLOCK);
+  free(data);
+  return 0;
+}
+
+double now_sec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void bench_crc(const char *data, int size){
+  // checksums BENCHBYTES in packets of size bytes
+  long rounds = BENCHBYTES / size;
+  volatile uint32_t sink = 0;
+  double start;
+  double elapsed;
+  long i;
+  start = now_sec();
+  for(i=0; i<rounds; i++)
+    sink ^= crc32c(data, size);
+  elapsed = now_sec() - start;
+  printf("  %5d bytes: %7.2f Gbit/s\n", size, rounds*size*8/elapsed/1e9);
+}
+
+void bench_digest(const char *data, int size){
+  // digests BENCHBYTES fed in pieces of size bytes
+  long rounds = BENCHBYTES / size;
+  volatile uint64_t sink;
+  struct digest d;
+  double start;
+  double elapsed;
+  long i;
+  start = now_sec();
+  digest_init(&d);
+  for(i=0; i<rounds; i++)
+    digest_update(&d, data, size);
+  sink = digest_final(&d);
+  (void)sink;
+  elapsed = now_sec() - start;
+  printf("  %5d bytes: %7.2f Gbit/s\n", size, rounds*size*8/elapsed/1e9);
+}
@@ -0,0 +1,529 @@
+/*
+  impair.c
+  Network Impairment Proxy
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "packet.h"
+
+// constant values
+#define BUFSIZE 65536
+#define MAXPORTS (MAXSTREAMS+1) // the receiver port and the stream ports it announces
+#define MAXPEERS 256 // senders behind all ports
+#define MAXQUEUE 65536 // packets held back by the proxy at a time
+#define DRAIN 64 // packets read from one socket before the others get a turn
+#define HOLDBACK 10000 // minimum extra delay of a reordered packet in microseconds
+#define SOCKBUFSIZE (8*1024*1024)
+#define FORWARD 0 // sender to receiver
+#define BACKWARD 1
+
+// what happens to the packets of one direction, probabilities are between 0 and 1 and times in microseconds
+struct impairment {
+  double loss; // Bernoulli loss
+  double burst_enter; // Gilbert-Elliott, chance to go from the good to the bad state where every packet is lost, 0 without bursts
+  double burst_leave;
+  int bad;
+  long delay;
+  long jitter; // the delay varies evenly by up to this much either way
+  double reorder; // chance that a packet is held back so that later ones overtake it
+  double duplicate;
+  double corrupt; // chance that one bit of the packet is flipped
+  long rate; // bits per second, 0 for no limit
+  long queue; // longest the bandwidth limit may queue a packet before it is dropped
+  long link_free; // when the limited link has sent everything queued so far
+  long last_due; // packets that are not reordered leave in the order they came
+  uint64_t rng; // every decision comes from this generator, the seed replays them
+  long packets; // statistics
+  long lost;
+  long duplicated;
+  long corrupted;
+  long reordered;
+  long overflowed;
+};
+
+// socket the senders talk to in place of one receiver port
+struct port {
+  int sock;
+  int listen_port;
+  int target_port;
+};
+
+// socket towards the receiver for one sender on one port, the receiver answers there
+struct peer {
+  int port;
+  struct sockaddr_in client;
+  int sock;
+};
+
+// packet waiting for its time to leave
+struct pending {
+  long due;
+  long order; // packets due at the same time leave in arrival order
+  int sock;
+  struct sockaddr_in to;
+  int size;
+  char *data;
+};
+
+void error (char *e);
+void parse_pair(const char *arg, double *forward, double *backward);
+void parse_burst(const char *arg, struct impairment *f, struct impairment *b);
+int open_port(int listen_port, int target_port);
+int find_port(int target_port);
+struct peer *find_peer(int port, struct sockaddr_in *client);
+int rewrite_ports(char *data, int size);
+void impair(struct impairment *m, int dir, int sock, struct sockaddr_in *to, const char *data, int size);
+void schedule(long due, int sock, struct sockaddr_in *to, const char *data, int size);
+void deliver(long now);
+void heap_push(struct pending *p);
+struct pending *heap_pop();
+int earlier(struct pending *a, struct pending *b);
+double next_random(struct impairment *m);
+int chance(struct impairment *m, double p);
+uint64_t splitmix(uint64_t *x);
+long now_usec();
+void print_stats(const char *name, struct impairment *m);
+void on_signal(int sig);
+
+// global variables
+struct impairment impairments[2];
+struct port ports[MAXPORTS];
+int port_count = 0;
+struct peer peers[MAXPEERS];
+int peer_count = 0;
+struct sockaddr_in target; // the receiver, its port is set per packet
+struct pending *heap[MAXQUEUE];
+int heap_size = 0;
+long order = 0;
+int verbose = 0;
+volatile sig_atomic_t stop = 0;
+
+int main(int argc, char **argv){
+  struct hostent *receiver;
+  struct pollfd fds[MAXPORTS+MAXPEERS];
+  struct sockaddr_in from;
+  socklen_t len;
+  struct timespec ts;
+  struct peer *p;
+  char buffer[BUFSIZE];
+  char *hostname = "127.0.0.1";
+  double forward;
+  double backward;
+  uint64_t seed = 1;
+  long wait;
+  int listen_port = 0;
+  int target_port = 0;
+  int count;
+  int size;
+  int n;
+  int i;
+  int k;
+
+  // parse command line input, every impairment takes one value for both directions or forward/backward
+  memset(impairments, 0, sizeof(impairments));
+  for(i=1; i<argc; i++){
+    if(strcmp(argv[i],"-p")==0) // port the senders use
+      listen_port = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-r")==0) // port of the receiver
+      target_port = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-h")==0) // host of the receiver
+      hostname = argv[i+1];
+    else if(strcmp(argv[i],"-s")==0) // seed
+      seed = strtoull(argv[i+1], NULL, 10);
+    else if(strcmp(argv[i],"-l")==0){ // loss in percent
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].loss = forward/100;
+      impairments[BACKWARD].loss = backward/100;
+    }
+    else if(strcmp(argv[i],"-g")==0) // Gilbert-Elliott bursts, p:r in percent
+      parse_burst(argv[i+1], &impairments[FORWARD], &impairments[BACKWARD]);
+    else if(strcmp(argv[i],"-d")==0){ // delay in milliseconds
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].delay = forward*1000;
+      impairments[BACKWARD].delay = backward*1000;
+    }
+    else if(strcmp(argv[i],"-j")==0){ // jitter in milliseconds
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].jitter = forward*1000;
+      impairments[BACKWARD].jitter = backward*1000;
+    }
+    else if(strcmp(argv[i],"-o")==0){ // reordering in percent
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].reorder = forward/100;
+      impairments[BACKWARD].reorder = backward/100;
+    }
+    else if(strcmp(argv[i],"-u")==0){ // duplication in percent
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].duplicate = forward/100;
+      impairments[BACKWARD].duplicate = backward/100;
+    }
+    else if(strcmp(argv[i],"-c")==0){ // corruption in percent
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].corrupt = forward/100;
+      impairments[BACKWARD].corrupt = backward/100;
+    }
+    else if(strcmp(argv[i],"-b")==0){ // bandwidth in kbit/s
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].rate = forward*1000;
+      impairments[BACKWARD].rate = backward*1000;
+    }
+    else if(strcmp(argv[i],"-q")==0){ // queue of the bandwidth limit in milliseconds
+      parse_pair(argv[i+1], &forward, &backward);
+      impairments[FORWARD].queue = forward*1000;
+      impairments[BACKWARD].queue = backward*1000;
+    }
+    else if(strcmp(argv[i],"-v")==0) // a line for every decision
+      verbose = 1;
+  }
+
+  if(listen_port <= 0 || target_port <= 0){
+    printf("\tUsage:\n\
+          [-p port] [-r receiver_port] <-h receiver_hostname> <-s seed> <-l loss%%> <-g p%%:r%%> <-d delay_ms> <-j jitter_ms>\n\
+          <-o reorder%%> <-u duplicate%%> <-c corrupt%%> <-b kbit/s> <-q queue_ms> <-v>\n\
+          [required] <optional>, impairments take one value or forward/backward\n");
+    exit(1);
+  }
+  for(k=0; k<2; k++){
+    if(impairments[k].queue == 0)
+      impairments[k].queue = 100000;
+    impairments[k].rng = seed ^ (k == FORWARD ? 0x6a09e667f3bcc908ULL : 0xbb67ae8584caa73bULL);
+    splitmix(&impairments[k].rng);
+  }
+
+  receiver = gethostbyname(hostname);
+  if(receiver == NULL)
+    error("Receiver cannot be found!");
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  memcpy(&target.sin_addr, receiver->h_addr, sizeof(target.sin_addr));
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  open_port(listen_port, target_port);
+  printf("Relaying port %d to %s:%d, seed %llu\n", listen_port, hostname, target_port, (unsigned long long)seed);
+  fflush(stdout);
+
+  while(!stop){
+    // sleep until a packet arrives or the next held packet is due
+    count = 0;
+    for(i=0; i<port_count; i++){
+      fds[count].fd = ports[i].sock;
+      fds[count++].events = POLLIN;
+    }
+    for(i=0; i<peer_count; i++){
+      fds[count].fd = peers[i].sock;
+      fds[count++].events = POLLIN;
+    }
+    wait = heap_size > 0 ? heap[0]->due - now_usec() : -1;
+    if(heap_size > 0 && wait < 0)
+      wait = 0;
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = wait % 1000000 * 1000;
+    if(ppoll(fds, count, wait >= 0 ? &ts : NULL, NULL) < 0 && errno != EINTR)
+      error("Poll error");
+
+    for(i=0; i<count; i++){
+      if(!(fds[i].revents & POLLIN))
+        continue;
+      for(n=0; n<DRAIN; n++){
+        len = sizeof(from);
+        size = recvfrom(fds[i].fd, buffer, BUFSIZE, MSG_DONTWAIT, (struct sockaddr *) &from, &len);
+        if(size < 0)
+          break;
+        if(i < port_count){ // from a sender
+          p = find_peer(i, &from);
+          if(p == NULL)
+            continue;
+          target.sin_port = htons(ports[i].target_port);
+          impair(&impairments[FORWARD], FORWARD, p->sock, &target, buffer, size);
+        }
+        else{ // from the receiver, back to the sender of that peer
+          p = &peers[i-port_count];
+          size = rewrite_ports(buffer, size);
+          impair(&impairments[BACKWARD], BACKWARD, ports[p->port].sock, &p->client, buffer, size);
+        }
+      }
+    }
+    deliver(now_usec());
+  }
+
+  print_stats("FORWARD", &impairments[FORWARD]);
+  print_stats("BACKWARD", &impairments[BACKWARD]);
+  return 0;
+}
+
+void parse_pair(const char *arg, double *forward, double *backward){
+  // "x" applies to both directions, "x/y" to the forward and the backward one
+  *forward = atof(arg);
+  *backward = strchr(arg,'/') != NULL ? atof(strchr(arg,'/')+1) : *forward;
+  if(*forward < 0 || *backward < 0)
+    error("Impairment out of range!");
+}
+
+void parse_burst(const char *arg, struct impairment *f, struct impairment *b){
+  // "p:r" for both directions, "p:r/p:r" for each, in percent
+  const char *second = strchr(arg,'/') != NULL ? strchr(arg,'/')+1 : arg;
+  f->burst_enter = atof(arg)/100;
+  f->burst_leave = strchr(arg,':') != NULL ? atof(strchr(arg,':')+1)/100 : 1;
+  b->burst_enter = atof(second)/100;
+  b->burst_leave = strchr(second,':') != NULL ? atof(strchr(second,':')+1)/100 : 1;
+  if(f->burst_leave <= 0 || b->burst_leave <= 0)
+    error("A burst must end!");
+}
+
+int open_port(int listen_port, int target_port){
+  // opens the socket senders use for target_port, listen_port 0 lets the kernel pick one, returns its index
+  struct sockaddr_in address;
+  socklen_t len = sizeof(address);
+  int bufsize = SOCKBUFSIZE;
+  int sock;
+  if(port_count == MAXPORTS)
+    error("Too many ports!");
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock < 0)
+    error("Cannot open socket!");
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(listen_port);
+  if(bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+    error("ERROR on binding");
+  if(getsockname(sock, (struct sockaddr *) &address, &len) < 0)
+    error("Cannot read socket address");
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  ports[port_count].sock = sock;
+  ports[port_count].listen_port = ntohs(address.sin_port);
+  ports[port_count].target_port = target_port;
+  return port_count++;
+}
+
+int find_port(int target_port){
+  // the port senders use for target_port, opened the first time the receiver announces it
+  int i;
+  for(i=0; i<port_count; i++)
+    if(ports[i].target_port == target_port)
+      return i;
+  return open_port(0, target_port);
+}
+
+struct peer *find_peer(int port, struct sockaddr_in *client){
+  // the socket towards the receiver for this sender on this port, NULL if there are too many senders
+  int bufsize = SOCKBUFSIZE;
+  int i;
+  for(i=0; i<peer_count; i++)
+    if(peers[i].port == port && peers[i].client.sin_port == client->sin_port
+       && peers[i].client.sin_addr.s_addr == client->sin_addr.s_addr)
+      return &peers[i];
+  if(peer_count == MAXPEERS)
+    return NULL;
+  peers[peer_count].port = port;
+  peers[peer_count].client = *client;
+  peers[peer_count].sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(peers[peer_count].sock < 0)
+    error("Cannot open socket!");
+  setsockopt(peers[peer_count].sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(peers[peer_count].sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  return &peers[peer_count++];
+}
+
+int rewrite_ports(char *data, int size){
+  // the ACK of INIT names the stream ports of the receiver, the sender has to use ours instead,
+  // returns the new size of the packet
+  struct header h;
+  struct initack ack;
+  int i;
+  if(demult(data, size, &h) < 0 || h.type != ACK || demult_initack(data, &h, &ack) < 0 || ack.streams < 2)
+    return size;
+  for(i=0; i<ack.streams; i++)
+    ack.ports[i] = ports[find_port(ack.ports[i])].listen_port;
+  return mult_initack(data, &h, &ack);
+}
+
+void impair(struct impairment *m, int dir, int sock, struct sockaddr_in *to, const char *data, int size){
+  // decides the fate of a packet and holds its copies until they are due
+  char copy[BUFSIZE];
+  long now = now_usec();
+  long index = ++m->packets;
+  long due;
+  int copies = 1;
+  int bit;
+  int i;
+
+  // the Gilbert-Elliott channel changes state before every packet, the bad state loses everything
+  if(m->burst_enter > 0){
+    if(m->bad && chance(m, m->burst_leave))
+      m->bad = 0;
+    else if(!m->bad && chance(m, m->burst_enter))
+      m->bad = 1;
+  }
+  if(m->bad || chance(m, m->loss)){
+    m->lost++;
+    if(verbose)
+      printf("%c %ld LOST\n", dir == FORWARD ? '>' : '<', index);
+    return;
+  }
+  if(chance(m, m->duplicate)){
+    copies = 2;
+    m->duplicated++;
+  }
+
+  for(i=0; i<copies; i++){
+    memcpy(copy, data, size);
+    if(chance(m, m->corrupt)){
+      bit = next_random(m) * size * 8;
+      copy[bit/8] ^= 1 << (bit%8);
+      m->corrupted++;
+    }
+
+    // a limited link sends one packet after the other and drops what would wait too long
+    due = now;
+    if(m->rate > 0){
+      if(m->link_free < now)
+        m->link_free = now;
+      if(m->link_free - now > m->queue){
+        m->overflowed++;
+        if(verbose)
+          printf("%c %ld OVERFLOW\n", dir == FORWARD ? '>' : '<', index);
+        continue;
+      }
+      m->link_free += size * 8000000L / m->rate;
+      due = m->link_free;
+    }
+    due += m->delay;
+    if(m->jitter > 0)
+      due += (long)((next_random(m)*2 - 1) * m->jitter);
+    if(due < now)
+      due = now;
+
+    // held back packets are overtaken, the others keep their order despite the jitter
+    if(chance(m, m->reorder)){
+      due += m->delay > HOLDBACK ? m->delay : HOLDBACK;
+      m->reordered++;
+    }
+    else{
+      if(due < m->last_due)
+        due = m->last_due;
+      m->last_due = due;
+    }
+    if(verbose)
+      printf("%c %ld +%ldus%s%s\n", dir == FORWARD ? '>' : '<', index, due - now,
+             copies > 1 ? " DUPLICATE" : "", memcmp(copy, data, size) != 0 ? " CORRUPT" : "");
+    schedule(due, sock, to, copy, size);
+  }
+}
+
+void schedule(long due, int sock, struct sockaddr_in *to, const char *data, int size){
+  struct pending *p;
+  if(heap_size == MAXQUEUE) // the proxy itself is full
+    return;
+  p = malloc(sizeof(struct pending));
+  if(p == NULL || (p->data = malloc(size)) == NULL)
+    error("Cannot hold packet!");
+  p->due = due;
+  p->order = order++;
+  p->sock = sock;
+  p->to = *to;
+  p->size = size;
+  memcpy(p->data, data, size);
+  heap_push(p);
+}
+
+void deliver(long now){
+  // sends every held packet that is due
+  struct pending *p;
+  while(heap_size > 0 && heap[0]->due <= now){
+    p = heap_pop();
+    sendto(p->sock, p->data, p->size, 0, (struct sockaddr *) &p->to, sizeof(p->to)); // a full buffer is one more loss
+    free(p->data);
+    free(p);
+  }
+}
+
+void heap_push(struct pending *p){
+  int i = heap_size++;
+  while(i > 0 && earlier(p, heap[(i-1)/2])){
+    heap[i] = heap[(i-1)/2];
+    i = (i-1)/2;
+  }
+  heap[i] = p;
+}
+
+struct pending *heap_pop(){
+  struct pending *top = heap[0];
+  struct pending *last = heap[--heap_size];
+  int i = 0;
+  int child;
+  while((child = 2*i+1) < heap_size){
+    if(child+1 < heap_size && earlier(heap[child+1], heap[child]))
+      child++;
+    if(!earlier(heap[child], last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+int earlier(struct pending *a, struct pending *b){
+  return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+double next_random(struct impairment *m){
+  // xorshift64*, uniform in [0,1)
+  m->rng ^= m->rng >> 12;
+  m->rng ^= m->rng << 25;
+  m->rng ^= m->rng >> 27;
+  return ((m->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int chance(struct impairment *m, double p){
+  // draws only if the impairment is on, so an unused one does not shift the others
+  return p > 0 && next_random(m) < p;
+}
+
+uint64_t splitmix(uint64_t *x){
+  // spreads the seed over the state, xorshift must not start at zero
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  *x = z ^ (z >> 31);
+  if(*x == 0)
+    *x = 1;
+  return *x;
+}
+
+long now_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+void print_stats(const char *name, struct impairment *m){
+  printf("%s: %ld PACKETS, %ld LOST, %ld DUPLICATED, %ld CORRUPTED, %ld REORDERED, %ld OVERFLOWED\n",
+         name, m->packets, m->lost, m->duplicated, m->corrupted, m->reordered, m->overflowed);
+}
+
+void on_signal(int sig){
+  stop = 1;
+}
+
+void error (char *e){
+  // print error message and die
+  printf("%s\n",e);
+  exit(1);
+}
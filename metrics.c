@@ -0,0 +1,175 @@
+/*
+  metrics.c
+  Log Levels and Transfer Metrics
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+void error (char *e);
+void *metrics_thread(void *arg);
+void metrics_exit();
+long metrics_usec();
+long metric_percentile(int id, int percent);
+
+// names in JSON, in the order of the metric numbers
+const char *metric_names[METRICS] = {
+  "packets_sent", "packets_received", "bytes_sent", "bytes_received", "retransmits",
+  "timeouts", "duplicate_acks", "duplicate_packets", "goodput_bytes", "rtt_us"
+};
+
+int log_level = LOGINFO;
+struct metrics *metrics = NULL;
+pid_t metrics_owner; // only the process that started the transfer reports it
+int control_sock = -1;
+char served_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+void metrics_init(){
+  // maps the metrics where forked streams share them and reports them when the process exits
+  metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(metrics == MAP_FAILED)
+    error("Cannot create metrics!");
+  memset(metrics, 0, sizeof(struct metrics));
+  metrics->start = metrics_usec();
+  metrics_owner = getpid();
+  atexit(metrics_exit);
+}
+
+void metrics_serve(const char *path){
+  // answers every connection to the unix socket at path with the current metrics in JSON
+  struct sockaddr_un address;
+  pthread_t thread;
+  if(strlen(path) >= sizeof(address.sun_path))
+    error("Control socket path too long!");
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  control_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(control_sock < 0)
+    error("Cannot open control socket!");
+  unlink(path); // left behind by an earlier run
+  if(bind(control_sock, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(control_sock, 8) < 0)
+    error("Cannot bind control socket!");
+  strcpy(served_path, path);
+  if(pthread_create(&thread, NULL, metrics_thread, NULL) != 0)
+    error("Cannot create control thread!");
+  pthread_detach(thread);
+}
+
+void *metrics_thread(void *arg){
+  // one JSON document per connection, then the connection is closed
+  char buffer[METRICSJSON];
+  int size;
+  int c;
+  while(1){
+    c = accept(control_sock, NULL, NULL);
+    if(c < 0){
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL;
+    }
+    size = metrics_json(buffer, sizeof(buffer));
+    write(c, buffer, size); // a reader that went away is no concern
+    close(c);
+  }
+}
+
+void metrics_done(){
+  // the data is through, what follows is no part of the goodput
+  long now = metrics_usec();
+  long end = __atomic_load_n(&metrics->end, __ATOMIC_RELAXED);
+  while(now > end && !__atomic_compare_exchange_n(&metrics->end, &end, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void metric_add(int id, long value){
+  long none = 0;
+  __atomic_fetch_add(&metrics->value[id], value, __ATOMIC_RELAXED);
+  if(id == GOODBYTES && __atomic_load_n(&metrics->first, __ATOMIC_RELAXED) == 0) // time to first byte
+    __atomic_compare_exchange_n(&metrics->first, &none, metrics_usec(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void metric_observe(int id, long value){
+  // adds a sample to a histogram
+  long max = __atomic_load_n(&metrics->max[id], __ATOMIC_RELAXED);
+  int bucket = 0;
+  while(bucket < HISTBUCKETS-1 && value >> bucket > 0)
+    bucket++;
+  __atomic_fetch_add(&metrics->buckets[id][bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&metrics->value[id], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&metrics->sum[id], value, __ATOMIC_RELAXED);
+  while(value > max && !__atomic_compare_exchange_n(&metrics->max[id], &max, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+long metric_percentile(int id, int percent){
+  // upper end of the bucket that holds the percentile, never more than the largest sample
+  long count = __atomic_load_n(&metrics->value[id], __ATOMIC_RELAXED);
+  long seen = 0;
+  long bound;
+  int i;
+  if(count == 0)
+    return 0;
+  for(i=0; i<HISTBUCKETS; i++){
+    seen += __atomic_load_n(&metrics->buckets[id][i], __ATOMIC_RELAXED);
+    if(seen*100 >= count*percent)
+      break;
+  }
+  bound = i == 0 ? 0 : (1L << i) - 1;
+  return bound < metrics->max[id] ? bound : metrics->max[id];
+}
+
+int metrics_json(char *buffer, int size){
+  // writes the metrics as one line of JSON, goodput is averaged over the time from metrics_init to metrics_done
+  long end = __atomic_load_n(&metrics->end, __ATOMIC_RELAXED);
+  long elapsed = (end > 0 ? end : metrics_usec()) - metrics->start;
+  long first = __atomic_load_n(&metrics->first, __ATOMIC_RELAXED);
+  long count;
+  int n;
+  int i;
+  n = snprintf(buffer, size, "{\"elapsed_us\":%ld,\"first_byte_us\":%ld", elapsed, first > 0 ? first - metrics->start : 0);
+  for(i=0; i<METRICS && n < size; i++){
+    count = __atomic_load_n(&metrics->value[i], __ATOMIC_RELAXED);
+    if(i != RTT)
+      n += snprintf(buffer+n, size-n, ",\"%s\":%ld", metric_names[i], count);
+    else
+      n += snprintf(buffer+n, size-n, ",\"%s\":{\"count\":%ld,\"mean\":%ld,\"p50\":%ld,\"p90\":%ld,\"p99\":%ld,\"max\":%ld}",
+                    metric_names[i], count, count > 0 ? metrics->sum[i]/count : 0,
+                    metric_percentile(i,50), metric_percentile(i,90), metric_percentile(i,99), metrics->max[i]);
+  }
+  if(n < size)
+    n += snprintf(buffer+n, size-n, ",\"goodput_bps\":%ld}\n",
+                  elapsed > 0 ? (long)(metrics->value[GOODBYTES] * 8.0 * 1000000 / elapsed) : 0);
+  return n < size ? n : size-1;
+}
+
+void metrics_dump(){
+  // the summary of a transfer
+  char buffer[METRICSJSON];
+  metrics_json(buffer, sizeof(buffer));
+  printf("METRICS %s", buffer);
+}
+
+void metrics_exit(){
+  // runs at exit, forked streams leave the report and the control socket to their parent
+  if(getpid() != metrics_owner)
+    return;
+  metrics_dump();
+  if(control_sock >= 0)
+    unlink(served_path);
+}
+
+long metrics_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
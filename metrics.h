@@ -0,0 +1,61 @@
+/*
+  metrics.h
+  Log Levels and Transfer Metrics
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// log levels, errors and the summary of a transfer are always printed
+#define LOGINFO 0
+#define LOGTRACE 1 // a line for every packet, -v
+
+// per packet lines cost more than the packets themselves on a terminal, build with -DNOTRACE to drop them entirely
+#ifdef NOTRACE
+#define trace(...) do{}while(0)
+#else
+#define trace(...) do{ if(log_level >= LOGTRACE) printf(__VA_ARGS__); }while(0)
+#endif
+
+// metrics, counters unless noted
+#define PACKETSSENT 0
+#define PACKETSRECEIVED 1
+#define BYTESSENT 2
+#define BYTESRECEIVED 3
+#define RETRANSMITS 4
+#define TIMEOUTS 5
+#define DUPACKS 6 // ACKs that acknowledge nothing new
+#define DUPPACKETS 7 // data packets that arrived more than once
+#define GOODBYTES 8 // file bytes acknowledged by the receiver, or written by it
+#define RTT 9 // histogram of round trip samples in microseconds
+#define METRICS 10
+
+// constant values
+#define HISTBUCKETS 32 // bucket i counts the values below 2^i that are not in an earlier one
+#define METRICSJSON 2048 // enough for every metric in JSON
+
+// every metric of the process and the streams it forks, shared so that the totals cover all of them
+struct metrics {
+  long start; // microseconds
+  long end; // when the last stream was done with the data, 0 while it is running
+  long first; // when the first file bytes were acknowledged or written, 0 until then
+  long value[METRICS]; // counter value, number of samples of a histogram
+  long sum[METRICS];
+  long max[METRICS];
+  long buckets[METRICS][HISTBUCKETS];
+};
+
+extern int log_level;
+extern struct metrics *metrics;
+
+void metrics_init();
+void metrics_serve(const char *path);
+void metrics_done();
+void metric_add(int id, long value);
+void metric_observe(int id, long value);
+int metrics_json(char *buffer, int size);
+void metrics_dump();
+
+#endif
@@ -0,0 +1,344 @@
+/*
+  packet.c
+  Wire Format Shared by the Sender and the Receiver
+*/
+
+#include <string.h>
+#include <endian.h>
+#include "packet.h"
+#include "checksum.h"
+
+// offsets of the INIT payload fields
+#define INIT_FILESIZE 0
+#define INIT_WINDOW 8
+#define INIT_DATASIZE 12
+#define INIT_STREAMS 16
+#define INIT_MTIME 18
+#define INIT_FEC 26
+#define INIT_NAMELEN 28
+#define INIT_NAME 30
+
+// offsets of the payload fields of the ACK of INIT
+#define INITACK_DATASIZE 0
+#define INITACK_STREAMS 4
+#define INITACK_PORTS 6
+
+// size of a range of held packets in an ACK
+#define SACK_BLOCKSIZE 8
+
+// offsets of the SIGNATURE answer fields
+#define SIG_BLOCKSIZE 0
+#define SIG_BLOCKS 4
+#define SIG_COUNT 12
+#define SIG_ENTRIES 14
+#define SIG_ENTRYSIZE 12
+
+void put_header(char *buffer, struct header *h);
+int get_header(const char *buffer, int size, struct header *h);
+
+int mult(char *buffer, struct header *h, const char *data){
+  // writes the header, the payload and the checksum into buffer and returns the packet size
+  // data may be NULL when the payload was already placed after the header
+  uint32_t crc;
+  put_header(buffer,h);
+  if(data != NULL && h->len > 0)
+    memcpy(buffer+HEADERSIZE,data,h->len);
+  crc = htobe32(crc32c(buffer,HEADERSIZE + h->len));
+  memcpy(buffer+HEADERSIZE+h->len,&crc,sizeof(crc));
+  return OVERHEAD + h->len;
+}
+
+int mult_split(char *buffer, struct header *h, const char *data){
+  // writes the header and right after it the checksum of a packet whose payload stays in data, it is sent
+  // as HEADERSIZE bytes of buffer, the payload and TRAILERSIZE bytes of buffer, returns the packet size
+  uint32_t crc;
+  put_header(buffer,h);
+  crc = htobe32(crc32c_extend(crc32c(buffer,HEADERSIZE),data,h->len));
+  memcpy(buffer+HEADERSIZE,&crc,sizeof(crc));
+  return OVERHEAD + h->len;
+}
+
+void put_header(char *buffer, struct header *h){
+  uint16_t len = htobe16(h->len);
+  uint32_t session = htobe32(h->session);
+  uint64_t seq_num = htobe64(h->seq_num);
+  buffer[0] = (VERSION << 4) | (h->type & 0x0f);
+  buffer[1] = h->flags;
+  memcpy(buffer+2,&len,sizeof(len));
+  memcpy(buffer+4,&session,sizeof(session));
+  memcpy(buffer+8,&seq_num,sizeof(seq_num));
+}
+
+int demult(const char *buffer, int size, struct header *h){
+  // reads the header of a size byte packet, returns -1 if it is not a packet we understand or it was corrupted
+  return demult_split(buffer,buffer+HEADERSIZE,size,h);
+}
+
+int demult_split(const char *buffer, const char *data, int size, struct header *h){
+  // like demult for a packet whose header was received into buffer and the rest, payload and checksum, into data
+  uint32_t crc;
+  if(get_header(buffer,size,h) < 0)
+    return -1;
+  memcpy(&crc,data+h->len,sizeof(crc));
+  if(be32toh(crc) != crc32c_extend(crc32c(buffer,HEADERSIZE),data,h->len))
+    return -1;
+  return 0;
+}
+
+int get_header(const char *buffer, int size, struct header *h){
+  uint16_t len;
+  uint32_t session;
+  uint64_t seq_num;
+  if(size < OVERHEAD)
+    return -1;
+  h->version = (unsigned char)buffer[0] >> 4;
+  h->type = buffer[0] & 0x0f;
+  h->flags = (unsigned char)buffer[1];
+  memcpy(&len,buffer+2,sizeof(len));
+  memcpy(&session,buffer+4,sizeof(session));
+  memcpy(&seq_num,buffer+8,sizeof(seq_num));
+  h->len = be16toh(len);
+  h->session = be32toh(session);
+  h->seq_num = be64toh(seq_num);
+  if(h->version != VERSION || OVERHEAD + h->len > size)
+    return -1;
+  return 0;
+}
+
+int mult_init(char *buffer, struct header *h, struct init *in){
+  // writes an INIT packet and returns its size
+  uint64_t filesize = htobe64(in->filesize);
+  uint32_t window = htobe32(in->window);
+  uint32_t datasize = htobe32(in->datasize);
+  uint16_t streams = htobe16(in->streams);
+  uint64_t mtime = htobe64(in->mtime);
+  uint16_t fec = htobe16(in->fec);
+  uint16_t namelen = strlen(in->filename);
+  char *p = buffer+HEADERSIZE;
+  if(namelen > NAMESIZE)
+    namelen = NAMESIZE;
+  memcpy(p+INIT_FILESIZE,&filesize,sizeof(filesize));
+  memcpy(p+INIT_WINDOW,&window,sizeof(window));
+  memcpy(p+INIT_DATASIZE,&datasize,sizeof(datasize));
+  memcpy(p+INIT_STREAMS,&streams,sizeof(streams));
+  memcpy(p+INIT_MTIME,&mtime,sizeof(mtime));
+  memcpy(p+INIT_FEC,&fec,sizeof(fec));
+  h->len = INIT_NAME + namelen;
+  namelen = htobe16(namelen);
+  memcpy(p+INIT_NAMELEN,&namelen,sizeof(namelen));
+  memcpy(p+INIT_NAME,in->filename,h->len - INIT_NAME);
+  h->type = INIT;
+  return mult(buffer,h,NULL);
+}
+
+int demult_init(const char *buffer, struct header *h, struct init *in){
+  // reads the payload of an INIT packet whose header is in h, returns -1 if it is malformed
+  uint64_t filesize;
+  uint32_t window;
+  uint32_t datasize;
+  uint16_t streams;
+  uint64_t mtime;
+  uint16_t fec;
+  uint16_t namelen;
+  const char *p = buffer+HEADERSIZE;
+  if(h->type != INIT || h->len < INIT_NAME)
+    return -1;
+  memcpy(&filesize,p+INIT_FILESIZE,sizeof(filesize));
+  memcpy(&window,p+INIT_WINDOW,sizeof(window));
+  memcpy(&datasize,p+INIT_DATASIZE,sizeof(datasize));
+  memcpy(&streams,p+INIT_STREAMS,sizeof(streams));
+  memcpy(&mtime,p+INIT_MTIME,sizeof(mtime));
+  memcpy(&fec,p+INIT_FEC,sizeof(fec));
+  memcpy(&namelen,p+INIT_NAMELEN,sizeof(namelen));
+  in->filesize = be64toh(filesize);
+  in->window = be32toh(window);
+  in->datasize = be32toh(datasize);
+  in->streams = be16toh(streams);
+  in->mtime = be64toh(mtime);
+  in->fec = be16toh(fec);
+  namelen = be16toh(namelen);
+  if(namelen > NAMESIZE || INIT_NAME + namelen > h->len)
+    return -1;
+  memcpy(in->filename,p+INIT_NAME,namelen);
+  in->filename[namelen] = '\0';
+  return 0;
+}
+
+int mult_initack(char *buffer, struct header *h, struct initack *ack){
+  // writes the ACK of INIT with the accepted chunk size, the stream ports and the missing ranges and returns its size
+  uint32_t datasize = htobe32(ack->datasize);
+  uint16_t streams = htobe16(ack->streams);
+  uint16_t port;
+  uint16_t count = htobe16(ack->missing.count);
+  uint64_t first;
+  uint64_t length;
+  char *p = buffer+HEADERSIZE;
+  int i;
+  memcpy(p+INITACK_DATASIZE,&datasize,sizeof(datasize));
+  memcpy(p+INITACK_STREAMS,&streams,sizeof(streams));
+  h->len = INITACK_PORTS;
+  for(i=0; ack->streams > 1 && i<ack->streams; i++){ // a single stream stays on the INIT port
+    port = htobe16(ack->ports[i]);
+    memcpy(p+h->len,&port,sizeof(port));
+    h->len += sizeof(port);
+  }
+  memcpy(p+h->len,&count,sizeof(count));
+  h->len += sizeof(count);
+  for(i=0; i<ack->missing.count; i++){
+    first = htobe64(ack->missing.first[i]);
+    length = htobe64(ack->missing.length[i]);
+    memcpy(p+h->len,&first,sizeof(first));
+    memcpy(p+h->len+sizeof(first),&length,sizeof(length));
+    h->len += sizeof(first) + sizeof(length);
+  }
+  h->type = ACK;
+  return mult(buffer,h,NULL);
+}
+
+int demult_initack(const char *buffer, struct header *h, struct initack *ack){
+  // reads the payload of the ACK of INIT whose header is in h, returns -1 if it is malformed
+  uint32_t datasize;
+  uint16_t streams;
+  uint16_t port;
+  uint16_t count;
+  uint64_t first;
+  uint64_t length;
+  const char *p = buffer+HEADERSIZE;
+  int offset = INITACK_PORTS;
+  int i;
+  if(h->type != ACK || h->len < INITACK_PORTS)
+    return -1;
+  memcpy(&datasize,p+INITACK_DATASIZE,sizeof(datasize));
+  memcpy(&streams,p+INITACK_STREAMS,sizeof(streams));
+  ack->datasize = be32toh(datasize);
+  ack->streams = be16toh(streams);
+  if(ack->streams < 1 || ack->streams > MAXSTREAMS)
+    return -1;
+  if(ack->streams > 1 && h->len < INITACK_PORTS + ack->streams*(int)sizeof(port))
+    return -1;
+  for(i=0; ack->streams > 1 && i<ack->streams; i++){
+    memcpy(&port,p+offset,sizeof(port));
+    ack->ports[i] = be16toh(port);
+    offset += sizeof(port);
+  }
+  if(h->len < offset + (int)sizeof(count))
+    return -1;
+  memcpy(&count,p+offset,sizeof(count));
+  offset += sizeof(count);
+  ack->missing.count = be16toh(count);
+  if(ack->missing.count > MAXRANGES || h->len < offset + ack->missing.count*(int)(sizeof(first)+sizeof(length)))
+    return -1;
+  for(i=0; i<ack->missing.count; i++){
+    memcpy(&first,p+offset,sizeof(first));
+    memcpy(&length,p+offset+sizeof(first),sizeof(length));
+    ack->missing.first[i] = be64toh(first);
+    ack->missing.length[i] = be64toh(length);
+    offset += sizeof(first) + sizeof(length);
+  }
+  return 0;
+}
+
+int mult_ack(char *buffer, struct header *h, struct sack *sack){
+  // writes an ACK with the ranges of held packets in sack, which may be NULL, and returns its size
+  uint32_t distance;
+  uint32_t length;
+  char *p = buffer+HEADERSIZE;
+  int i;
+  h->type = ACK;
+  h->len = 0;
+  for(i=0; sack != NULL && i<sack->count; i++){
+    distance = htobe32(sack->first[i] - h->seq_num);
+    length = htobe32(sack->length[i]);
+    memcpy(p+h->len,&distance,sizeof(distance));
+    memcpy(p+h->len+sizeof(distance),&length,sizeof(length));
+    h->len += SACK_BLOCKSIZE;
+  }
+  return mult(buffer,h,NULL);
+}
+
+int demult_ack(const char *buffer, struct header *h, struct sack *sack){
+  // reads the ranges of held packets of an ACK whose header is in h, returns -1 if it is malformed
+  uint32_t distance;
+  uint32_t length;
+  const char *p = buffer+HEADERSIZE;
+  int i;
+  if(h->type != ACK || h->len % SACK_BLOCKSIZE != 0 || h->len / SACK_BLOCKSIZE > MAXSACKS)
+    return -1;
+  sack->count = h->len / SACK_BLOCKSIZE;
+  for(i=0; i<sack->count; i++){
+    memcpy(&distance,p+i*SACK_BLOCKSIZE,sizeof(distance));
+    memcpy(&length,p+i*SACK_BLOCKSIZE+sizeof(distance),sizeof(length));
+    sack->first[i] = h->seq_num + be32toh(distance);
+    sack->length[i] = be32toh(length);
+  }
+  return 0;
+}
+
+int mult_fin(char *buffer, struct header *h, uint64_t digest){
+  // writes a FIN packet with the digest of the file and returns its size
+  uint64_t value = htobe64(digest);
+  h->type = FIN;
+  h->len = sizeof(value);
+  return mult(buffer,h,(const char *)&value);
+}
+
+int demult_fin(const char *buffer, struct header *h, uint64_t *digest){
+  // reads the digest of a FIN packet whose header is in h, returns -1 if it is malformed
+  uint64_t value;
+  if(h->type != FIN || h->len < (int)sizeof(value))
+    return -1;
+  memcpy(&value,buffer+HEADERSIZE,sizeof(value));
+  *digest = be64toh(value);
+  return 0;
+}
+
+int mult_sigblock(char *buffer, struct header *h, struct sigblock *sb){
+  // writes a SIGNATURE answer with the signatures of sb->count blocks from h->seq_num on and returns its size
+  uint32_t blocksize = htobe32(sb->blocksize);
+  uint64_t blocks = htobe64(sb->blocks);
+  uint16_t count = htobe16(sb->count);
+  uint32_t weak;
+  uint64_t strong;
+  char *p = buffer+HEADERSIZE;
+  int i;
+  memcpy(p+SIG_BLOCKSIZE,&blocksize,sizeof(blocksize));
+  memcpy(p+SIG_BLOCKS,&blocks,sizeof(blocks));
+  memcpy(p+SIG_COUNT,&count,sizeof(count));
+  for(i=0; i<sb->count; i++){
+    weak = htobe32(sb->weak[i]);
+    strong = htobe64(sb->strong[i]);
+    memcpy(p+SIG_ENTRIES+i*SIG_ENTRYSIZE,&weak,sizeof(weak));
+    memcpy(p+SIG_ENTRIES+i*SIG_ENTRYSIZE+sizeof(weak),&strong,sizeof(strong));
+  }
+  h->type = SIGNATURE;
+  h->len = SIG_ENTRIES + sb->count*SIG_ENTRYSIZE;
+  return mult(buffer,h,NULL);
+}
+
+int demult_sigblock(const char *buffer, struct header *h, struct sigblock *sb){
+  // reads the payload of a SIGNATURE answer whose header is in h, returns -1 if it is malformed
+  uint32_t blocksize;
+  uint64_t blocks;
+  uint16_t count;
+  uint32_t weak;
+  uint64_t strong;
+  const char *p = buffer+HEADERSIZE;
+  int i;
+  if(h->type != SIGNATURE || h->len < SIG_ENTRIES)
+    return -1;
+  memcpy(&blocksize,p+SIG_BLOCKSIZE,sizeof(blocksize));
+  memcpy(&blocks,p+SIG_BLOCKS,sizeof(blocks));
+  memcpy(&count,p+SIG_COUNT,sizeof(count));
+  sb->blocksize = be32toh(blocksize);
+  sb->blocks = be64toh(blocks);
+  sb->count = be16toh(count);
+  if(sb->count > MAXSIGS || h->len < SIG_ENTRIES + sb->count*SIG_ENTRYSIZE)
+    return -1;
+  for(i=0; i<sb->count; i++){
+    memcpy(&weak,p+SIG_ENTRIES+i*SIG_ENTRYSIZE,sizeof(weak));
+    memcpy(&strong,p+SIG_ENTRIES+i*SIG_ENTRYSIZE+sizeof(weak),sizeof(strong));
+    sb->weak[i] = be32toh(weak);
+    sb->strong[i] = be64toh(strong);
+  }
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+  packet.h
+  Wire Format Shared by the Sender and the Receiver
+*/
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+// packet types
+#define INIT 0
+#define DATA 1
+#define ACK 2
+#define PROBE 3
+#define FIN 4
+#define REPAIR 5
+#define SIGNATURE 6
+
+// header flags
+#define SRMODE 0x01 // INIT, the sender uses selective repeat
+#define BADDIGEST 0x02 // answer to FIN, the file the receiver assembled does not match the digest
+#define DELTA 0x04 // INIT, the file is a delta against the receiver's copy of the same name
+#define COMPRESS 0x08 // INIT and its ACK, blocks may be compressed; DATA, the payload is a piece of a compressed block
+#define ARCHIVE 0x10 // INIT, the file is a directory tree packed behind its manifest
+#define CUMULATIVE 0x20 // ACK, the sequence number is the next packet the receiver needs and the payload the packets it holds beyond it
+#define REFUSED 0x40 // ACK of INIT, the receiver does not accept the transfer and the ACK carries nothing
+
+// constant values
+#define VERSION 1
+#define HEADERSIZE 16
+#define TRAILERSIZE 4 // CRC32C after the payload
+#define OVERHEAD (HEADERSIZE+TRAILERSIZE)
+#define DATASIZE 1024 // chunk size used unless another one is negotiated
+#define BASEPACKETSIZE 1200 // datagram size every path is assumed to carry
+#define MAXPACKETSIZE 8972 // largest datagram, a 9000 byte MTU minus IP and UDP headers
+#define MAXDATASIZE (MAXPACKETSIZE-OVERHEAD)
+#define NAMESIZE 255
+#define MAXSTREAMS 16 // most parallel streams one transfer is split into
+#define MAXRANGES 64 // most chunk ranges the ACK of INIT asks for, it must fit BASEPACKETSIZE
+#define MAXSIGS 64 // most block signatures in one SIGNATURE answer, it must fit BASEPACKETSIZE
+#define MAXSACKS 16 // most ranges of held packets in one ACK
+
+/*
+  Every packet starts with the same 16 byte header, all fields big endian,
+  and ends with the CRC32C of the header and the payload (32 bits):
+
+   0        1        2                 4                                  8
+  +--------+--------+--------+--------+--------+--------+--------+--------+
+  |ver|type| flags  | payload length  |           session id              |
+  +--------+--------+--------+--------+--------+--------+--------+--------+
+  |                        sequence number (64 bits)                      |
+  +--------+--------+--------+--------+--------+--------+--------+--------+
+
+  INIT carries the file size (64 bits), the window size N (32 bits), the
+  proposed chunk size (32 bits), the requested number of streams (16 bits),
+  the modification time of the file (64 bits), the number of data packets
+  per FEC block (16 bits, 0 without FEC), the length of the file name
+  (16 bits) and the name. The ACK of INIT carries the chunk size the
+  receiver accepted (32 bits), the number of streams (16 bits), the port of
+  each stream if there is more than one (16 bits each), and the ranges of
+  chunks the receiver still needs: their number (16 bits), then the first
+  chunk and the length of each range (64 bits each). An ACK of INIT with REFUSED
+  carries nothing, the receiver will not write the file. DATA carries the chunk.
+  An ACK with CUMULATIVE acknowledges every packet before its sequence
+  number and carries the ranges of packets the receiver holds beyond it,
+  each as the distance of its first packet from the sequence number
+  (32 bits) and its length (32 bits). Other ACKs carry nothing, in
+  selective repeat they acknowledge the packet in the sequence number. PROBE is
+  padded to the datagram size being tested and the receiver echoes that
+  size in the sequence number of an empty PROBE. FIN carries the XXH64
+  digest of the whole file (64 bits) and the receiver answers with an
+  empty FIN that sets BADDIGEST if its file has a different digest. REPAIR
+  carries one coded chunk of the FEC block whose first data packet is in
+  the sequence number, the flags hold the index of the repair packet.
+  SIGNATURE comes before INIT in a delta transfer: the sender asks for the
+  block signatures starting at the block in the sequence number of the
+  receiver's copy of the file named in the payload, and the receiver
+  answers with the block size (32 bits), the number of blocks of its copy
+  (64 bits, 0 if it has none), the number of signatures that follow
+  (16 bits) and for each one the rolling checksum (32 bits) and the XXH64
+  (64 bits) of the block. With COMPRESS, a DATA packet whose chunk belongs to
+  a compressed block carries the compressed size of the block (32 bits) and
+  its even share of the compressed bytes instead of the chunk. With ARCHIVE,
+  the file named in INIT is a directory and the data is its manifest
+  followed by the contents of its files, see archive.c.
+*/
+struct header {
+  int version;
+  int type;
+  int flags;
+  int len; // payload bytes after the header
+  uint32_t session;
+  long seq_num;
+};
+
+// payload of INIT
+struct init {
+  long filesize;
+  long window;
+  long datasize;
+  int streams;
+  long mtime;
+  int fec; // data packets per FEC block, 0 without FEC
+  char filename[NAMESIZE+1];
+};
+
+// chunks that still have to be sent, in file order, chunks are counted from 0
+struct ranges {
+  int count;
+  long first[MAXRANGES];
+  long length[MAXRANGES];
+};
+
+// payload of the ACK of INIT
+struct initack {
+  long datasize;
+  int streams;
+  int ports[MAXSTREAMS];
+  struct ranges missing;
+};
+
+// packets the receiver holds beyond the next one it needs, in sequence order
+struct sack {
+  int count;
+  long first[MAXSACKS];
+  long length[MAXSACKS];
+};
+
+// payload of a SIGNATURE answer
+struct sigblock {
+  long blocksize;
+  long blocks;
+  int count;
+  uint32_t weak[MAXSIGS];
+  uint64_t strong[MAXSIGS];
+};
+
+int mult(char *buffer, struct header *h, const char *data);
+int mult_split(char *buffer, struct header *h, const char *data);
+int demult(const char *buffer, int size, struct header *h);
+int demult_split(const char *buffer, const char *data, int size, struct header *h);
+int mult_init(char *buffer, struct header *h, struct init *in);
+int demult_init(const char *buffer, struct header *h, struct init *in);
+int mult_initack(char *buffer, struct header *h, struct initack *ack);
+int demult_initack(const char *buffer, struct header *h, struct initack *ack);
+int mult_ack(char *buffer, struct header *h, struct sack *sack);
+int demult_ack(const char *buffer, struct header *h, struct sack *sack);
+int mult_fin(char *buffer, struct header *h, uint64_t digest);
+int demult_fin(const char *buffer, struct header *h, uint64_t *digest);
+int mult_sigblock(char *buffer, struct header *h, struct sigblock *sb);
+int demult_sigblock(const char *buffer, struct header *h, struct sigblock *sb);
+
+#endif
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+#  probetest.sh
+#  Path MTU Probing Behind Late and Duplicated Answers
+#
+#  usage: ./probetest.sh <port>
+#  sends a file with -M through impair, which duplicates and delays the answers of the receiver, so PROBE
+#  echoes come twice or after the sender gave up on them and land in the handshake, then compares the copy,
+#  all files are written under a temporary directory that is removed afterwards
+
+port=${1:-9400}
+bin=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'kill $impair 2>/dev/null; rm -rf "$dir"' EXIT
+
+cd "$dir" || exit 1
+head -c 3000000 /dev/urandom > src.bin
+
+failed=0
+set -- "-u 0/100" "-u 0/100 -d 0/4 -j 0/4" "-u 50 -d 3 -j 3" "-u 0/100 -d 0/30"
+for impairments in "$@"; do
+  rm -f src.bin[0-9]*
+  "$bin/impair" -p $((port + 1)) -r "$port" $impairments > i.log 2>&1 &
+  impair=$!
+  timeout 60 "$bin/receiver" -p "$port" -m sr:32 > r.log 2>&1 &
+  receiver=$!
+  sleep 0.2
+  timeout 60 "$bin/sender" -p $((port + 1)) -h 127.0.0.1 -f src.bin -m sr:32 -M > s.log 2>&1
+  wait $receiver
+  kill $impair 2>/dev/null
+  wait $impair 2>/dev/null
+  copy=$(ls src.bin[0-9]* 2>/dev/null | head -n 1)
+  if [ -z "$copy" ] || ! cmp -s src.bin "$copy"; then
+    echo "FAILED: impair $impairments, $(grep -v -e METRICS -e "^$" s.log | tail -n 1)"
+    failed=1
+  fi
+done
+[ $failed -eq 0 ] && echo "OK: $# transfers"
+exit $failed
@@ -16,26 +16,98 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
-
-// packet types
-#define INIT '0'
-#define DATA '1'
-#define ACK '2'
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include "packet.h"
+#include "batch.h"
+#include "daemon.h"
+#include "resume.h"
+#include "checksum.h"
+#include "fec.h"
+#include "delta.h"
+#include "compress.h"
+#include "archive.h"
+#include "writer.h"
+#include "metrics.h"
+#include "ack.h"
+#include "event.h"
 
 // constant values
-#define DATASIZE 1024
-#define BUFSIZE 2048
-#define FILENAMESIZE 56
-#define RECVTIMEOUT 15
+#define BUFSIZE MAXPACKETSIZE
+#define RECVTIMEOUT 15000000 // microseconds
+#define LINGER 1000000
+
+// pieces of a compressed block that arrived so far
+struct assembly {
+  long block; // -1 while the slot is free
+  int size; // compressed size of the block
+  int count;
+  uint64_t have; // one bit per piece
+  char *data;
+};
 
 // function definitions
 void error (char *e);
-void mult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]);
-void demult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]);
-void merge(const int num_pack, const char* filename);
+int open_output(const char *filename, long filesize, int keep);
+void write_packet(struct writer *w, int fd, long offset, const char *data, int size, long filesize, long chunk, void *context);
+void close_output(int fd, long filesize);
+void store_packet(long index, const char *data, int size, int flags);
+void store_piece(long index, const char *data, int size);
+void written(struct write_request *r);
+void save_progress();
+int repair_packet(struct header *h, const char *data, long first, long total_packets, long req_num, long *slot_seq);
+int repair_block(long first, long total_packets, long block, long req_num, long *slot_seq);
+void keep_packet(long seq_num, const char *data, int size);
+int make_ack(char *buffer, uint32_t session, long seq_num);
+void send_ack(int sock, struct sockaddr_in *sender_address, long req_num, long *slot_seq, int repeat);
+void digest_written(struct digest *d, long *pos, long offset, const char *data, int size, long filesize, struct archive *a);
+uint64_t digest_output(int fd, struct digest *d, long pos, long filesize, struct archive *a);
+void linger(int sock, uint32_t session, long total_packets, int cumulative, int fin);
+void answer_signatures(int sock, struct sockaddr_in *sender_address, struct header *h, const char *packet);
+int rebuild_file();
+int receive_batch(int sock);
+int open_stream(int *port);
+void receive(int sock, long first, long total_packets);
+void receive_streams(int *socks, long total_packets);
+void stop_and_wait(int sock, long first, long total_packets);
+void gobackn(int sock, long first, long total_packets);
+void selective_repeat(int sock, long first, long total_packets);
 
-const char *prefix = "packet";
+// global variables
+int mode;
+int selective = 0;
+uint32_t session;
+long filesize;
+long datasize;
+int streams = 1;
+int fd;
+struct ranges missing; // chunks the sender was asked for
+struct resume resume;
+struct digest digest; // digest of the file up to digest_pos, fed while chunks arrive in order
+long digest_pos = 0;
+int verdict = -1; // -1 until FIN is checked, then 1 if the digest matched
+int fec_k = 0; // data packets per FEC block, 0 without FEC
+struct fec_block *fec_blocks = NULL; // repair packets of the blocks inside the window
+int fec_slots = 0;
+char *fec_data = NULL; // copies of the data packets of those blocks, fec_k chunks per slot of fec_blocks
+char *filename;
+char outname[NAMESIZE+16];
+int delta = 0; // the transfer carries a delta against our copy of filename
+struct signatures signatures; // block signatures of our copy, computed for the first SIGNATURE
+long block_chunks = 0; // chunks per compressed block, 0 if the sender does not compress
+struct assembly *assemblies = NULL; // compressed blocks inside the window
+int assembly_count = 0;
+struct archive *archive = NULL; // extraction of a directory, NULL for a single file
+struct writer writer; // writes the chunks to the file, off the thread that receives them
+int offload = 0;
+char *control_path = NULL; // unix socket that serves the metrics while the transfer runs
+int ack_every = ACKEVERY;
+struct acker acker; // when the sender is owed an ACK
+long highest = 0; // highest sequence number held in the window
+struct events events; // socket readiness and timers of the stream
 
 int main(int argc, char **argv) {
   int sock;
@@ -47,36 +119,33 @@ int main(int argc, char **argv) {
   struct sockaddr_in receiver_address;
   struct hostent *sender;
   long seq_num;
-  char type;
-  char filename[FILENAMESIZE];
-  char packetname[FILENAMESIZE];
-  long filesize;
-  int mode;
-  int sender_mode;
-  char data[DATASIZE];
+  struct header h;
+  struct init in;
+  struct initack ack;
+  char partname[NAMESIZE+16];
+  char streamname[NAMESIZE+24];
+  int resumed;
   char buffer[BUFSIZE];
   char recv_buffer[BUFSIZE];
   socklen_t len;
-  int received = 0;
-  FILE *file;
-  int recv_seq_num;
+  int size;
   long total_packets;
-  long req_num = 1;
-  struct timeval timeout;
-  fd_set fdset;
-  int to_status;
+  int socks[MAXSTREAMS];
   int mode_exist = 0;
   int port_exist = 0;
   int hostname_exist = 0;
-  int test_exist = 0;
-  int test_case = 0;
-  int phase = 0;
+  int daemon = 0;
   int i;
 
   // parse command line input
   for (i=0; i<argc; i++){
     if(strcmp(argv[i],"-m")==0){
-      mode = atoi(argv[i+1]);
+      if(strncmp(argv[i+1],"sr:",3)==0){ // selective repeat with window size N
+        selective = 1;
+        mode = atoi(argv[i+1]+3);
+      }
+      else
+        mode = atoi(argv[i+1]);
       mode_exist = 1;
     }
     else if(strcmp(argv[i],"-p")==0){
@@ -87,15 +156,27 @@ int main(int argc, char **argv) {
       hostname = argv[i+1];
       hostname_exist = 1;
     }
-    else if(strcmp(argv[i],"-t")==0){
-      test_exist = 1;
-      test_case = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-G")==0){
+      offload = 1;
+    }
+    else if(strcmp(argv[i],"-d")==0){
+      daemon = 1;
+    }
+    else if(strcmp(argv[i],"-v")==0){
+      log_level = LOGTRACE;
+    }
+    else if(strcmp(argv[i],"-S")==0){
+      control_path = argv[i+1];
+    }
+    else if(strcmp(argv[i],"-a")==0){ // packets one ACK covers at most
+      ack_every = atoi(argv[i+1]);
     }
   }
 
-  if(!mode_exist || !port_exist){
+  if((!mode_exist && !daemon) || !port_exist || ack_every < 1){
     printf("\tUsage:\n\
-          [-m mode] [-p port] <-h hostname> <-t test>\n\
+          [-m mode|sr:N] [-p port] <-h hostname> <-G> <-a packets> <-v> <-S socket>\n\
+          [-p port] [-d] <-m mode|sr:N> <-h hostname> <-G> <-a packets> <-v> <-S socket>\n\
           [required] <optional>\n");
     exit(1);
   }
@@ -124,30 +205,66 @@ int main(int argc, char **argv) {
   if (bind(sock, (struct sockaddr *) &receiver_address, sizeof(receiver_address)) < 0)
     error("ERROR on binding");
 
-  // set timeout
-  FD_ZERO (&fdset);
-  FD_SET  (sock, &fdset);
-  timeout.tv_sec = 2*RECVTIMEOUT;
-  timeout.tv_usec = 0;
-
-  to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-  if(to_status < 0) // error
-    error("Select error");
-  else if(to_status == 0){ // receiver was idle
-    error("Receiver time out...");
+  // accept coalesced buffers from the kernel if it can build them
+  if(offload && !batch_offload(sock))
+    printf("Segmentation offload is not available\n");
+
+  // serve every sender on this socket, with -m only senders of that mode, the metrics are totals of all of them
+  if(daemon){
+    metrics_init();
+    if(control_path != NULL)
+      metrics_serve(control_path);
+    serve(sock, mode_exist ? mode : 0, selective, hostname_exist ? (struct in_addr *)sender->h_addr : NULL);
   }
 
   len = sizeof(sender_address);
+  event_open(&events,sock);
 
-  // receive packet
-  if(recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len) < 0)
-    error("No init\n");
+  // wait for INIT, answering path MTU probes and the signature requests of a delta transfer that come before it
+  while(1){
+    if(!event_read(&events, 2*RECVTIMEOUT)) // receiver was idle
+      error("Receiver time out...");
 
-  // get packet contents
-  demult(recv_buffer,&type,filename,&filesize,&sender_mode,&seq_num,data);
+    // receive packet
+    size = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len);
+    if(size < 0)
+      error("No init\n");
+    if(demult(recv_buffer,size,&h) == 0 && h.type == SIGNATURE){
+      answer_signatures(sock,&sender_address,&h,recv_buffer);
+      continue;
+    }
+    if(demult(recv_buffer,size,&h) < 0 || h.type != PROBE)
+      break;
+
+    // tell the sender which size arrived, the answer itself stays small
+    printf("<- PROBE %d\n",size);
+    h.len = 0;
+    h.seq_num = size;
+    size = mult(buffer,&h,NULL);
+    if(sendto(sock, buffer, size, 0,(struct sockaddr *) &sender_address, len) < 0)
+      error("Cannot send package!");
+  }
+
+  // get packet contents and check packet type
+  if(demult(recv_buffer,size,&h) < 0 || demult_init(recv_buffer,&h,&in) < 0)
+    error("No INIT message!");
+
+  // the transfer starts now, its goodput does not count the wait for the sender
+  metrics_init();
+  if(control_path != NULL)
+    metrics_serve(control_path);
+  session = h.session;
+  seq_num = h.seq_num;
+  filename = in.filename;
+  filesize = in.filesize;
+
+  // accept the proposed chunk size unless it does not fit our buffers
+  if(in.datasize < 1)
+    error("No INIT message!");
+  datasize = in.datasize < MAXDATASIZE ? in.datasize : MAXDATASIZE;
 
   // check for mode mismatch
-  if(mode != sender_mode)
+  if(in.window != mode || ((h.flags & SRMODE) != 0) != selective)
     error("Incompatible modes!");
 
   // check if the sender is the designated host given from the command line
@@ -157,206 +274,821 @@ int main(int argc, char **argv) {
       error("Unexpected sender");
   }
 
-  // check packet type
-  if (type != INIT)
-    error("No INIT message!");
+  delta = (h.flags & DELTA) != 0;
+  printf(delta ? "<- INIT, DELTA\n" : (h.flags & ARCHIVE) ? "<- INIT, DIRECTORY\n" : "<- INIT\n");
 
-  // calculate total number of data packets
-  total_packets = (long)ceil((double)filesize/(double)DATASIZE);
+  // keep the repair packets of the blocks that overlap the window
+  if(in.fec > 0 && in.fec <= MAXBLOCK && (selective || mode > 1)){
+    fec_k = in.fec;
+    fec_slots = mode/fec_k + 2;
+    fec_blocks = calloc(fec_slots, sizeof(struct fec_block));
+    if(fec_blocks == NULL)
+      error("Cannot create repair buffers!");
+  }
 
-  printf("<- INIT\n");
+  // the output file is named after the original file and our pid once it is complete,
+  // until then it is a partial file whose bitmap lets a later INIT continue it, a delta
+  // arrives in a file of its own and the output is rebuilt from it and our copy at the end,
+  // a directory is extracted into the output while its stream arrives in a file of its own
+  snprintf(outname,sizeof(outname),"%s%d",filename,getpid());
+  snprintf(partname,sizeof(partname),delta ? "%s.delta.part" : "%s.part",filename);
+  resumed = resume_open(&resume,partname,filesize,in.mtime,&datasize);
+  if(resumed < 0) // another receiver is writing the partial file
+    snprintf(streamname,sizeof(streamname),delta ? "%s.delta" : (h.flags & ARCHIVE) ? "%s.archive" : "%s",outname);
+  else
+    snprintf(streamname,sizeof(streamname),"%s",partname);
+  fd = open_output(streamname,filesize,resumed > 0);
+  if(h.flags & ARCHIVE)
+    archive = archive_extract(outname);
+  resume.data_fd = fd;
+  atexit(save_progress);
+  digest_init(&digest);
+
+  // compressed blocks are put together in memory and written once complete, FEC rebuilds chunks from the file instead
+  if((h.flags & COMPRESS) && fec_k == 0)
+    block_chunks = compress_chunks(datasize);
+  if(block_chunks > 0){
+    assembly_count = mode/block_chunks + 3;
+    assemblies = calloc(assembly_count, sizeof(struct assembly));
+    if(assemblies == NULL)
+      error("Cannot create decompression buffers!");
+    for(i=0; i<assembly_count; i++)
+      assemblies[i].block = -1;
+  }
 
-  // create and send ACK message for INIT
-  type = ACK;
-  if(mode == 1)
-    mult(buffer,&type,filename,&filesize,&sender_mode,&seq_num,data);
+  // calculate the data packets to receive, only the missing chunks of a resumed file
+  if(resumed > 0)
+    resume_missing(&resume,&missing);
   else
-    mult(buffer,&type,filename,&filesize,&sender_mode,&req_num,data);
-  if(sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, len) < 0)
+    ranges_all(&missing,(long)ceil((double)filesize/(double)datasize));
+  total_packets = ranges_total(&missing);
+  if(resumed > 0)
+    printf("RESUMING, %ld OF %ld PACKETS MISSING\n",total_packets,resume.chunks);
+
+  // give every requested stream its own socket, but never more streams than packets
+  streams = in.streams;
+  if(streams > MAXSTREAMS)
+    streams = MAXSTREAMS;
+  if(streams > total_packets)
+    streams = total_packets;
+  if(streams < 1)
+    streams = 1;
+  for(i=0; streams > 1 && i<streams; i++)
+    socks[i] = open_stream(&ack.ports[i]);
+
+  // create and send ACK message for INIT, it carries the accepted chunk size and the stream ports
+  h.flags = block_chunks > 0 ? COMPRESS : 0;
+  h.session = session;
+  h.seq_num = (mode == 1 && !selective) ? seq_num : 1;
+  ack.datasize = datasize;
+  ack.streams = streams;
+  ack.missing = missing;
+  size = mult_initack(buffer,&h,&ack);
+  if(sendto(sock, buffer, size, 0,(struct sockaddr *) &sender_address, len) < 0)
     error("Cannot send package!");
+  batch_init(OVERHEAD + datasize);
 
-  printf("-> ACK INIT\n");
+  printf("-> ACK INIT, CHUNK SIZE %ld, %d STREAMS%s\n",datasize,streams,block_chunks > 0 ? ", COMPRESSED" : "");
 
   // main loop
-  if (mode == 1){ // stop and wait
-    recv_seq_num = 1;
-    while(received < filesize){ // when there is still packets to receive
-      to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-      if(to_status < 0) // error
-        error("Select error");
-      else if(to_status == 0){ // channel was idle for too long
+  if(streams == 1)
+    receive(sock,0,total_packets);
+  else{
+    receive_streams(socks,total_packets);
+    linger(sock,session,0,0,1); // the streams are done, only FIN is left
+    event_close(&events);
+    close(sock);
+  }
+  close_output(fd,filesize);
+
+  // a file that does not match the sender's digest is of no use for a later attempt either
+  if(!verdict){
+    unlink(streamname);
+    if(delta)
+      unlink(outname);
+    if(archive != NULL)
+      archive_remove(outname);
+    resume_finish(&resume);
+    error("File digest mismatch!");
+  }
+  if(delta || archive != NULL) // the output was rebuilt or extracted by the time FIN came
+    unlink(streamname);
+  else if(resumed >= 0 && rename(partname,outname) < 0)
+    error("Cannot rename file");
+  resume_finish(&resume);
+}
+
+void receive(int sock, long first, long total_packets){
+  // receives the packets of one stream, first is the index of its first packet in the transfer,
+  // every stream has a writer of its own
+  // a packet is received right into the buffer it is written from, its checksum follows the payload there
+  writer_start(&writer,block_chunks > 0 ? block_chunks*datasize : datasize+TRAILERSIZE,written);
+  if (selective && mode > 0) // selective repeat with windows size N=mode
+    selective_repeat(sock,first,total_packets);
+  else if (mode == 1) // stop and wait
+    stop_and_wait(sock,first,total_packets);
+  else if(mode > 1) // go-back-n with windows size N=mode
+    gobackn(sock,first,total_packets);
+  writer_stop(&writer);
+  event_close(&events);
+  close(sock);
+}
+
+void receive_streams(int *socks, long total_packets){
+  // receives each contiguous share of the packets in its own process, they all write to the same file
+  long first;
+  long last;
+  pid_t pids[MAXSTREAMS];
+  int status;
+  int failed = 0;
+  int i;
+  int j;
+
+  fflush(stdout); // children must not inherit buffered output
+  for(i=0; i<streams; i++){
+    first = total_packets*i/streams;
+    last = total_packets*(i+1)/streams;
+    pids[i] = fork();
+    if(pids[i] < 0)
+      error("Cannot create stream!");
+    if(pids[i] == 0){
+      prctl(PR_SET_PDEATHSIG, SIGTERM); // a stream does not outlive the transfer
+      for(j=0; j<streams; j++) // keep only the socket of this stream
+        if(j != i)
+          close(socks[j]);
+      session = session + i;
+      archive = NULL; // a directory is extracted by the parent once every share is here
+      printf("STREAM %d: PACKETS %ld-%ld\n",i,first+1,last);
+      event_close(&events); // the events of a stream watch its own socket
+      event_open(&events,socks[i]);
+      receive(socks[i],first,last-first);
+      exit(0);
+    }
+  }
+  for(i=0; i<streams; i++)
+    close(socks[i]);
+
+  // the file is complete only if every stream is
+  for(i=0; i<streams; i++)
+    if(waitpid(pids[i],&status,0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+  if(failed)
+    error("Stream failed!");
+}
+
+void selective_repeat(int sock, long first, long total_packets){
+  struct sockaddr_in sender_address;
+  struct header h;
+  long seq_num;
+  long req_num = 1;
+  long before;
+  long wait;
+  long *slot_seq;
+  int count;
+  int k;
+  int ready;
+  struct timer idle; // the sender went away
+  struct timer owed; // the ACK of the packets read so far, or its repetition
+  struct timer *t;
+
+  // sequence number received in each window slot, indexed by seq_num % N
+  slot_seq = calloc(mode, sizeof(long));
+  if(slot_seq == NULL)
+    error("Cannot create window!");
+  ack_init(&acker,ack_every,mode);
+  memset(&idle, 0, sizeof(idle));
+  memset(&owed, 0, sizeof(owed));
+  timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+  while(req_num <= total_packets){ // when there is still packets to receive
+    wait = ack_wait(&acker);
+    if(wait < 0)
+      timer_stop(&events,&owed);
+    else
+      timer_set(&events,&owed,event_usec() + wait);
+    ready = event_wait(&events);
+
+    // the timers only count while nothing is left to read
+    while((t = timer_expired(&events)) != NULL){
+      if(ready & EVENTREAD)
+        continue;
+      if(t == &idle) // channel was idle for too long
         error("Receiver time out...");
+      // every queued packet is read, acknowledge them, or no packet followed the last ACK and it may be lost
+      send_ack(sock,&sender_address,req_num,slot_seq,acker.unacked == 0);
+      batch_flush(sock);
+    }
+    if(!(ready & EVENTREAD))
+      continue;
+    timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+    ack_answered(&acker);
+
+    // receive every packet that is already queued
+    count = receive_batch(sock);
+    for(k=0; k<count; k++){
+      sender_address = recv_addr[k];
+
+      // get packet content, packets of other sessions are not ours
+      if(demult_split(recv_batch[k],recv_data[k],recv_size[k],&h) < 0 || h.session != session)
+        continue;
+      before = req_num;
+      if(h.type == REPAIR){ // rebuilt packets are acknowledged at once
+        if(repair_packet(&h,recv_data[k],first,total_packets,req_num,slot_seq) > 0){
+          while(req_num <= total_packets && slot_seq[req_num%mode] == req_num)
+            req_num++;
+          send_ack(sock,&sender_address,req_num,slot_seq,0);
+        }
+        continue;
       }
+      if(h.type != DATA)
+        continue;
+      seq_num = h.seq_num;
 
-      // receive packet
-      bzero(data,DATASIZE);
-      int x = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len);
-      if( x < 0)
-        error("Cannot receive packet");
+      if(seq_num >= req_num && seq_num < req_num+mode && seq_num <= total_packets){ // inside the window
+        if(slot_seq[seq_num%mode] != seq_num){ // not a duplicate
+          slot_seq[seq_num%mode] = seq_num;
+          if(seq_num > highest)
+            highest = seq_num;
+          trace("<- PACKET %ld\n",seq_num);
 
-      // get packet contents
-      demult(recv_buffer,&type,filename,&filesize,&sender_mode,&seq_num,data);
+          // out of order packets are placed at their offset right away, so only the slot is kept
+          store_packet(first+seq_num-1,recv_data[k],h.len,h.flags);
 
-      // if the received packet is the expected packet
+          // the repair packets of its block may have been waiting for this one
+          if(fec_k > 0){
+            keep_packet(seq_num,recv_data[k],h.len);
+            repair_block(first,total_packets,seq_num-(seq_num-1)%fec_k,req_num,slot_seq);
+          }
+        }
+        else
+          metric_add(DUPPACKETS,1);
+
+        // slide the window over the packets received in order
+        while(req_num <= total_packets && slot_seq[req_num%mode] == req_num)
+          req_num++;
+      }
+      else if(seq_num >= req_num-mode && seq_num < req_num) // already delivered, its ACK was lost
+        metric_add(DUPPACKETS,1);
+      else
+        continue;
+      if(ack_packet(&acker,req_num-before,req_num > total_packets))
+        send_ack(sock,&sender_address,req_num,slot_seq,0);
+    }
+    batch_flush(sock); // the ACKs of the whole batch leave together
+  }
+  timer_stop(&events,&idle);
+  timer_stop(&events,&owed);
+
+  // the last ACKs may be lost, FIN comes here unless the transfer is split into streams
+  linger(sock,session,total_packets,0,streams == 1);
+  free(slot_seq);
+  printf("Transmission complete\n");
+  batch_stats();
+}
+
+void stop_and_wait(int sock, long first, long total_packets){
+  struct sockaddr_in sender_address;
+  socklen_t len = sizeof(sender_address);
+  struct header h;
+  char buffer[BUFSIZE];
+  char recv_buffer[BUFSIZE];
+  long seq_num;
+  long recv_seq_num = 1;
+  int size;
+  int ready;
+  struct timer idle; // the sender went away
+
+  memset(&idle, 0, sizeof(idle));
+  timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+  while(recv_seq_num <= total_packets){ // when there is still packets to receive
+    ready = event_wait(&events);
+    if(timer_expired(&events) != NULL && !(ready & EVENTREAD)) // channel was idle for too long
+      error("Receiver time out...");
+    if(!(ready & EVENTREAD))
+      continue;
+    timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+
+    // receive packet
+    size = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len);
+    if(size < 0)
+      error("Cannot receive packet");
+    metric_add(PACKETSRECEIVED,1);
+    metric_add(BYTESRECEIVED,size);
+
+    // get packet contents
+    if(demult(recv_buffer,size,&h) < 0 || h.type != DATA || h.session != session)
+      continue;
+    seq_num = h.seq_num;
+    if(seq_num < recv_seq_num)
+      metric_add(DUPPACKETS,1);
+
+    // if the received packet is the expected packet, or one whose ACK was lost
+    if(seq_num == recv_seq_num || (seq_num >= 1 && seq_num < recv_seq_num)){
       if(seq_num == recv_seq_num){
         recv_seq_num++;
-        received = received + sizeof(data);
-        printf("<- PACKET %ld\n",seq_num);
-
-        // write packet to disk
-        char tmp[DATASIZE+1];
-        memcpy(tmp,data,DATASIZE);
-        tmp[DATASIZE] = '\0';
-        strcpy(packetname,prefix);
-        sprintf(packetname+strlen(prefix),"%ld",seq_num);
-        file = fopen(packetname,"wb");
-        fwrite(tmp,1,sizeof(tmp),file);
-        fclose(file);
-
-        // create and send ACK for the received DATA packet
-        type = ACK;
-        mult(buffer,&type,filename,&filesize,&sender_mode,&seq_num,data);
-        if(sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, len) < 0)
-          error("Cannot send package!");
-        printf("-> ACK %ld\n",seq_num);
+        trace("<- PACKET %ld\n",seq_num);
+
+        // write packet to its place in the output file
+        store_packet(first+seq_num-1,recv_buffer+HEADERSIZE,h.len,h.flags);
       }
-    }
-    printf("Transmission complete\n");
-    close(sock);
 
-    // combine data packets to re-create the original file
-    pid_t pid = getpid();
-    bzero(packetname,FILENAMESIZE);
-    strcpy(packetname,filename);
-    sprintf(packetname+strlen(filename),"%d",pid);
-    merge(seq_num,packetname);
+      // create and send ACK for the received DATA packet
+      size = make_ack(buffer,session,seq_num);
+      if(sendto(sock, buffer, size, 0,(struct sockaddr *) &sender_address, len) < 0)
+        error("Cannot send package!");
+      metric_add(PACKETSSENT,1);
+      metric_add(BYTESSENT,size);
+      trace("-> ACK %ld\n",seq_num);
+    }
   }
-  else if(mode > 1){ // go-back-n with windows size N=mode
-    while(req_num <= total_packets){ // when there is still packets to receive
-      FD_ZERO (&fdset);
-      FD_SET  (sock, &fdset);
-      to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-      if(to_status < 0) // error
-        error("Select error");
-      else if(to_status == 0){ // channel was idle for too long
+  timer_stop(&events,&idle);
+  linger(sock,session,total_packets,0,streams == 1);
+  printf("Transmission complete\n");
+}
+
+void gobackn(int sock, long first, long total_packets){
+  struct sockaddr_in sender_address;
+  struct header h;
+  long seq_num;
+  long req_num = 1;
+  long before;
+  long wait;
+  long *slot_seq;
+  int count;
+  int k;
+  int ready;
+  struct timer idle; // the sender went away
+  struct timer owed; // the ACK of the packets read so far, or its repetition
+  struct timer *t;
+
+  // packets after a gap are kept so that repair packets can fill it, indexed by seq_num % N
+  slot_seq = calloc(mode, sizeof(long));
+  if(slot_seq == NULL)
+    error("Cannot create window!");
+  ack_init(&acker,ack_every,mode);
+  memset(&idle, 0, sizeof(idle));
+  memset(&owed, 0, sizeof(owed));
+  timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+  while(req_num <= total_packets){ // when there is still packets to receive
+    wait = ack_wait(&acker);
+    if(wait < 0)
+      timer_stop(&events,&owed);
+    else
+      timer_set(&events,&owed,event_usec() + wait);
+    ready = event_wait(&events);
+
+    // the timers only count while nothing is left to read
+    while((t = timer_expired(&events)) != NULL){
+      if(ready & EVENTREAD)
+        continue;
+      if(t == &idle) // channel was idle for too long
         error("Receiver time out...");
-      }
+      // every queued packet is read, acknowledge them, or no packet followed the last ACK and it may be lost
+      send_ack(sock,&sender_address,req_num,slot_seq,acker.unacked == 0);
+      batch_flush(sock);
+    }
+    if(!(ready & EVENTREAD))
+      continue;
+    timer_set(&events,&idle,event_usec() + 2*RECVTIMEOUT);
+    ack_answered(&acker);
 
-      // receive packet
-      bzero(data,DATASIZE);
-      int x = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len);
-      if( x < 0)
-        error("Cannot receive packet");
+    // receive every packet that is already queued
+    count = receive_batch(sock);
+    for(k=0; k<count; k++){
+      sender_address = recv_addr[k];
 
       // get packet content
-      demult(recv_buffer,&type,filename,&filesize,&sender_mode,&seq_num,data);
-
-      if(seq_num == req_num){ // expected packet
-        req_num++;
-        received = received + sizeof(data);
-        printf("<- PACKET %ld\n",seq_num);
-
-        // write packet to disk
-        char tmp[DATASIZE+1];
-        memcpy(tmp,data,DATASIZE);
-        tmp[DATASIZE] = '\0';
-        strcpy(packetname,prefix);
-        sprintf(packetname+strlen(prefix),"%ld",seq_num);
-        file = fopen(packetname,"wb");
-        fwrite(tmp,1,strlen(tmp),file);
-        fclose(file);
+      if(demult_split(recv_batch[k],recv_data[k],recv_size[k],&h) < 0 || h.session != session)
+        continue;
+      before = req_num;
+      if(h.type == REPAIR){
+        if(repair_packet(&h,recv_data[k],first,total_packets,req_num,slot_seq) <= 0)
+          continue;
       }
-      // send ACK for the unreceived packet with smallest seq num
-      if(!(test_case == 4 && req_num != total_packets + 1 && req_num % 2 == 1)){ // test case 4
-        type = ACK;
-        mult(buffer,&type,filename,&filesize,&sender_mode,&req_num,data);
-        if(sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, len) < 0)
-          error("Cannot send package!");
-        printf("-> REQUEST %ld\n",req_num);
+      else if(h.type != DATA)
+        continue;
+      else if((seq_num = h.seq_num) == req_num || (fec_k > 0 && seq_num > req_num && seq_num < req_num+mode
+              && seq_num <= total_packets && slot_seq[seq_num%mode] != seq_num)){ // expected, or after a gap FEC may fill
+        slot_seq[seq_num%mode] = seq_num;
+        if(seq_num > highest)
+          highest = seq_num;
+        trace("<- PACKET %ld\n",seq_num);
+
+        // write packet to its place in the output file
+        store_packet(first+seq_num-1,recv_data[k],h.len,h.flags);
+        if(fec_k > 0){
+          keep_packet(seq_num,recv_data[k],h.len);
+          repair_block(first,total_packets,seq_num-(seq_num-1)%fec_k,req_num,slot_seq);
+        }
       }
+      else if(seq_num >= 1 && seq_num < req_num)
+        metric_add(DUPPACKETS,1);
+      while(req_num <= total_packets && slot_seq[req_num%mode] == req_num)
+        req_num++;
+
+      // request the unreceived packet with smallest seq num
+      if(ack_packet(&acker,req_num-before,req_num > total_packets))
+        send_ack(sock,&sender_address,req_num,slot_seq,0);
     }
-    printf("Transmission complete\n");
-    close(sock);
+    batch_flush(sock); // the ACKs of the whole batch leave together
+  }
+  timer_stop(&events,&idle);
+  timer_stop(&events,&owed);
+  linger(sock,session,total_packets,1,streams == 1);
+  free(slot_seq);
+  printf("Transmission complete\n");
+  batch_stats();
+}
 
-    // combine data packets to re-create the original file
-    pid_t pid = getpid();
-    bzero(packetname,FILENAMESIZE);
-    strcpy(packetname,filename);
-    sprintf(packetname+strlen(filename),"%d",pid);
-    merge(seq_num,packetname);
+int receive_batch(int sock){
+  // drains the socket, the payloads land in the buffers of the next writes so those that are stored need no copy,
+  // the pieces of compressed blocks are collected elsewhere and are received as a whole
+  char *payloads[BATCH];
+  int i;
+  if(block_chunks > 0)
+    return batch_receive(sock);
+  for(i=0; i<BATCH; i++)
+    payloads[i] = writer_slot(&writer,i);
+  return batch_receive_into(sock,payloads,datasize+TRAILERSIZE);
+}
+
+int open_stream(int *port){
+  // opens the socket of one stream on a port chosen by the kernel and returns it
+  int sock;
+  struct sockaddr_in address;
+  socklen_t len = sizeof(address);
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    error("Cannot open socket!");
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = 0;
+  if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+    error("ERROR on binding");
+  if (getsockname(sock, (struct sockaddr *) &address, &len) < 0)
+    error("ERROR on binding");
+  *port = ntohs(address.sin_port);
+  if(offload)
+    batch_offload(sock);
+  return sock;
+}
+
+int open_output(const char *filename, long filesize, int keep){
+  // creates the output file and reserves space for the whole transfer, keep leaves earlier content in place
+  int fd;
+  int err;
+  fd = open(filename, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644); // read back for the digest
+  if(fd < 0)
+    error("Cannot open file");
+  if(filesize > 0){
+    err = posix_fallocate(fd, 0, filesize);
+    if(err != 0 && err != EOPNOTSUPP && err != EINVAL) // not every filesystem can preallocate
+      error("Cannot allocate file");
   }
+  return fd;
 }
 
-void mult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]){
-  // writes the packet fields into the packet and does conversions if necessary
-  long fls = htonl(*filesize);
-  int mod = htons(*mode);
-  long sn = htonl(*seq_num);
-  int i=0;
-  memcpy(buffer,type,sizeof(char));
-  i = i+sizeof(char);
-  memcpy(buffer+i,&(*filename),FILENAMESIZE);
-  i = i+FILENAMESIZE;
-  memcpy(buffer+i,&fls,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(buffer+i,&mod,sizeof(int));
-  i = i+sizeof(int);
-  memcpy(buffer+i,&sn,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(buffer+i,data,DATASIZE);
+void write_packet(struct writer *w, int fd, long offset, const char *data, int size, long filesize, long chunk, void *context){
+  // queues the payload of a DATA packet at its offset, never past the size announced in INIT
+  if(offset >= filesize)
+    size = 0;
+  else if(offset + size > filesize)
+    size = filesize - offset;
+  writer_write(w,fd,offset,data,size,chunk,1,context);
+}
+
+void store_packet(long index, const char *data, int size, int flags){
+  // writes the index-th packet of the transfer to its chunk and records it in the bitmap
+  long chunk = ranges_chunk(&missing,index);
+  if(flags & COMPRESS){
+    store_piece(index,data,size);
+    return;
+  }
+  write_packet(&writer,fd,chunk*datasize,data,size,filesize,chunk,NULL);
+}
+
+void store_piece(long index, const char *data, int size){
+  // keeps a piece of a compressed block and writes the block once all of its pieces are here
+  long chunk = ranges_chunk(&missing,index);
+  long block = chunk / block_chunks;
+  long total_chunks = (filesize + datasize - 1) / datasize;
+  long chunks = total_chunks - block*block_chunks < block_chunks ? total_chunks - block*block_chunks : block_chunks;
+  long offset = block*block_chunks*datasize;
+  long raw = filesize - offset < chunks*datasize ? filesize - offset : chunks*datasize;
+  int j = chunk - block*block_chunks;
+  struct assembly *a = NULL;
+  uint32_t packed;
+  long first;
+  long last;
+  int i;
+
+  // every piece carries the compressed size, which gives where it goes in the block
+  if(block_chunks == 0 || size < PIECEHEADER)
+    return;
+  memcpy(&packed,data,PIECEHEADER);
+  packed = ntohl(packed);
+  if(packed < 1 || packed > chunks*(datasize-PIECEHEADER))
+    return;
+  first = j*(long)packed / chunks;
+  last = (j+1)*(long)packed / chunks;
+  if(size != PIECEHEADER + last - first)
+    return;
 
+  for(i=0; i<assembly_count && a == NULL; i++)
+    if(assemblies[i].block == block)
+      a = &assemblies[i];
+  for(i=0; i<assembly_count && a == NULL; i++)
+    if(assemblies[i].block < 0){ // a new block
+      a = &assemblies[i];
+      a->block = block;
+      a->size = packed;
+      a->count = 0;
+      a->have = 0;
+      if(a->data == NULL && (a->data = malloc(COMPRESSBLOCK)) == NULL)
+        error("Cannot create decompression buffers!");
+    }
+  if(a == NULL) // the window never holds more blocks than there are slots
+    error("Too many compressed blocks!");
+  if(a->size != (int)packed || (a->have >> j) & 1)
+    return;
+  memcpy(a->data+first, data+PIECEHEADER, last-first);
+  a->have |= 1ULL << j;
+  a->count++;
+  if(a->count < chunks)
+    return;
+
+  // the whole block is here, it is decompressed right into the buffer the writer takes it from
+  if(decompress_block(a->data, a->size, writer_buffer(&writer), raw) != raw)
+    error("Cannot decompress block!");
+  writer_queue(&writer,fd,offset,raw,block*block_chunks,chunks,NULL);
+  a->block = -1;
 }
 
-void demult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]){
-  // reads the packet fields from the packet and does conversions if necessary
-  int i=0;
-  memcpy(type,buffer,sizeof(char));
-  i = i+sizeof(char);
-  memcpy(&(*filename),buffer+i,FILENAMESIZE);
-  i = i+FILENAMESIZE;
-  memcpy(filesize,buffer+i,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(mode,buffer+i,sizeof(int));
-  i = i+sizeof(int);
-  memcpy(seq_num,buffer+i,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(data,buffer+i,DATASIZE);
-  *filesize = ntohl(*filesize);
-  *mode = ntohs(*mode);
-  *seq_num = ntohl(*seq_num);
+void written(struct write_request *r){
+  // runs on the writer thread once chunks are in the file, only then they count for the digest and the bitmap
+  long i;
+  metric_add(GOODBYTES,r->size);
+  digest_written(&digest,&digest_pos,r->offset,r->data,r->size,filesize,archive);
+  for(i=0; i<r->chunks; i++)
+    resume_mark(&resume,r->chunk+i);
+}
 
+void digest_written(struct digest *d, long *pos, long offset, const char *data, int size, long filesize, struct archive *a){
+  // feeds a written chunk to the digest if it is the next one in file order, the rest is read back at the end,
+  // the extraction of a directory follows the digest
+  if(offset != *pos || offset >= filesize)
+    return;
+  if(offset + size > filesize)
+    size = filesize - offset;
+  digest_update(d,data,size);
+  if(a != NULL)
+    archive_feed(a,data,size);
+  *pos += size;
 }
 
-void merge(const int num_pack, const char* filename){
-  // combine small packets into a large file
-  char buffer[DATASIZE];
-  char packetname[FILENAMESIZE];
-  int i = 1;
+uint64_t digest_output(int fd, struct digest *d, long pos, long filesize, struct archive *a){
+  // reads the part of the file the digest has not seen and returns the digest of the whole file
+  char block[65536];
   long size;
-  FILE* fr;
-  FILE* fw = fopen(filename, "wb");
-  if(fw == NULL)
-    error("Cannot open file");
+  while(pos < filesize){
+    size = filesize - pos < (long)sizeof(block) ? filesize - pos : (long)sizeof(block);
+    if(pread(fd, block, size, pos) != size)
+      error("Cannot read file");
+    digest_update(d,block,size);
+    if(a != NULL)
+      archive_feed(a,block,size);
+    pos += size;
+  }
+  return digest_final(d);
+}
 
-  while(i<=num_pack){
+int repair_packet(struct header *h, const char *data, long first, long total_packets, long req_num, long *slot_seq){
+  // keeps a repair packet and rebuilds what its block lost, returns the number of packets rebuilt
+  long block = h->seq_num;
+  if(fec_k == 0 || h->len != datasize || h->flags >= MAXREPAIR || block < 1 || block > total_packets || (block-1) % fec_k != 0)
+    return 0;
+  if(block + fec_k <= req_num) // every packet of the block is already here
+    return 0;
+  trace("<- REPAIR %ld:%d\n",block,h->flags);
+  fec_add(&fec_blocks[(block-1)/fec_k % fec_slots],block,h->flags,data,h->len);
+  return repair_block(first,total_packets,block,req_num,slot_seq);
+}
 
-    bzero(packetname,FILENAMESIZE);
-    strcpy(packetname,prefix);
-    sprintf(packetname+strlen(prefix),"%d",i);
+int repair_block(long first, long total_packets, long block, long req_num, long *slot_seq){
+  // rebuilds the lost packets of the block once it holds as many repair packets as it lost, from the copies
+  // of the packets that arrived, so nothing waits for the writer, returns the number of packets rebuilt
+  struct fec_block *b = &fec_blocks[(block-1)/fec_k % fec_slots];
+  char *chunks[MAXBLOCK];
+  char present[MAXBLOCK];
+  long seq_num;
+  long offset;
+  long size;
+  int lost = 0;
+  int k;
+  int i;
+
+  if(b->first != block || b->count == 0)
+    return 0;
+  k = total_packets - block + 1 < fec_k ? total_packets - block + 1 : fec_k;
+  for(i=0; i<k; i++){
+    seq_num = block + i;
+    present[i] = seq_num < req_num || slot_seq[seq_num%mode] == seq_num;
+    if(!present[i] && seq_num >= req_num+mode) // no slot to put it in yet
+      return 0;
+    lost += !present[i];
+  }
+  if(lost == 0 || lost > b->count)
+    return 0;
+
+  for(i=0; i<k; i++) // a rebuilt packet takes the place of its copy
+    chunks[i] = fec_data + (((block-1)/fec_k % fec_slots)*fec_k + i)*datasize;
+  if(fec_decode(b,k,chunks,present,datasize) < 0)
+    error("Cannot decode block");
+  for(i=0; i<k; i++){
+    seq_num = block + i;
+    if(!present[i]){
+      offset = ranges_chunk(&missing,first+seq_num-1)*datasize;
+      size = filesize - offset < datasize ? filesize - offset : datasize;
+      slot_seq[seq_num%mode] = seq_num;
+      if(seq_num > highest)
+        highest = seq_num;
+      store_packet(first+seq_num-1,chunks[i],size,0);
+      trace("<- REBUILT %ld\n",seq_num);
+    }
+  }
+  b->count = 0;
+  return lost;
+}
+
+void keep_packet(long seq_num, const char *data, int size){
+  // copies a data packet into the slot of its FEC block, padded with zeros like the sender codes it, a slot
+  // is only reused once every packet of its block is in order
+  long block = seq_num - (seq_num-1)%fec_k;
+  char *copy;
+  if(fec_data == NULL && (fec_data = malloc((long)fec_slots*fec_k*datasize)) == NULL)
+    error("Cannot create repair buffers!");
+  if(size > datasize)
+    size = datasize;
+  copy = fec_data + (((block-1)/fec_k % fec_slots)*fec_k + seq_num - block)*datasize;
+  memcpy(copy,data,size);
+  memset(copy+size,0,datasize-size);
+}
+
+void save_progress(){
+  // runs at exit, an unfinished transfer keeps its bitmap for the next attempt and extracts its directory again
+  writer_stop(&writer);
+  resume_close(&resume);
+  if(archive != NULL && verdict != 1)
+    archive_remove(outname);
+}
+
+void close_output(int fd, long filesize){
+  // cuts the file to the exact size announced in INIT
+  if(ftruncate(fd, filesize) < 0)
+    error("Cannot truncate file");
+  if(close(fd) < 0)
+    error("Cannot close file");
+}
+
+int make_ack(char *buffer, uint32_t session, long seq_num){
+  // builds an ACK, which is only a header, and returns its size
+  struct header h;
+  h.type = ACK;
+  h.flags = 0;
+  h.len = 0;
+  h.session = session;
+  h.seq_num = seq_num;
+  return mult(buffer,&h,NULL);
+}
+
+void send_ack(int sock, struct sockaddr_in *sender_address, long req_num, long *slot_seq, int repeat){
+  // queues the ACK, a repeated one is not repeated again
+  int size = make_sack(batch_buffer(),session,req_num,slot_seq,mode,highest);
+  batch_queue(sock,sender_address,size);
+  ack_sent(&acker,repeat);
+  trace("-> REQUEST %ld\n",req_num);
+}
+
+void linger(int sock, uint32_t session, long total_packets, int cumulative, int fin){
+  // keeps acknowledging retransmissions until the sender is quiet, with fin it first waits for FIN
+  // and answers it with the result of comparing the digests
+  struct sockaddr_in sender_address;
+  socklen_t len = sizeof(sender_address);
+  char recv_buffer[BUFSIZE];
+  char buffer[BUFSIZE];
+  struct header h;
+  long seq_num;
+  uint64_t expected = 0;
+  uint64_t received;
+  int rebuilt = 1;
+  int size;
+  int ready;
+
+  metrics_done(); // every packet is here
+
+  // the whole file is read before FIN arrives, so that the answer is not delayed by it, which
+  // also extracts what is left of a directory, and a delta is applied to our copy so that FIN also covers the file it rebuilds
+  if(fin){
+    writer_flush(&writer);
+    expected = digest_output(fd,&digest,digest_pos,filesize,archive);
+    if(delta)
+      rebuilt = rebuild_file() == 0;
+  }
+  while(1){
+    ready = event_read(&events, fin && verdict < 0 ? 2*RECVTIMEOUT : LINGER);
+    if(!ready && fin && verdict < 0) // the file cannot be checked, its bitmap stays for the next attempt
+      error("Receiver time out...");
+    else if(!ready) // sender is done
+      break;
+    size = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &sender_address, &len);
+    if(size < 0)
+      error("Cannot receive packet");
+    metric_add(PACKETSRECEIVED,1);
+    metric_add(BYTESRECEIVED,size);
+    if(demult(recv_buffer,size,&h) < 0 || h.session != session)
+      continue;
+    if(fin && demult_fin(recv_buffer,&h,&received) == 0){
+      if(verdict < 0){
+        verdict = received == expected && rebuilt && (archive == NULL || archive_finish(archive) == 0);
+        printf("<- FIN %016llx\n",(unsigned long long)received);
+      }
+      h.flags = verdict ? 0 : BADDIGEST;
+      h.len = 0;
+      size = mult(buffer,&h,NULL);
+      if(sendto(sock, buffer, size, 0,(struct sockaddr *) &sender_address, len) < 0)
+        error("Cannot send package!");
+      printf(verdict ? "-> FIN, DIGEST OK\n" : "-> FIN, DIGEST MISMATCH\n");
+      continue;
+    }
+    if(h.type != DATA)
+      continue;
+    seq_num = h.seq_num;
+    if(seq_num < 1 || seq_num > total_packets)
+      continue;
+    metric_add(DUPPACKETS,1);
+    if(cumulative) // go-back-n requests the packet after the last one
+      seq_num = total_packets + 1;
+    size = make_ack(buffer,session,seq_num);
+    if(sendto(sock, buffer, size, 0,(struct sockaddr *) &sender_address, len) < 0)
+      error("Cannot send package!");
+    metric_add(PACKETSSENT,1);
+    metric_add(BYTESSENT,size);
+    trace(cumulative ? "-> REQUEST %ld\n" : "-> ACK %ld\n",seq_num);
+  }
+}
 
-    fr = fopen(packetname, "rb");
-    if(fr == NULL)
-      error("Cannot open file");
+void answer_signatures(int sock, struct sockaddr_in *sender_address, struct header *h, const char *packet){
+  // answers a SIGNATURE request with the signatures of our copy from block h->seq_num on, no blocks if we have no copy
+  struct sigblock sb;
+  char name[NAMESIZE+1];
+  char buffer[BUFSIZE];
+  long first = h->seq_num;
+  int size;
+  int i;
 
-    char curr_char;
-    while ((curr_char = getc(fr)) != EOF)
-      fwrite(&curr_char,1,sizeof(curr_char),fw);
+  if(h->len > NAMESIZE)
+    return;
+  memcpy(name,packet+HEADERSIZE,h->len);
+  name[h->len] = '\0';
+  if(signatures.weak == NULL || strcmp(signatures.name,name) != 0){
+    if(delta_signatures(&signatures,name) < 0)
+      printf("NO COPY OF %s\n",name);
+    else
+      printf("SIGNATURES OF %s, %ld BLOCKS OF %ld BYTES\n",name,signatures.blocks,signatures.blocksize);
+  }
+  sb.blocksize = signatures.blocksize;
+  sb.blocks = signatures.blocks;
+  sb.count = 0;
+  for(i=0; first >= 0 && first+i < signatures.blocks && i < MAXSIGS; i++){
+    sb.weak[i] = signatures.weak[first+i];
+    sb.strong[i] = signatures.strong[first+i];
+    sb.count++;
+  }
+  h->flags = 0;
+  size = mult_sigblock(buffer,h,&sb);
+  if(sendto(sock, buffer, size, 0,(struct sockaddr *) sender_address, sizeof(*sender_address)) < 0)
+    error("Cannot send package!");
+}
 
-    fclose(fr);
-    remove(packetname);
-    i++;
+int rebuild_file(){
+  // writes the output from the delta that arrived and our copy, returns 0 if it has the digest the delta names
+  int basis_fd;
+  int out_fd;
+  int result;
+  basis_fd = open(filename, O_RDONLY);
+  if(basis_fd < 0){
+    printf("NO COPY OF %s TO APPLY THE DELTA TO\n",filename);
+    return -1;
   }
-  fclose(fw);
+  out_fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out_fd < 0)
+    error("Cannot open file");
+  result = delta_apply(fd,filesize,basis_fd,out_fd);
+  close(basis_fd);
+  if(close(out_fd) < 0)
+    error("Cannot close file");
+  printf(result == 0 ? "REBUILT %s FROM DELTA\n" : "CANNOT REBUILD %s FROM DELTA\n",outname);
+  return result;
 }
 
 void error (char *e){
@@ -0,0 +1,200 @@
+/*
+  resume.c
+  Resumable Transfers with a Received Chunk Bitmap
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "resume.h"
+
+void error (char *e);
+long resume_clock();
+int compare_gaps(const void *a, const void *b);
+
+long ranges_total(struct ranges *r){
+  // number of chunks covered by the ranges
+  long total = 0;
+  int i;
+  for(i=0; i<r->count; i++)
+    total += r->length[i];
+  return total;
+}
+
+long ranges_chunk(struct ranges *r, long index){
+  // maps the index-th chunk to send, counted from 0, to its chunk in the file
+  int i;
+  for(i=0; i<r->count && index >= r->length[i]; i++)
+    index -= r->length[i];
+  return i < r->count ? r->first[i] + index : -1;
+}
+
+void ranges_all(struct ranges *r, long chunks){
+  // the whole file is missing
+  r->count = chunks > 0 ? 1 : 0;
+  r->first[0] = 0;
+  r->length[0] = chunks;
+}
+
+int resume_open(struct resume *r, const char *partname, long filesize, long mtime, long *datasize){
+  // loads the bitmap of an earlier attempt at the same file, returns 1 if the transfer can continue
+  // from it, 0 if it starts over and -1 if another transfer is writing the file
+  struct resume_header hd;
+  struct stat st;
+  long bytes;
+  int resumed = 0;
+
+  snprintf(r->name,sizeof(r->name),"%s.map",partname);
+  r->data_fd = -1;
+  r->bits = NULL;
+  r->fd = open(r->name, O_RDWR | O_CREAT, 0644);
+  if(r->fd < 0)
+    error("Cannot open bitmap file");
+  if(flock(r->fd, LOCK_EX | LOCK_NB) < 0){
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+  }
+
+  // the earlier attempt must be for the same file, and its chunks must not be larger than we accept
+  if(read(r->fd, &hd, sizeof(hd)) == sizeof(hd) && memcmp(hd.magic,RESUMEMAGIC,sizeof(hd.magic)) == 0
+     && hd.filesize == filesize && hd.mtime == mtime && hd.datasize > 0 && hd.datasize <= *datasize
+     && stat(partname, &st) == 0){
+    *datasize = hd.datasize;
+    resumed = 1;
+  }
+  r->chunks = (filesize + *datasize - 1) / *datasize;
+  bytes = r->chunks/8 + 1;
+
+  // stream processes mark their chunks in the same memory
+  r->bits = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(r->bits == MAP_FAILED)
+    error("Cannot create bitmap");
+  if(resumed && pread(r->fd, r->bits, bytes, sizeof(hd)) != bytes)
+    resumed = 0;
+  if(!resumed){
+    memset(r->bits, 0, bytes);
+    memcpy(hd.magic,RESUMEMAGIC,sizeof(hd.magic));
+    hd.filesize = filesize;
+    hd.mtime = mtime;
+    hd.datasize = *datasize;
+    if(ftruncate(r->fd, 0) < 0 || pwrite(r->fd, &hd, sizeof(hd), 0) != sizeof(hd) || pwrite(r->fd, r->bits, bytes, sizeof(hd)) != bytes)
+      error("Cannot write bitmap file");
+  }
+  r->last_checkpoint = resume_clock();
+  return resumed;
+}
+
+void resume_missing(struct resume *r, struct ranges *missing){
+  // lists the chunks not marked yet, nearby ranges are merged until they fit in MAXRANGES
+  long *first;
+  long *length;
+  long *gaps;
+  long threshold;
+  long chunk;
+  int count = 0;
+  int i;
+
+  first = malloc((r->chunks/2 + 1)*sizeof(long));
+  length = malloc((r->chunks/2 + 1)*sizeof(long));
+  if(first == NULL || length == NULL)
+    error("Cannot create ranges");
+  for(chunk=0; chunk<r->chunks; chunk++){
+    if(r->bits[chunk/8] & (1 << chunk%8))
+      continue;
+    if(count > 0 && first[count-1] + length[count-1] == chunk)
+      length[count-1]++;
+    else{
+      first[count] = chunk;
+      length[count] = 1;
+      count++;
+    }
+  }
+
+  // resending a few received chunks is cheaper than a longer list, so the smallest gaps are closed first
+  if(count > MAXRANGES){
+    gaps = malloc((count-1)*sizeof(long));
+    if(gaps == NULL)
+      error("Cannot create ranges");
+    for(i=1; i<count; i++)
+      gaps[i-1] = first[i] - (first[i-1] + length[i-1]);
+    qsort(gaps, count-1, sizeof(long), compare_gaps);
+    threshold = gaps[count-MAXRANGES-1];
+    free(gaps);
+    missing->count = 0;
+    for(i=0; i<count; i++){
+      if(missing->count > 0 && first[i] - (missing->first[missing->count-1] + missing->length[missing->count-1]) <= threshold)
+        missing->length[missing->count-1] = first[i] + length[i] - missing->first[missing->count-1];
+      else{
+        missing->first[missing->count] = first[i];
+        missing->length[missing->count] = length[i];
+        missing->count++;
+      }
+    }
+  }else{
+    missing->count = count;
+    memcpy(missing->first, first, count*sizeof(long));
+    memcpy(missing->length, length, count*sizeof(long));
+  }
+  free(first);
+  free(length);
+}
+
+void resume_mark(struct resume *r, long chunk){
+  // records a written chunk, the bitmap reaches the disk at the next checkpoint
+  if(r->fd < 0 || chunk < 0 || chunk >= r->chunks)
+    return;
+  __atomic_fetch_or(&r->bits[chunk/8], 1 << chunk%8, __ATOMIC_RELAXED);
+  if(resume_clock() - r->last_checkpoint >= CHECKPOINT)
+    resume_checkpoint(r);
+}
+
+void resume_checkpoint(struct resume *r){
+  // makes the written chunks durable before the bitmap that claims them
+  if(r->fd < 0)
+    return;
+  if(r->data_fd >= 0)
+    fdatasync(r->data_fd);
+  if(pwrite(r->fd, r->bits, r->chunks/8 + 1, sizeof(struct resume_header)) < 0)
+    error("Cannot write bitmap file");
+  r->last_checkpoint = resume_clock();
+}
+
+void resume_close(struct resume *r){
+  // saves the bitmap so that a later INIT for the same file continues from it
+  if(r->fd < 0)
+    return;
+  resume_checkpoint(r);
+  close(r->fd);
+  munmap(r->bits, r->chunks/8 + 1);
+  r->fd = -1;
+}
+
+void resume_finish(struct resume *r){
+  // the file is complete, the bitmap is not needed anymore
+  if(r->fd < 0)
+    return;
+  unlink(r->name);
+  close(r->fd);
+  munmap(r->bits, r->chunks/8 + 1);
+  r->fd = -1;
+}
+
+long resume_clock(){
+  // monotonic clock in milliseconds
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000L + ts.tv_nsec/1000000;
+}
+
+int compare_gaps(const void *a, const void *b){
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,43 @@
+/*
+  resume.h
+  Resumable Transfers with a Received Chunk Bitmap
+*/
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "packet.h"
+
+// constant values
+#define CHECKPOINT 1000 // milliseconds between bitmap checkpoints
+#define RESUMEMAGIC "UDPFTMAP"
+
+// bitmap of the chunks written to a partial output file, kept in a file next to it
+struct resume {
+  int fd; // bitmap file, -1 if the transfer cannot be resumed
+  int data_fd; // partial output file, synced before every checkpoint
+  unsigned char *bits; // shared with the stream processes
+  long chunks;
+  long last_checkpoint;
+  char name[NAMESIZE+16];
+};
+
+// first part of the bitmap file, the bits follow
+struct resume_header {
+  char magic[8];
+  long filesize;
+  long mtime;
+  long datasize;
+};
+
+long ranges_total(struct ranges *r);
+long ranges_chunk(struct ranges *r, long index);
+void ranges_all(struct ranges *r, long chunks);
+int resume_open(struct resume *r, const char *partname, long filesize, long mtime, long *datasize);
+void resume_missing(struct resume *r, struct ranges *missing);
+void resume_mark(struct resume *r, long chunk);
+void resume_checkpoint(struct resume *r);
+void resume_close(struct resume *r);
+void resume_finish(struct resume *r);
+
+#endif
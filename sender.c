@@ -15,58 +15,174 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/ip.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <math.h>
-
-// packet types
-#define INIT '0'
-#define DATA '1'
-#define ACK '2'
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include "packet.h"
+#include "cc.h"
+#include "batch.h"
+#include "resume.h"
+#include "checksum.h"
+#include "fec.h"
+#include "delta.h"
+#include "compress.h"
+#include "archive.h"
+#include "metrics.h"
+#include "event.h"
 
 // constant values
-#define DATASIZE 1024
-#define FILENAMESIZE 56
-#define BUFSIZE 1200
-#define MAXTRIES 3
-#define RTT 500000
+#define BUFSIZE MAXPACKETSIZE
+#define MAXTRIES 8
+#define PROBETRIES 2
+#define PROBESTEP 16
+#define INITRTO 500000
+#define MINRTO 2000
+#define MAXRTO 8000000
+#define PACEBURST 4
+#define SIGWINDOW 32 // SIGNATURE requests in flight while the signatures are fetched
+#define DUPTHRESH 3 // duplicate ACKs that make the Go-Back-N sender resend the window before its timer expires
+
+// retransmission timeout estimator, all times in microseconds
+struct rtt_estimator {
+  long srtt; // smoothed round trip time, 0 until the first sample
+  long rttvar; // round trip time variation
+  long rto; // current retransmission timeout, including backoff
+};
+
+// a run of consecutive chunks read by the compression worker, compressed if it is a whole block
+struct cslot {
+  long seq; // packet of the first chunk, 0 while the slot is free
+  int count; // packets of the run
+  int ready;
+  long offset; // file offset of the first chunk
+  int size; // bytes of the file in the run
+  int packed; // compressed size, 0 if the chunks are sent as they are
+  char *raw;
+  char *packed_data;
+};
 
 // function definitions
 void error (char *e);
-void mult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]);
-void demult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]);
-void stop_and_wait();
-void gobackn(long N);
+int open_socket(struct sockaddr_in *receiver_address);
+long handshake(int sock, struct sockaddr_in *receiver_address, int flags, long seq_num);
+int make_data(char *buffer, long seq_num, const char **payload);
+int send_data(int sock, struct sockaddr_in *address, const char *buffer, int size, const char *payload);
+void compress_start();
+void *compress_worker(void *arg);
+int compressed_chunk(long seq_num, char *data, int *flags);
+void compress_release(long seq_num);
+void compress_end();
+void fec_feed(const char *data, int size, long seq_num);
+void send_repairs(int sock, struct sockaddr_in *receiver_address, long seq_num);
+long probe_mtu(int sock, struct sockaddr_in *receiver_address);
+int send_probe(int sock, struct sockaddr_in *receiver_address, int size);
+int fetch_signatures(int sock, struct sockaddr_in *receiver_address);
+void delta_source(int sock, struct sockaddr_in *receiver_address);
+void transfer(int sock, struct sockaddr_in receiver_address, long seq_num);
+void transfer_streams(struct sockaddr_in receiver_address, long seq_num);
+void finish(int sock, struct sockaddr_in receiver_address);
+void stop_and_wait(int sock, struct sockaddr_in receiver_address, long seq_num);
+void gobackn(int sock, struct sockaddr_in receiver_address, long N);
+void selective_repeat(int sock, struct sockaddr_in receiver_address, long N);
+long now_usec();
+void rtt_init(struct rtt_estimator *r);
+void rtt_sample(struct rtt_estimator *r, long sample);
+long rtt_timeout(struct rtt_estimator *r);
+void rtt_backoff(struct rtt_estimator *r);
+int pace_ready();
+void pace_sent();
+void open_source(const char *filename);
+void read_source(char *data, long size, long offset);
+int read_chunk(long seq_num, char *data);
+const char *mapped_chunk(long seq_num, int *size);
+void digest_chunk(long offset, const char *data, long size);
+long chunk_bytes(long seq_num);
+void release_chunks(long seq_num);
+uint64_t file_digest();
+int check_ranges(struct ranges *r, long datasize);
+void close_source();
 
 // global variables
 int port;
 char *hostname;;
 int mode;
+int selective = 0;
 char *filename;
 long filesize;
-char * filebuffer;
+long datasize = DATASIZE;
+int probing = 0;
+int streams = 1;
+int stream_ports[MAXSTREAMS];
+int fec_k = 0; // data packets per FEC block, 0 without FEC
+int fec_r = 0; // repair packets per FEC block
+char *repairs[MAXREPAIR]; // repair packets of the block being sent
+long mtime; // modification time, a resumed transfer must be of the same file
+int delta = 0; // send only what the receiver's copy of the file lacks
+struct signatures signatures; // block signatures of the receiver's copy
+int compress = 0; // offer to compress the data
+long block_chunks = 0; // chunks per compressed block, 0 unless the receiver decompresses
+struct cslot *cslots = NULL; // runs prepared by the compression worker, in packet order
+long cslot_count;
+long cslot_head = 0; // next slot the worker fills
+long cslot_tail = 0; // oldest slot still in use
+long compress_base = 1; // oldest packet not acknowledged, the worker stays close to it
+int compress_stop = 0;
+long compress_in = 0; // bytes of the whole blocks and their compressed size
+long compress_out = 0;
+pthread_t compress_thread;
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+int directory = 0; // filename is a directory, its tree is sent as one archive
+struct archive archive;
+struct ranges missing; // chunks the receiver asked for
+long first_index = 0; // index of the first packet this process sends
+long stream_packets; // number of packets this process sends
+int file_fd = -1;
+char * filemap = NULL;
+long released = 0;
+struct digest digest; // digest of the file up to digest_pos, fed while chunks are read in order
+long digest_pos = 0;
 char buffer[BUFSIZE];
 char recv_buffer[BUFSIZE];
-int phase = 0;
-long random_packet;
+uint32_t session;
+struct rtt_estimator rtt;
+int maxtries = MAXTRIES;
+struct cc cc;
+const struct cc_ops *algorithm = NULL;
+int pacing = 0;
+int offload = 0;
+long next_departure = 0;
+struct events events; // socket readiness and retransmission timers of the data transfer
+char *control_path = NULL; // unix socket that serves the metrics while the transfer runs
 
 int mode_exist = 0;
 int port_exist = 0;
 int hostname_exist = 0;
 int filename_exist = 0;
-int test_exist = 0;
-int test_case = 0;
 
 int main(int argc, char** argv){
 
-  FILE * file;
-  size_t res;
   int i;
+  int sock;
+  struct sockaddr_in receiver_address;
+  long seq_num;
+  int flags;
 
   // parse command line input
   for (i=0; i<argc; i++){ // mode
     if(strcmp(argv[i],"-m")==0){
-      mode = atoi(argv[i+1]);
+      if(strncmp(argv[i+1],"sr:",3)==0){ // selective repeat with window size N
+        selective = 1;
+        mode = atoi(argv[i+1]+3);
+      }
+      else
+        mode = atoi(argv[i+1]);
       mode_exist = 1;
     }
     else if(strcmp(argv[i],"-p")==0){ // port
@@ -81,64 +197,344 @@ int main(int argc, char** argv){
       filename = argv[i+1];
       filename_exist = 1;
     }
-    else if(strcmp(argv[i],"-t")==0){ // test case
-      test_exist = 1;
-      test_case = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-r")==0){ // retry budget
+      maxtries = atoi(argv[i+1]);
+      if(maxtries < 1)
+        maxtries = 1;
+    }
+    else if(strcmp(argv[i],"-c")==0){ // congestion control algorithm
+      algorithm = cc_find(argv[i+1]);
+      if(algorithm == NULL)
+        error("Unknown congestion control algorithm!");
+    }
+    else if(strcmp(argv[i],"-P")==0){ // pacing
+      pacing = 1;
+    }
+    else if(strcmp(argv[i],"-G")==0){ // segmentation offload
+      offload = 1;
+    }
+    else if(strcmp(argv[i],"-s")==0){ // chunk size
+      datasize = atol(argv[i+1]);
+      if(datasize < 1 || datasize > MAXDATASIZE)
+        error("Chunk size out of range!");
+    }
+    else if(strcmp(argv[i],"-M")==0){ // path MTU probing
+      probing = 1;
+    }
+    else if(strcmp(argv[i],"-j")==0){ // parallel streams
+      streams = atoi(argv[i+1]);
+      if(streams < 1 || streams > MAXSTREAMS)
+        error("Number of streams out of range!");
+    }
+    else if(strcmp(argv[i],"-F")==0){ // forward error correction, R repair packets per K data packets
+      fec_k = atoi(argv[i+1]);
+      fec_r = strchr(argv[i+1],':') != NULL ? atoi(strchr(argv[i+1],':')+1) : 1;
+      if(fec_k < 1 || fec_k > MAXBLOCK || fec_r < 1 || fec_r > MAXREPAIR)
+        error("FEC block out of range!");
+    }
+    else if(strcmp(argv[i],"-D")==0){ // delta against the receiver's copy
+      delta = 1;
+    }
+    else if(strcmp(argv[i],"-z")==0){ // compression
+      compress = 1;
+    }
+    else if(strcmp(argv[i],"-v")==0){ // a line for every packet
+      log_level = LOGTRACE;
+    }
+    else if(strcmp(argv[i],"-S")==0){ // metrics control socket
+      control_path = argv[i+1];
     }
   }
 
   if(!mode_exist || !port_exist || !filename_exist ||!hostname_exist){
     printf("\tUsage:\n\
-          [-m mode] [-p port] [-f filename] [-h hostname] <-t test>\n\
+          [-m mode|sr:N] [-p port] [-f filename|directory] [-h hostname] <-r tries> <-c reno|vegas|fixed> <-P> <-G> <-s chunksize> <-M> <-j streams> <-F K:R> <-D> <-z> <-v> <-S socket>\n\
           [required] <optional>\n");
     exit(1);
   }
+  if(fec_k > 0 && !selective && mode < 2)
+    error("FEC needs go-back-n or selective repeat!");
+  if(fec_k > 0 && compress)
+    error("FEC cannot be combined with compression!");
+
+  // the metrics are reported when the process exits, and on request while it runs
+  metrics_init();
+  if(control_path != NULL)
+    metrics_serve(control_path);
+
+  // open file and get the size of the file, data is read chunk by chunk while sending
+  for(i=strlen(filename); i>1 && filename[i-1]=='/'; i--) // the receiver names its copy after the last component
+    filename[i-1] = '\0';
+  open_source(filename);
+  if(delta && directory)
+    error("Delta transfers need a single file!");
+  digest_init(&digest);
+
+  // every transfer gets its own session id, the receiver ignores packets of other sessions
+  srand(time(NULL) ^ getpid());
+  session = rand();
 
-  // open file and get the size of the file
-  file = fopen(filename,"rb");
-  if(file == NULL)
-    error("Cannot open file!");
-  fseek (file , 0 , SEEK_END);
-  filesize = ftell (file);
-  rewind (file);
+  // begin transmission
+  rtt_init(&rtt);
+  if(algorithm == NULL)
+    algorithm = cc_find("reno");
+  cc_init(&cc, algorithm, mode);
+  sock = open_socket(&receiver_address);
+  event_open(&events,sock);
+  if(delta) // from here on the delta is sent in place of the file
+    delta_source(sock,&receiver_address);
+  flags = (delta ? DELTA : 0) | (compress ? COMPRESS : 0) | (directory ? ARCHIVE : 0);
+  if(selective || mode > 1){ // the receiver requests the first packet
+    seq_num = handshake(sock,&receiver_address,(selective ? SRMODE : 0) | flags,1);
+    if(seq_num != 1)
+      error("Unknown response!");
+  }else
+    seq_num = handshake(sock,&receiver_address,flags,0);
+
+  if(streams == 1){
+    stream_packets = ranges_total(&missing);
+    transfer(sock,receiver_address,seq_num);
+  }
+  else
+    transfer_streams(receiver_address,seq_num);
 
-  // store the file content in a buffer
-  filebuffer = (char*) malloc (sizeof(char)*filesize);
-  if(filebuffer == NULL)
-    error("Cannot create file buffer!");
+  // the receiver checks the whole file against our digest
+  finish(sock,receiver_address);
+  event_close(&events);
+  close(sock);
+  close_source();
+  return 0;
+}
 
-  if(fread(filebuffer,1,filesize,file) != filesize)
-    error("Cannot read file");
+void transfer(int sock, struct sockaddr_in receiver_address, long seq_num){
+  // sends the range of the file given to this process over sock
+  if(block_chunks > 0)
+    compress_start();
+  if (selective && mode > 0) // selective repeat with windows size N=mode
+    selective_repeat(sock,receiver_address,mode);
+  else if (mode == 1) // stop and wait
+    stop_and_wait(sock,receiver_address,seq_num);
+  else if(mode > 1) // go-back-n with windows size N=mode
+    gobackn(sock,receiver_address,mode);
+  metrics_done();
+  if(block_chunks > 0)
+    compress_end();
+  batch_stats();
+}
 
-  fclose(file);
+void transfer_streams(struct sockaddr_in receiver_address, long seq_num){
+  // splits the packets into contiguous shares, each sent by its own process to its own receiver port
+  long total_packets = ranges_total(&missing);
+  long first;
+  long last;
+  pid_t pids[MAXSTREAMS];
+  int status;
+  int failed = 0;
+  int sock;
+  int i;
 
-  // begin transmission
-  if (mode == 1) // stop and wait
-    stop_and_wait();
-  else if(mode > 1) // go-back-n with windows size N=mode
-    gobackn(mode);
+  fflush(stdout); // children must not inherit buffered output
+  for(i=0; i<streams; i++){
+    first = total_packets*i/streams;
+    last = total_packets*(i+1)/streams;
+    pids[i] = fork();
+    if(pids[i] < 0)
+      error("Cannot create stream!");
+    if(pids[i] == 0){ // every stream has its own socket, window and timers
+      prctl(PR_SET_PDEATHSIG, SIGTERM); // a stream does not outlive the transfer
+      port = stream_ports[i];
+      session = session + i;
+      first_index = first;
+      stream_packets = last - first;
+      if(stream_packets > 0)
+        released = ranges_chunk(&missing,first)*datasize / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+      printf("STREAM %d: PACKETS %ld-%ld\n",i,first+1,last);
+      event_close(&events);
+      sock = open_socket(&receiver_address);
+      event_open(&events,sock);
+      transfer(sock,receiver_address,seq_num);
+      exit(0);
+    }
+  }
+
+  // the digest is computed while the streams send
+  file_digest();
+
+  // the transfer succeeds only if every stream does
+  for(i=0; i<streams; i++)
+    if(waitpid(pids[i],&status,0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+  if(failed)
+    error("Stream failed!");
+}
+
+void finish(int sock, struct sockaddr_in receiver_address){
+  // sends FIN with the digest of the file until the receiver answers whether its copy matches
+  struct header h;
+  uint64_t value = file_digest();
+  int size;
+  int n;
+  int tries = 0;
+  long timeout;
+  long sent_at;
+  long wait;
+  socklen_t len = sizeof(receiver_address);
+
+  h.flags = 0;
+  h.session = session;
+  h.seq_num = 0;
+  size = mult_fin(buffer,&h,value);
+
+  // the receiver may still be reading its file, so FIN is not retried faster than INIT
+  timeout = rtt_timeout(&rtt) > INITRTO ? rtt_timeout(&rtt) : INITRTO;
+  while(1){
+    if(tries >= maxtries) // terminate connection if there is no progress after maxtries tries
+      error("Sender time out...\n");
+    tries++;
+    if(sendto(sock, buffer, size, 0,(struct sockaddr *) &receiver_address, len) < 0)
+      error("Cannot send package!");
+    printf("-> FIN %016llx\n",(unsigned long long)value);
+    sent_at = now_usec();
+    while((wait = sent_at + timeout - now_usec()) > 0 && event_read(&events, wait)){
+      n = recvfrom(sock, recv_buffer, BUFSIZE, 0, NULL, NULL);
+      if(n < 0 || demult(recv_buffer,n,&h) < 0 || h.type != FIN || h.session != session)
+        continue; // a late ACK of a data packet
+      if(h.flags & BADDIGEST)
+        error("File digest mismatch!");
+      printf("<- FIN, DIGEST OK\n");
+      return;
+    }
+    printf("TIMEOUT-%d FOR FIN\n",tries);
+    timeout = timeout*2 < MAXRTO ? timeout*2 : MAXRTO;
+  }
+}
 
+int fetch_signatures(int sock, struct sockaddr_in *receiver_address){
+  // asks for the block signatures of the receiver's copy, SIGWINDOW answers at a time,
+  // returns -1 if the receiver has no copy or does not answer
+  struct header h;
+  struct sigblock sb;
+  char *got = NULL; // answers that arrived, known once the first one tells the number of blocks
+  long answers = 1;
+  long received = 0;
+  long asked;
+  long index;
+  long i;
+  int size;
+  int tries = 0;
+  long timeout = INITRTO; // the receiver reads its whole copy before the first answer
+  long sent_at;
+  long wait;
+  socklen_t len = sizeof(*receiver_address);
+
+  while(received < answers){
+    if(tries >= maxtries){
+      free(got);
+      return -1;
+    }
+    tries++;
+
+    // ask again for the first answers that are still missing
+    h.flags = 0;
+    h.session = session;
+    h.type = SIGNATURE;
+    h.len = strlen(filename) < NAMESIZE ? strlen(filename) : NAMESIZE;
+    for(i=0, asked=0; i<answers && asked<SIGWINDOW; i++){
+      if(got != NULL && got[i])
+        continue;
+      h.seq_num = i*MAXSIGS;
+      size = mult(buffer,&h,filename);
+      if(sendto(sock, buffer, size, 0,(struct sockaddr *) receiver_address, len) < 0)
+        error("Cannot send package!");
+      asked++;
+    }
+    printf("-> SIGNATURE x%ld\n",asked);
+
+    sent_at = now_usec();
+    while(asked > 0 && (wait = sent_at + timeout - now_usec()) > 0 && event_read(&events, wait)){
+      size = recvfrom(sock, recv_buffer, BUFSIZE, 0, NULL, NULL);
+      if(size < 0 || demult(recv_buffer,size,&h) < 0 || h.session != session || demult_sigblock(recv_buffer,&h,&sb) < 0)
+        continue;
+      if(sb.blocks == 0){ // nothing to build a delta against
+        free(got);
+        return -1;
+      }
+      if(got == NULL){ // the first answer sizes the signatures
+        if(sb.blocksize < MINBLOCKSIZE || sb.blocksize > MAXBLOCKSIZE)
+          return -1;
+        signatures.blocksize = sb.blocksize;
+        signatures.blocks = sb.blocks;
+        signatures.weak = malloc(sb.blocks*sizeof(uint32_t));
+        signatures.strong = malloc(sb.blocks*sizeof(uint64_t));
+        answers = (sb.blocks + MAXSIGS - 1) / MAXSIGS;
+        got = calloc(answers, 1);
+        if(signatures.weak == NULL || signatures.strong == NULL || got == NULL)
+          error("Cannot create signatures!");
+      }
+      index = h.seq_num / MAXSIGS;
+      if(sb.blocksize != signatures.blocksize || sb.blocks != signatures.blocks || h.seq_num < 0 || h.seq_num % MAXSIGS != 0
+         || index >= answers || got[index] || sb.count != (sb.blocks - h.seq_num < MAXSIGS ? sb.blocks - h.seq_num : MAXSIGS))
+        continue;
+      memcpy(signatures.weak + h.seq_num, sb.weak, sb.count*sizeof(uint32_t));
+      memcpy(signatures.strong + h.seq_num, sb.strong, sb.count*sizeof(uint64_t));
+      got[index] = 1;
+      received++;
+      tries = 0;
+      asked--;
+    }
+    if(asked > 0 && tries > 0){
+      printf("TIMEOUT-%d FOR SIGNATURE\n",tries);
+      timeout = timeout*2 < MAXRTO ? timeout*2 : MAXRTO;
+    }
+  }
+  free(got);
+  printf("<- SIGNATURE, %ld BLOCKS OF %ld BYTES\n",signatures.blocks,signatures.blocksize);
   return 0;
 }
 
-void stop_and_wait(){
+void delta_source(int sock, struct sockaddr_in *receiver_address){
+  // replaces the file with its delta against the receiver's copy, which is then sent like any file,
+  // the whole file is sent if the receiver has no copy or the delta would not be smaller
+  struct digest d;
+  FILE *tmp;
+  long size;
+
+  if(filemap == NULL || fetch_signatures(sock,receiver_address) < 0){
+    printf("No copy on the receiver, sending the whole file\n");
+    delta = 0;
+    return;
+  }
+  tmp = tmpfile();
+  if(tmp == NULL)
+    error("Cannot create delta!");
+  size = delta_encode(fileno(tmp),filemap,filesize,&signatures);
+  printf("DELTA: %ld BYTES FOR A %ld BYTE FILE\n",size,filesize);
+  if(size >= filesize){
+    fclose(tmp);
+    delta = 0;
+    return;
+  }
+
+  // a resumed delta must be against the same copy too, so the signatures are part of its key
+  digest_init(&d);
+  digest_update(&d,signatures.strong,signatures.blocks*sizeof(uint64_t));
+  mtime ^= digest_final(&d);
+  delta_free(&signatures);
+
+  close_source();
+  file_fd = fileno(tmp);
+  filesize = size;
+  filemap = mmap(NULL, filesize, PROT_READ, MAP_SHARED, file_fd, 0);
+  if(filemap == MAP_FAILED)
+    filemap = NULL;
+  else
+    madvise(filemap, filesize, MADV_SEQUENTIAL);
+}
+
+int open_socket(struct sockaddr_in *receiver_address){
+  // creates the socket and builds the receiver address
   int sock;
-  struct sockaddr_in receiver_address;
   struct hostent *receiver;
-  long seq_num;
-  char type;
-  char data[DATASIZE];
-  char FNAME[FILENAMESIZE];
-  int tries;
-  int go;
-  int to_status;
-  struct timeval timeout;
-  int microsecond = RTT;
-  int sent = 0;
-  int sent_data;
-  socklen_t len;
-  fd_set fdset;
-  long total_packets;
 
   // create socket
   sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -151,345 +547,1008 @@ void stop_and_wait(){
     error("Receiver cannot be found!");
 
   // build receiver address
-  memset(&receiver_address, 0, sizeof(receiver_address));
-  receiver_address.sin_family = AF_INET;
-  memcpy(&receiver_address.sin_addr, receiver->h_addr, sizeof(receiver_address.sin_addr));
-  receiver_address.sin_port = htons(port);
-
-  // create INIT packet
-  type = INIT;
-  bzero(FNAME,sizeof(FNAME));
-  memcpy(FNAME,&(*filename),strlen(filename));
-  seq_num = 0;
-  bzero(data,DATASIZE);
-  mult(buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
-
-  // calculate total number of data packets
-  total_packets = (long)ceil((double)filesize/(double)DATASIZE);
-
-  len = sizeof(receiver_address);
-
-  // set timeout
-  FD_ZERO (&fdset);
-  FD_SET  (sock, &fdset);
-  timeout.tv_sec = 0;
-  timeout.tv_usec = RTT;
-  tries = 0;
-  go = 0;
+  memset(receiver_address, 0, sizeof(*receiver_address));
+  receiver_address->sin_family = AF_INET;
+  memcpy(&receiver_address->sin_addr, receiver->h_addr, sizeof(receiver_address->sin_addr));
+  receiver_address->sin_port = htons(port);
+
+  // hand runs of packets to the kernel as one buffer if it can segment them
+  if(offload && !batch_offload(sock))
+    printf("Segmentation offload is not available\n");
+  return sock;
+}
 
-  // send INIT packet up to MAXTRIES times until an ACK is received
-  while(tries < MAXTRIES){
+long handshake(int sock, struct sockaddr_in *receiver_address, int flags, long seq_num){
+  // sends INIT until it is acknowledged and returns the sequence number carried by the ACK
+  struct header h;
+  struct init in;
+  struct initack ack;
+  struct sockaddr_in from;
+  int size;
+  int n;
+  int tries = 0;
+  int acked = 0;
+  long sent_at;
+  long wait;
+  int i;
+  socklen_t len = sizeof(*receiver_address);
+  socklen_t fromlen = sizeof(from);
+
+  // discover the largest datagram the path carries and use it as the chunk size
+  if(probing)
+    datasize = probe_mtu(sock, receiver_address) - OVERHEAD;
+
+  // create INIT packet, the only packet that carries the file name and size
+  h.flags = flags;
+  h.session = session;
+  h.seq_num = seq_num;
+  in.filesize = filesize;
+  in.window = mode;
+  in.datasize = datasize;
+  in.streams = streams;
+  in.mtime = mtime;
+  in.fec = fec_k;
+  strncpy(in.filename,filename,NAMESIZE);
+  in.filename[NAMESIZE] = '\0';
+  size = mult_init(buffer,&h,&in);
+
+  // send INIT packet up to maxtries times until its ACK arrives, late answers to SIGNATURE and PROBE are skipped
+  while(!acked){
+    if(tries >= maxtries) // terminate connection if there is no progress after maxtries tries
+      error("Sender time out...\n");
     tries++;
-    sent_data = sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len);
-    if( sent_data < 0)
+    if(sendto(sock, buffer, size, 0,(struct sockaddr *) receiver_address, len) < 0)
       error("Cannot send package!");
+    sent_at = now_usec();
     printf("-> INIT\n");
-    if(test_case == 1 && phase == 0){ // test case 1
-      to_status = 0;
-      phase = 1;
+    while(!acked && (wait = sent_at + rtt_timeout(&rtt) - now_usec()) > 0 && event_read(&events, wait)){
+      n = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &from, &fromlen);
+      if(n < 0 || demult(recv_buffer,n,&h) < 0 || h.type != ACK || h.session != session)
+        continue;
+      if(h.flags & REFUSED)
+        error("Transfer refused!");
+      // sender only accepts the ACK of INIT for its session
+      if(demult_initack(recv_buffer,&h,&ack) < 0)
+        error("Unknown response!\n");
+      if(ack.datasize < 1 || ack.datasize > in.datasize || ack.streams > in.streams || check_ranges(&ack.missing,ack.datasize) < 0)
+        error("Unknown response!\n");
+      // only an INIT that was sent once gives an unambiguous sample
+      if(tries == 1)
+        rtt_sample(&rtt, now_usec() - sent_at);
+      *receiver_address = from;
+      acked = 1;
     }
-    else
-      to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-    if(to_status < 0) // error
-      error("Select error");
-    else if(to_status == 0){ // timeout
+    if(!acked){
       printf("TIMEOUT-%d FOR INIT\n",tries);
-      timeout.tv_usec = (tries+1) * RTT; // try again with higher timeout
-    }else{ // success
-      go = 1;
-      break;
+      rtt_backoff(&rtt); // try again with higher timeout
     }
   }
 
-  // terminate connection if there is no progress after MAXTRIES tries
-  if(!go)
-    error("Sender time out...\n");
-
-  // receive packet from receiver
-  if(recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, &len) < 0)
-    error("No response!\n");
-
-  // get the packet content
-  demult(recv_buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
+  // the receiver may accept a smaller chunk and fewer streams than proposed
+  datasize = ack.datasize;
+  streams = ack.streams;
+  memcpy(stream_ports,ack.ports,sizeof(stream_ports));
+  missing = ack.missing;
+  if(h.flags & COMPRESS) // the receiver decompresses, blocks are split across the packets of their chunks
+    block_chunks = compress_chunks(datasize);
+  batch_init(OVERHEAD + datasize);
+  for(i=0; i<fec_r; i++){ // built up while the data packets of a block leave
+    repairs[i] = malloc(datasize);
+    if(repairs[i] == NULL)
+      error("Cannot create repair buffer!");
+  }
+  printf("<- ACK INIT, CHUNK SIZE %ld, %d STREAMS%s\n",datasize,streams,block_chunks > 0 ? ", COMPRESSED" : "");
+  if(ranges_total(&missing) < (long)ceil((double)filesize/(double)datasize))
+    printf("RESUMING, %ld OF %ld PACKETS MISSING\n",ranges_total(&missing),(long)ceil((double)filesize/(double)datasize));
+  return h.seq_num;
+}
 
-  // sender only accepts packets of type ACK
-  if(type != ACK)
-    error("Unknown response!\n");
+void stop_and_wait(int sock, struct sockaddr_in receiver_address, long seq_num){
+  struct header h;
+  int size;
+  int n;
+  int tries;
+  int go;
+  int expired;
+  long sent_at;
+  struct timer retransmit;
+  const char *payload;
+  int sent_data;
+  socklen_t len;
+  long total_packets;
 
-  printf("<- ACK INIT\n");
+  len = sizeof(receiver_address);
 
-  phase = 0;
-  srand(time(NULL));
-  random_packet = rand()%total_packets+1;
+  // number of data packets this process sends
+  total_packets = stream_packets;
+  memset(&retransmit, 0, sizeof(retransmit));
 
   // send the file
-  while(sent < filesize){
-    // divide the file into chunks
-    type = DATA;
+  while(seq_num < total_packets){
+    // divide the file into chunks and create the DATA packet
     seq_num++;
-    bzero(data,DATASIZE);
-    memcpy(data,filebuffer+sent,DATASIZE);
+    size = make_data(buffer,seq_num,&payload);
 
-    // create the DATA packet
-    mult(buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
-
-    //set timeout
-    timeout.tv_sec = 0;
-    timeout.tv_usec = RTT;
     tries = 0;
     go = 0;
 
-    // send DATA packet up to MAXTRIES times until an ACK is received
-    while(tries < MAXTRIES){
-      FD_ZERO (&fdset);
-      FD_SET  (sock, &fdset);
+    // send DATA packet up to maxtries times until an ACK is received
+    while(tries < maxtries){
       tries++;
-      if(test_case == 2 && phase == 0 && seq_num == random_packet){
-        phase = 1;
-        receiver_address.sin_port = htons(port-1);
-        sent_data = sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len);
-        if( sent_data < 0)
-          error("Cannot send package!");
-        printf("-> PACKET %ld\n",seq_num);
-      }
-      else if(test_case == 3 && seq_num == random_packet){
-        receiver_address.sin_port = htons(port-1);
-        sent_data = sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len);
-        if( sent_data < 0)
-          error("Cannot send package!");
-        printf("-> PACKET %ld\n",seq_num);
-      }else{
-        receiver_address.sin_port = htons(port);
-        sent_data = sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len);
-        if( sent_data < 0)
-          error("Cannot send package!");
-        printf("-> PACKET %ld\n",seq_num);
+      sent_data = send_data(sock,&receiver_address,buffer,size,payload);
+      if( sent_data < 0)
+        error("Cannot send package!");
+      trace("-> PACKET %ld\n",seq_num);
+      sent_at = now_usec();
+      timer_set(&events,&retransmit,sent_at + rtt_timeout(&rtt));
+      expired = 0;
+      metric_add(PACKETSSENT,1);
+      metric_add(BYTESSENT,size);
+      if(tries > 1)
+        metric_add(RETRANSMITS,1);
+
+      // wait for the ACK of this packet, late ACKs of earlier copies are skipped
+      while(!go && !expired){
+        if(event_wait(&events) & EVENTREAD){
+          n = recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, &len);
+          if(n < 0)
+            error("No response!");
+          metric_add(PACKETSRECEIVED,1);
+          metric_add(BYTESRECEIVED,n);
+          if(demult(recv_buffer,n,&h) == 0 && h.type == ACK && h.session == session && h.seq_num == seq_num)
+            go = 1;
+        }
+        expired = timer_expired(&events) != NULL;
       }
-      to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-      if(to_status < 0) // error
-        error("Select error");
-      else if(to_status == 0){ // timeout
-        printf("TIMEOUT-%d FOR PACKET %ld\n",tries,seq_num);
-        timeout.tv_usec = (tries+1) * RTT; // try again with higher timeout
-      }else{ // success
-        go = 1;
+      if(go){ // success
+        timer_stop(&events,&retransmit);
         break;
       }
+      trace("TIMEOUT-%d FOR PACKET %ld\n",tries,seq_num);
+      metric_add(TIMEOUTS,1);
+      rtt_backoff(&rtt); // try again with higher timeout
     }
 
     if(go==1){ // if we receive a packet
-      sent = sent + sizeof(data); // increment data chunk pointer
-      if(recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, &len) < 0)
-        error("No response!");
-
-      // get packet contents
-      demult(recv_buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
+      // Karn's rule, retransmitted packets give no RTT sample
+      if(tries == 1)
+        rtt_sample(&rtt, now_usec() - sent_at);
 
-      if(type != ACK)
-        error("Unknown response!");
-
-      printf("<- ACK %ld\n",seq_num);
+      trace("<- ACK %ld\n",seq_num);
+      metric_add(GOODBYTES,chunk_bytes(seq_num));
+      release_chunks(seq_num+1);
     }
-    else // terminate connection if there is no progress after MAXTRIES tries
+    else // terminate connection if there is no progress after maxtries tries
       error("Sender timeout...\n");
   }
-  close(sock);
   printf("Transmission complete\n");
 }
 
-void gobackn(long N){
-  int sock;
-  struct sockaddr_in receiver_address;
-  struct hostent *receiver;
+void gobackn(int sock, struct sockaddr_in receiver_address, long N){
   long req_num;
   long seq_num;
   long base = 1;
   long max = N;
-  char type;
-  char data[DATASIZE];
-  char FNAME[FILENAMESIZE];
+  long top = 1; // lowest sequence number that was never sent
+  long rewound = 0; // base the window was last sent again from, its duplicate ACKs are expected
+  long recover = 0; // losses below this sequence number belong to a congestion event already handled
+  int dupacks = 0; // duplicate ACKs for the current base
+  struct header h;
+  int size;
+  const char *payload; // the chunk in the mapped file, sent without a copy
   int tries;
-  int sent = 0;
   long total_packets;
-  socklen_t len;
-  struct timeval timeout;
-  fd_set fdset;
-  int to_status;
-  int go;
-  int sent_data;
+  int ready;
+  long now;
+  struct timer retransmit; // runs for the oldest unacknowledged packet
+  struct timer pacer; // wakes the loop when the pacer lets the next packet go
+  struct timer *t;
+  long sample;
+  int count;
+  int k;
+  long i;
+  int done = 0;
+  long *sent_at; // last transmission time of each window slot
+  char *resent; // whether the packet in each window slot was transmitted more than once
+  long *held; // sequence number the receiver reported holding in each window slot
+  struct sack sack;
+  int j;
 
-  // create socket
-  sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0)
-    error("Cannot open socket!");
-
-  // get receiver info
-  receiver = gethostbyname(hostname);
-  if (receiver == NULL)
-    error("Receiver cannot be found!");
-
-  // build receiver address
-  memset(&receiver_address, 0, sizeof(receiver_address));
-  receiver_address.sin_family = AF_INET;
-  memcpy(&receiver_address.sin_addr, receiver->h_addr, sizeof(receiver_address.sin_addr));
-  receiver_address.sin_port = htons(port);
-
-  // create INIT packet
-  type = INIT;
-  memcpy(FNAME,&(*filename),strlen(filename));
   seq_num = 1;
-  bzero(data,DATASIZE);
-  mult(buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
 
-  // calculate total number of data packets
-  total_packets = (long)ceil((double)filesize/(double)DATASIZE);
+  // number of data packets this process sends
+  total_packets = stream_packets;
 
-  len = sizeof(receiver_address);
+  // nothing to send for an empty file
+  if(total_packets == 0){
+    printf("Transmission complete\n");
+    return;
+  }
+
+  sent_at = calloc(N, sizeof(long));
+  resent = calloc(N, sizeof(char));
+  held = calloc(N, sizeof(long));
+  if(sent_at == NULL || resent == NULL || held == NULL)
+    error("Cannot create window!");
 
-  // set timeout
-  FD_ZERO (&fdset);
-  FD_SET  (sock, &fdset);
-  timeout.tv_sec = 0;
-  timeout.tv_usec = RTT;
   tries = 0;
-  go = 0;
+  memset(&retransmit, 0, sizeof(retransmit));
+  memset(&pacer, 0, sizeof(pacer));
 
-  // send INIT packet up to MAXTRIES times until an ACK is received
-  while(tries < MAXTRIES){
-    tries++;
-    sent_data = sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len);
-    if( sent_data < 0)
+  while(!done){ // main loop
+    // every window is sent at most maxtries times
+    if(tries >= maxtries)
+      error("Connection timeout!");
+
+    // send the window, limited by the congestion window
+    max = base+cc_window(&cc)-1;
+    if(base != rewound && dupacks < DUPTHRESH) // limited transmit, each duplicate ACK lets a new packet go
+      max += dupacks;
+    while(seq_num <= total_packets && seq_num <= max && pace_ready()){
+      if(seq_num < top && held[seq_num%N] == seq_num){ // the receiver kept it after a gap
+        seq_num++;
+        continue;
+      }
+      size = make_data(batch_buffer(),seq_num,&payload);
+      if(seq_num >= top) // the repair packets cover the first copy
+        fec_feed(payload != NULL ? payload : batch_buffer()+HEADERSIZE,size-OVERHEAD,seq_num);
+      batch_queue_split(sock,&receiver_address,size,payload);
+      if(seq_num >= top)
+        send_repairs(sock,&receiver_address,seq_num);
+
+      trace("-> PACKET %ld\n",seq_num);
+      if(seq_num < top)
+        metric_add(RETRANSMITS,1);
+      now = now_usec();
+      sent_at[seq_num%N] = now;
+      resent[seq_num%N] = seq_num < top;
+      if(seq_num == base) // the timer runs for the oldest unacknowledged packet
+        timer_set(&events,&retransmit,now + rtt_timeout(&rtt));
+      pace_sent();
+      seq_num++;
+      if(seq_num > top)
+        top = seq_num;
+    }
+    batch_flush(sock); // the whole window leaves in as few calls as possible
+
+    // wait for ACKs, the retransmission timer, or the pacer to let the next packet go
+    if(seq_num <= total_packets && seq_num <= max)
+      timer_set(&events,&pacer,next_departure);
+    else
+      timer_stop(&events,&pacer);
+    ready = event_wait(&events);
+
+    if(ready & EVENTREAD){ // drain every ACK that is already queued
+      count = batch_receive(sock);
+      for(k=0; k<count && !done; k++){
+
+        // get packet content
+        if(demult(recv_batch[k],recv_size[k],&h) < 0 || h.type != ACK || h.session != session)
+          continue;
+        req_num = h.seq_num;
+        trace("<- REQUEST %ld\n",req_num);
+        if(req_num == base && base < top)
+          metric_add(DUPACKS,1);
+
+        // packets the receiver holds after a gap are not sent again, with FEC it keeps them
+        if((h.flags & CUMULATIVE) && demult_ack(recv_batch[k],&h,&sack) == 0)
+          for(j=0; j<sack.count; j++)
+            for(i=sack.first[j]; i<sack.first[j]+sack.length[j] && i<top && i<req_num+N; i++)
+              held[i%N] = i;
+
+        // fast retransmit, the receiver lost base and drops what follows it, so after DUPTHRESH duplicates the
+        // window is sent again at once instead of after the timer, and the congestion window is halved once
+        if(req_num == base && base < top && base != rewound && ++dupacks >= DUPTHRESH){
+          if(base >= recover){
+            cc_loss(&cc);
+            recover = top;
+          }
+          seq_num = base;
+          rewound = base;
+          timer_set(&events,&retransmit,now_usec() + rtt_timeout(&rtt));
+          trace("FAST RETRANSMIT %ld\n",base);
+        }
+
+        if(req_num > base && req_num <= top){
+          // the newest packet covered by the ACK gives a sample unless it was retransmitted
+          now = now_usec();
+          sample = 0;
+          if(!resent[(req_num-1)%N]){
+            sample = now - sent_at[(req_num-1)%N];
+            rtt_sample(&rtt, sample);
+          }
+          cc_ack(&cc, req_num - base, sample);
+          for(i=base; i<req_num; i++)
+            metric_add(GOODBYTES,chunk_bytes(i));
+
+          // all packets delivered so terminate the connection
+          if(req_num == total_packets + 1){
+            printf("Transmission complete\n");
+            done = 1;
+          }
+
+          // slide the window and restart the timer for the new base
+          base = req_num;
+          dupacks = 0;
+          release_chunks(base);
+          if(seq_num < base) // a resend that started after a timeout skips what is acknowledged now
+            seq_num = base;
+          timer_set(&events,&retransmit,now + rtt_timeout(&rtt));
+
+          // reset tries
+          tries = 0;
+        }
+      }
+    }
+
+    // an ACK that slides the window restarts the timer, so it only expires when nothing moved for a timeout
+    while((t = timer_expired(&events)) != NULL){
+      if(t != &retransmit || done)
+        continue;
+      tries++;
+      rtt_backoff(&rtt); // try again with higher timeout
+      cc_timeout(&cc);
+      seq_num = base; // send the window again from scratch
+      rewound = base;
+      recover = top;
+      trace("TIMEOUT-%d\n", tries);
+      metric_add(TIMEOUTS,1);
+    }
+  }
+  timer_stop(&events,&retransmit);
+  timer_stop(&events,&pacer);
+  free(sent_at);
+  free(resent);
+  free(held);
+}
+
+void selective_repeat(int sock, struct sockaddr_in receiver_address, long N){
+  long ack_num;
+  long base = 1;
+  long next = 1;
+  struct header h;
+  int size;
+  const char *payload;
+  long total_packets;
+  int ready;
+  int timedout;
+  long sample;
+  long now;
+  long recover = 0; // losses below this sequence number belong to a congestion event already handled
+  long i;
+  int count;
+  int k;
+  long *slot_seq; // sequence number held by each window slot
+  long *sent_at; // last transmission time of each slot
+  struct timer *timers; // retransmission timer of each slot
+  struct timer pacer; // wakes the loop when the pacer lets the next packet go
+  struct timer *t;
+  int *slot_tries; // number of transmissions of each slot
+  char *acked; // whether the packet in each slot is acknowledged
+  struct sack sack;
+  long newly;
+  long newest;
+  int j;
+
+  // number of data packets this process sends
+  total_packets = stream_packets;
+
+  // per packet retransmission state, indexed by seq_num % N
+  slot_seq = calloc(N, sizeof(long));
+  sent_at = calloc(N, sizeof(long));
+  timers = calloc(N, sizeof(struct timer));
+  slot_tries = calloc(N, sizeof(int));
+  acked = calloc(N, sizeof(char));
+  if(slot_seq == NULL || sent_at == NULL || timers == NULL || slot_tries == NULL || acked == NULL)
+    error("Cannot create window!");
+  memset(&pacer, 0, sizeof(pacer));
+
+  while(base <= total_packets){ // main loop
+    // send the packets that entered the window, limited by the congestion window
+    while(next <= total_packets && next < base+cc_window(&cc) && pace_ready()){
+      size = make_data(batch_buffer(),next,&payload);
+      fec_feed(payload != NULL ? payload : batch_buffer()+HEADERSIZE,size-OVERHEAD,next);
+      batch_queue_split(sock,&receiver_address,size,payload);
+      send_repairs(sock,&receiver_address,next);
+      trace("-> PACKET %ld\n",next);
+      slot_seq[next%N] = next;
+      slot_tries[next%N] = 1;
+      acked[next%N] = 0;
+      sent_at[next%N] = now_usec();
+      timer_set(&events,&timers[next%N],sent_at[next%N] + rtt_timeout(&rtt));
+      pace_sent();
+      next++;
+    }
+    batch_flush(sock);
+
+    // wait for ACKs, the retransmission timers, or the pacer to let the next packet go
+    if(next <= total_packets && next < base+cc_window(&cc))
+      timer_set(&events,&pacer,next_departure);
+    else
+      timer_stop(&events,&pacer);
+    ready = event_wait(&events);
+
+    if(ready & EVENTREAD){ // drain every ACK that is already queued
+      count = batch_receive(sock);
+      for(k=0; k<count; k++){
+
+        // get packet content
+        if(demult(recv_batch[k],recv_size[k],&h) < 0 || h.type != ACK || h.session != session)
+          continue;
+        ack_num = h.seq_num;
+        trace("<- ACK %ld\n",ack_num);
+
+        // a cumulative ACK covers every packet before its number and the ranges the receiver holds,
+        // any other ACK only the packet in its number
+        if(!(h.flags & CUMULATIVE)){
+          sack.count = 1;
+          sack.first[0] = ack_num;
+          sack.length[0] = 1;
+          ack_num = base;
+        }
+        else if(demult_ack(recv_batch[k],&h,&sack) < 0)
+          continue;
+
+        // mark the packets, the newest one that was sent once gives the RTT sample
+        newly = 0;
+        newest = 0;
+        for(j=-1; j<sack.count; j++)
+          for(i=j < 0 ? base : sack.first[j]; i<(j < 0 ? ack_num : sack.first[j]+sack.length[j]) && i<next; i++){
+            if(i < base || slot_seq[i%N] != i || acked[i%N])
+              continue;
+            acked[i%N] = 1;
+            timer_stop(&events,&timers[i%N]);
+            newly++;
+            if(slot_tries[i%N] == 1) // Karn's rule
+              newest = i;
+            metric_add(GOODBYTES,chunk_bytes(i));
+          }
+        if(newly == 0){
+          metric_add(DUPACKS,1);
+          continue;
+        }
+        sample = 0;
+        if(newest > 0){
+          sample = now_usec() - sent_at[newest%N];
+          rtt_sample(&rtt, sample);
+        }
+        cc_ack(&cc, newly, sample);
+      }
+
+      // slide the window over the acknowledged prefix
+      while(base < next && acked[base%N])
+        base++;
+      release_chunks(base);
+    }
+
+    // resend only the packets that are not acknowledged in time, an ACK stops the timer of its packets
+    timedout = 0;
+    now = now_usec();
+    while((t = timer_expired(&events)) != NULL){
+      if(t == &pacer)
+        continue;
+      i = slot_seq[t-timers];
+      if(slot_tries[i%N] >= maxtries) // every packet is sent at most maxtries times
+        error("Connection timeout!");
+      if(!timedout){ // back off once per expiry, not once per packet
+        rtt_backoff(&rtt);
+        timedout = 1;
+      }
+      if(i >= recover){ // one window reduction per round trip of losses
+        cc_loss(&cc);
+        recover = next;
+      }
+      trace("TIMEOUT-%d FOR PACKET %ld\n",slot_tries[i%N],i);
+      metric_add(TIMEOUTS,1);
+      size = make_data(batch_buffer(),i,&payload);
+      batch_queue_split(sock,&receiver_address,size,payload);
+      trace("-> PACKET %ld\n",i);
+      metric_add(RETRANSMITS,1);
+      slot_tries[i%N]++;
+      sent_at[i%N] = now;
+      timer_set(&events,t,now + rtt_timeout(&rtt));
+    }
+    batch_flush(sock);
+  }
+  timer_stop(&events,&pacer);
+  for(i=0; i<N; i++) // the events outlive the loop, no slot may stay in the wheel
+    timer_stop(&events,&timers[i]);
+  printf("Transmission complete\n");
+  free(slot_seq);
+  free(sent_at);
+  free(timers);
+  free(slot_tries);
+  free(acked);
+}
+
+long probe_mtu(int sock, struct sockaddr_in *receiver_address){
+  // searches for the largest datagram that arrives unfragmented, in the spirit of DPLPMTUD (RFC 8899)
+  long confirmed = BASEPACKETSIZE;
+  long low = BASEPACKETSIZE;
+  long high = MAXPACKETSIZE;
+  long probe;
+  int pmtudisc = IP_PMTUDISC_PROBE;
+  int restore = IP_PMTUDISC_WANT;
+
+  // set DF on the probes and let them be larger than the cached path MTU
+  if(setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) < 0){
+    printf("Path MTU probing is not available\n");
+    return OVERHEAD + datasize;
+  }
+
+  // the base size is assumed to work, the search only decides how far above it to go
+  if(send_probe(sock, receiver_address, high)){
+    confirmed = high;
+    low = high;
+  }
+  while(high - low > PROBESTEP){
+    probe = (low + high + 1) / 2;
+    if(send_probe(sock, receiver_address, probe)){
+      low = probe;
+      confirmed = probe;
+    }else
+      high = probe - 1;
+  }
+  setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &restore, sizeof(restore));
+  printf("PATH MTU %ld\n",confirmed);
+  return confirmed;
+}
+
+int send_probe(int sock, struct sockaddr_in *receiver_address, int size){
+  // sends a padded PROBE of size bytes up to PROBETRIES times, returns 1 if the receiver saw it
+  struct header h;
+  int tries;
+  int n;
+  long sent_at;
+  long wait;
+  socklen_t len = sizeof(*receiver_address);
+  h.type = PROBE;
+  h.flags = 0;
+  h.len = size - OVERHEAD;
+  h.session = session;
+  h.seq_num = size;
+  memset(buffer+HEADERSIZE, 0, h.len);
+  mult(buffer,&h,NULL);
+  for(tries=0; tries<PROBETRIES; tries++){
+    if(sendto(sock, buffer, size, 0,(struct sockaddr *) receiver_address, len) < 0){
+      if(errno == EMSGSIZE) // larger than the local interface allows
+        return 0;
       error("Cannot send package!");
-    printf("-> INIT\n");
-    to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
-    if(to_status < 0) // error
-      error("Select error");
-    else if(to_status == 0){ // timeout
-      printf("TIMEOUT-%d FOR INIT\n",tries);
-      timeout.tv_usec = (tries+1) * RTT; // try again with higher timeout
-    }else{ // success
-      go = 1;
-      break;
+    }
+    printf("-> PROBE %d\n",size);
+    sent_at = now_usec();
+    while((wait = sent_at + rtt_timeout(&rtt) - now_usec()) > 0 && event_read(&events, wait)){
+      n = recvfrom(sock, recv_buffer, BUFSIZE, 0, NULL, NULL);
+      if(n < 0 || demult(recv_buffer,n,&h) < 0 || h.type != PROBE || h.session != session || h.seq_num != size)
+        continue; // a late answer to an earlier probe
+      if(tries == 0)
+        rtt_sample(&rtt, now_usec() - sent_at);
+      printf("<- PROBE %d\n",size);
+      return 1;
     }
   }
+  return 0;
+}
 
-  // terminate connection if there is no progress after MAXTRIES tries
-  if(!go)
-    error("Sender time out...\n");
+long now_usec(){
+  // monotonic clock in microseconds
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
 
-  // receive packet
-  if(recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, &len) < 0)
-    error("No response!");
+void rtt_init(struct rtt_estimator *r){
+  // no sample yet, start from the conservative initial timeout
+  r->srtt = 0;
+  r->rttvar = 0;
+  r->rto = INITRTO;
+}
 
-  // get packet contents
-  demult(recv_buffer,&type,FNAME,&filesize,&mode,&req_num,data);
+void rtt_sample(struct rtt_estimator *r, long sample){
+  // Jacobson/Karels estimator, gains 1/8 and 1/4 as in RFC 6298
+  if(sample < 1)
+    sample = 1;
+  metric_observe(RTT,sample);
+  if(r->srtt == 0){
+    r->srtt = sample;
+    r->rttvar = sample/2;
+  }else{
+    r->rttvar = r->rttvar + (labs(r->srtt - sample) - r->rttvar)/4;
+    r->srtt = r->srtt + (sample - r->srtt)/8;
+  }
+  r->rto = r->srtt + 4*r->rttvar;
+  if(r->rto < MINRTO)
+    r->rto = MINRTO;
+  if(r->rto > MAXRTO)
+    r->rto = MAXRTO;
+}
 
-  if(type != ACK || req_num != 1)
-    error("Unknown response!");
+long rtt_timeout(struct rtt_estimator *r){
+  return r->rto;
+}
 
-  printf("<- ACK INIT\n");
+void rtt_backoff(struct rtt_estimator *r){
+  // exponential backoff, kept until the next valid sample
+  r->rto = r->rto*2;
+  if(r->rto > MAXRTO)
+    r->rto = MAXRTO;
+}
 
-  // set timeout
-  FD_ZERO (&fdset);
-  FD_SET  (sock, &fdset);
-  timeout.tv_sec = 0;
-  timeout.tv_usec = RTT;
-  tries = 0;
+int pace_ready(){
+  // returns 1 when the pacer lets the next packet leave
+  return !pacing || now_usec() >= next_departure;
+}
 
-  while(1){ // main loop
-    // every window is sent at most MAXTRIES times
-    if(tries >= MAXTRIES)
-      error("Connection timeout!");
+void pace_sent(){
+  // schedules the next departure one gap later, an idle sender may bank at most PACEBURST gaps
+  long gap;
+  long now;
+  if(!pacing)
+    return;
+  gap = cc_pacing_gap(&cc, rtt.srtt);
+  now = now_usec();
+  if(next_departure < now - gap*PACEBURST)
+    next_departure = now - gap*PACEBURST;
+  next_departure += gap;
+}
 
-    // send the window
-    max = base+N-1;
-    while(seq_num <= total_packets && seq_num <= max){
-      memcpy(data,filebuffer+(seq_num-1)*DATASIZE,DATASIZE);
-      type = DATA;
-      mult(buffer,&type,FNAME,&filesize,&mode,&seq_num,data);
+int make_data(char *buffer, long seq_num, const char **payload){
+  // builds the DATA packet of chunk seq_num and returns its size, a chunk of the mapped file is not copied:
+  // buffer gets only the header and the checksum as mult_split writes them and *payload points at the chunk,
+  // otherwise the chunk is read right behind the header and *payload is NULL
+  struct header h;
+  int size;
+  h.type = DATA;
+  h.flags = 0;
+  h.session = session;
+  h.seq_num = seq_num;
+  *payload = NULL;
+  if(block_chunks > 0)
+    h.len = compressed_chunk(seq_num,buffer+HEADERSIZE,&h.flags);
+  else if((*payload = mapped_chunk(seq_num,&size)) != NULL){
+    h.len = size;
+    return mult_split(buffer,&h,*payload);
+  }else
+    h.len = read_chunk(seq_num,buffer+HEADERSIZE);
+  return mult(buffer,&h,NULL);
+}
 
-      if(sendto(sock, buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, len) < 0)
-          error("Cannot send package!");
+int send_data(int sock, struct sockaddr_in *address, const char *buffer, int size, const char *payload){
+  // sends a packet from make_data on its own, the payload goes straight from the mapped file to the socket
+  struct msghdr msg;
+  struct iovec iov[3];
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = address;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = iov;
+  iov[0].iov_base = (char *)buffer;
+  iov[0].iov_len = size;
+  msg.msg_iovlen = 1;
+  if(payload != NULL){
+    iov[0].iov_len = HEADERSIZE;
+    iov[1].iov_base = (char *)payload;
+    iov[1].iov_len = size - OVERHEAD;
+    iov[2].iov_base = (char *)buffer + HEADERSIZE;
+    iov[2].iov_len = TRAILERSIZE;
+    msg.msg_iovlen = 3;
+  }
+  return sendmsg(sock, &msg, 0);
+}
 
-      printf("-> PACKET %ld\n",seq_num);
-      seq_num++;
+void compress_start(){
+  // starts the worker that reads and compresses ahead of the sending loop
+  cslot_count = mode + 2*block_chunks + 2; // enough for every run between the window and the read ahead
+  cslots = calloc(cslot_count, sizeof(struct cslot));
+  if(cslots == NULL)
+    error("Cannot create compression buffers!");
+  if(pthread_create(&compress_thread, NULL, compress_worker, NULL) != 0)
+    error("Cannot start compression!");
+}
+
+void *compress_worker(void *arg){
+  // prepares the chunks of this process in packet order, a run of chunks that is a whole block is
+  // compressed, and it stays at most a window and two blocks ahead of the oldest unacknowledged packet
+  long total_chunks = (filesize + datasize - 1) / datasize;
+  long seq = 1;
+  long chunk;
+  long block;
+  long chunks;
+  long cap;
+  int count;
+  struct cslot *c;
+
+  while(seq <= stream_packets){
+    // the run ends at the end of the block or where the chunks stop being consecutive
+    chunk = ranges_chunk(&missing,first_index+seq-1);
+    block = chunk / block_chunks;
+    for(count=1; seq+count <= stream_packets && (chunk+count) / block_chunks == block
+        && ranges_chunk(&missing,first_index+seq+count-1) == chunk+count; count++);
+
+    c = &cslots[cslot_head % cslot_count];
+    pthread_mutex_lock(&compress_lock);
+    while(!compress_stop && (c->seq > 0 || seq >= compress_base + mode + 2*block_chunks))
+      pthread_cond_wait(&compress_cond, &compress_lock);
+    if(compress_stop){
+      pthread_mutex_unlock(&compress_lock);
+      break;
+    }
+    c->seq = seq;
+    c->count = count;
+    c->ready = 0;
+    cslot_head++;
+    pthread_mutex_unlock(&compress_lock);
+
+    c->offset = chunk*datasize;
+    c->size = filesize - c->offset < count*datasize ? filesize - c->offset : count*datasize;
+    c->packed = 0;
+    c->raw = malloc(c->size);
+    c->packed_data = NULL;
+    if(c->raw == NULL)
+      error("Cannot create compression buffers!");
+    read_source(c->raw, c->size, c->offset);
+
+    // a block that shrinks by less than an eighth goes out as it is
+    chunks = total_chunks - block*block_chunks < block_chunks ? total_chunks - block*block_chunks : block_chunks;
+    if(chunk == block*block_chunks && count == chunks){
+      cap = c->size - c->size/8 < count*(datasize-PIECEHEADER) ? c->size - c->size/8 : count*(datasize-PIECEHEADER);
+      c->packed_data = malloc(cap > 0 ? cap : 1);
+      if(c->packed_data == NULL)
+        error("Cannot create compression buffers!");
+      c->packed = compress_block(c->raw, c->size, c->packed_data, cap);
     }
 
-    to_status = select(sock+1,&fdset,NULL,NULL,&timeout);
+    pthread_mutex_lock(&compress_lock);
+    c->ready = 1;
+    if(c->packed > 0){
+      compress_in += c->size;
+      compress_out += c->packed;
+    }
+    pthread_cond_broadcast(&compress_cond);
+    pthread_mutex_unlock(&compress_lock);
+    seq += count;
+  }
+  return NULL;
+}
 
-    if(to_status < 0) // error
-      error("Select error");
-    else if(to_status == 0){ // timeout
-      tries++;
-      timeout.tv_usec = (tries+1) * RTT; // try again with higher timeout
-      seq_num = base; // send the window again from scratch
-      printf("TIMEOUT-%d\n", tries);
-    }else{ // we receive a packet
+int compressed_chunk(long seq_num, char *data, int *flags){
+  // copies what packet seq_num carries into data and returns the payload size: the chunk itself,
+  // or for a compressed block the compressed size and the piece of the compressed data of this chunk
+  struct cslot *c = NULL;
+  long i;
+  long chunk_size;
+  long first;
+  long last;
+  uint32_t packed;
+  int j;
+
+  *flags = 0;
+  if(seq_num < 1 || seq_num > stream_packets)
+    return 0;
+  pthread_mutex_lock(&compress_lock);
+  while(c == NULL){
+    for(i=cslot_tail; i<cslot_head; i++)
+      if(cslots[i % cslot_count].seq <= seq_num && seq_num < cslots[i % cslot_count].seq + cslots[i % cslot_count].count)
+        break;
+    if(i < cslot_head && cslots[i % cslot_count].ready)
+      c = &cslots[i % cslot_count];
+    else
+      pthread_cond_wait(&compress_cond, &compress_lock);
+  }
+  pthread_mutex_unlock(&compress_lock);
+
+  // the digest follows the chunks in file order
+  j = seq_num - c->seq;
+  chunk_size = c->size - j*datasize < datasize ? c->size - j*datasize : datasize;
+  if(c->offset + j*datasize == digest_pos){
+    digest_update(&digest, c->raw + j*datasize, chunk_size);
+    digest_pos += chunk_size;
+  }
+  if(c->packed == 0){
+    memcpy(data, c->raw + j*datasize, chunk_size);
+    return chunk_size;
+  }
 
-      if(recvfrom(sock, recv_buffer, BUFSIZE, 0,(struct sockaddr *) &receiver_address, &len) < 0)
-        error("No response!");
+  // the compressed block is split evenly, so every packet of the block is smaller by the same ratio
+  first = (long)j*c->packed / c->count;
+  last = (long)(j+1)*c->packed / c->count;
+  packed = htonl(c->packed);
+  memcpy(data, &packed, PIECEHEADER);
+  memcpy(data+PIECEHEADER, c->packed_data+first, last-first);
+  *flags = COMPRESS;
+  return PIECEHEADER + last - first;
+}
 
-      // get packet content
-      demult(recv_buffer,&type,FNAME,&filesize,&mode,&req_num,data);
-      printf("<- REQUEST %ld\n",req_num);
+void compress_release(long seq_num){
+  // frees the runs whose packets are all acknowledged and lets the worker read further
+  struct cslot *c;
+  pthread_mutex_lock(&compress_lock);
+  compress_base = seq_num;
+  while(cslot_tail < cslot_head){
+    c = &cslots[cslot_tail % cslot_count];
+    if(!c->ready || c->seq + c->count > seq_num)
+      break;
+    free(c->raw);
+    free(c->packed_data);
+    c->seq = 0;
+    cslot_tail++;
+  }
+  pthread_cond_broadcast(&compress_cond);
+  pthread_mutex_unlock(&compress_lock);
+}
 
-      // all packets delivered so terminate the connection
-      if(req_num == total_packets + 1){
-        printf("Transmission complete\n");
-        break;
-      }
+void compress_end(){
+  // stops the worker and frees what is left
+  pthread_mutex_lock(&compress_lock);
+  compress_stop = 1;
+  pthread_cond_broadcast(&compress_cond);
+  pthread_mutex_unlock(&compress_lock);
+  pthread_join(compress_thread, NULL);
+  compress_release(stream_packets + 1);
+  if(compress_in > 0)
+    printf("COMPRESSED %ld BYTES TO %ld\n",compress_in,compress_out);
+  free(cslots);
+}
 
-      // slide the window
-      if(req_num > base)
-        base = req_num;
+void fec_feed(const char *data, int size, long seq_num){
+  // adds the chunk of a data packet to the repair packets of its block, a short chunk is padded with zeros
+  int index = (seq_num-1) % (fec_k > 0 ? fec_k : 1);
+  int i;
+  for(i=0; i<fec_r; i++){
+    if(index == 0)
+      memset(repairs[i], 0, datasize);
+    fec_muladd(repairs[i], data, fec_coefficient(i,index), size);
+  }
+}
 
-      // reset tries and timeout value
-      tries = 0;
-      timeout.tv_usec = RTT;
-    }
+void send_repairs(int sock, struct sockaddr_in *receiver_address, long seq_num){
+  // queues the repair packets of a block right after its last data packet
+  struct header h;
+  int size;
+  int i;
+  if(fec_k == 0 || (seq_num % fec_k != 0 && seq_num != stream_packets))
+    return;
+  h.type = REPAIR;
+  h.session = session;
+  h.seq_num = seq_num - (seq_num-1) % fec_k;
+  h.len = datasize;
+  for(i=0; i<fec_r; i++){
+    h.flags = i;
+    size = mult(batch_buffer(),&h,repairs[i]);
+    batch_queue(sock,receiver_address,size);
+    trace("-> REPAIR %ld:%d\n",h.seq_num,i);
+  }
+}
 
+void open_source(const char *filename){
+  // opens the file and maps it so that chunks are paged in on demand instead of read up front,
+  // a directory is read through the archive of its tree
+  struct stat st;
+  if(archive_open(&archive, filename) == 0){
+    directory = 1;
+    filesize = archive.size;
+    mtime = archive.key;
+    printf("ARCHIVE: %ld ENTRIES, %ld BYTES\n",archive.count,filesize);
+    return;
   }
-  close(sock);
+  file_fd = open(filename, O_RDONLY);
+  if(file_fd < 0)
+    error("Cannot open file!");
+  if(fstat(file_fd, &st) < 0)
+    error("Cannot read file");
+  filesize = st.st_size;
+  mtime = st.st_mtim.tv_sec*1000000000L + st.st_mtim.tv_nsec;
+  if(filesize == 0)
+    return;
+  filemap = mmap(NULL, filesize, PROT_READ, MAP_SHARED, file_fd, 0);
+  if(filemap == MAP_FAILED) // fall back to pread for files that cannot be mapped
+    filemap = NULL;
+  else
+    madvise(filemap, filesize, MADV_SEQUENTIAL);
+}
+
+void read_source(char *data, long size, long offset){
+  // copies size bytes of what is sent from offset on
+  if(filemap != NULL)
+    memcpy(data, filemap+offset, size);
+  else if(directory ? archive_read(&archive, data, size, offset) < 0 : pread(file_fd, data, size, offset) != size)
+    error("Cannot read file");
 }
 
-void mult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]){
-  // writes the packet fields into the packet and does conversions if necessary
-  long fls = htonl(*filesize);
-  int mod = htons(*mode);
-  long sn = htonl(*seq_num);
-  int i=0;
-  memcpy(buffer,type,sizeof(char));
-  i = i+sizeof(char);
-  memcpy(buffer+i,filename,FILENAMESIZE);
-  i = i+FILENAMESIZE;
-  memcpy(buffer+i,&fls,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(buffer+i,&mod,sizeof(int));
-  i = i+sizeof(int);
-  memcpy(buffer+i,&sn,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(buffer+i,data,DATASIZE);
-
-}
-
-void demult(char buffer[BUFSIZE], char *type, char filename[FILENAMESIZE], long *filesize, int *mode, long *seq_num, char data[DATASIZE]){
-  // reads the packet fields from the packet and does conversions if necessary
-  int i=0;
-  memcpy(type,buffer,sizeof(char));
-  i = i+sizeof(char);
-  memcpy(filename,buffer+i,FILENAMESIZE);
-  i = i+FILENAMESIZE;
-  memcpy(filesize,buffer+i,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(mode,buffer+i,sizeof(int));
-  i = i+sizeof(int);
-  memcpy(seq_num,buffer+i,sizeof(long));
-  i = i+sizeof(long);
-  memcpy(data,buffer+i,DATASIZE);
-  *filesize = ntohl(*filesize);
-  *mode = ntohs(*mode);
-  *seq_num = ntohl(*seq_num);
+int read_chunk(long seq_num, char *data){
+  // copies the chunk of packet seq_num into data and returns the payload size, the last chunk may be short
+  long offset = ranges_chunk(&missing,first_index+seq_num-1)*datasize;
+  long size = chunk_bytes(seq_num);
+  if(size == 0)
+    return 0;
+  read_source(data, size, offset);
+  digest_chunk(offset, data, size);
+  return size;
+}
+
+const char *mapped_chunk(long seq_num, int *size){
+  // the chunk of packet seq_num in the mapped file and its size in *size, NULL if the source is not mapped
+  long offset = ranges_chunk(&missing,first_index+seq_num-1)*datasize;
+  if(filemap == NULL)
+    return NULL;
+  *size = chunk_bytes(seq_num);
+  if(*size == 0)
+    return filemap;
+  digest_chunk(offset, filemap+offset, *size);
+  return filemap+offset;
+}
 
+void digest_chunk(long offset, const char *data, long size){
+  // the digest follows the chunks sent in file order
+  if(offset == digest_pos){
+    digest_update(&digest,data,size);
+    digest_pos += size;
+  }
+}
+
+long chunk_bytes(long seq_num){
+  // bytes of the file in the chunk of packet seq_num
+  long offset = ranges_chunk(&missing,first_index+seq_num-1)*datasize;
+  if(seq_num < 1 || seq_num > stream_packets || offset >= filesize)
+    return 0;
+  return filesize - offset < datasize ? filesize - offset : datasize;
+}
+
+void release_chunks(long seq_num){
+  // drops mapped pages of the acknowledged chunks before seq_num so memory use follows the window
+  long page = sysconf(_SC_PAGESIZE);
+  long end;
+  if(block_chunks > 0)
+    compress_release(seq_num);
+  if(filemap == NULL)
+    return;
+  if(seq_num > stream_packets) // everything this process sends is acknowledged
+    end = filesize;
+  else
+    end = (ranges_chunk(&missing,first_index+seq_num-1)*datasize / page) * page;
+  if(end <= released)
+    return;
+  madvise(filemap+released, end-released, MADV_DONTNEED);
+  released = end;
+}
+
+int check_ranges(struct ranges *r, long datasize){
+  // the receiver may only ask for chunks of the file, in file order
+  long chunks = (long)ceil((double)filesize/(double)datasize);
+  long end = 0;
+  int i;
+  for(i=0; i<r->count; i++){
+    if(r->first[i] < end || r->length[i] < 1 || r->first[i] + r->length[i] > chunks)
+      return -1;
+    end = r->first[i] + r->length[i];
+  }
+  return 0;
+}
+
+uint64_t file_digest(){
+  // reads the part of the file the digest has not seen and returns the digest of the whole file
+  char block[65536];
+  long size;
+  while(digest_pos < filesize){
+    size = filesize - digest_pos < (long)sizeof(block) ? filesize - digest_pos : (long)sizeof(block);
+    if(filemap != NULL)
+      digest_update(&digest,filemap+digest_pos,size);
+    else{
+      read_source(block, size, digest_pos);
+      digest_update(&digest,block,size);
+    }
+    digest_pos += size;
+  }
+  return digest_final(&digest);
+}
+
+void close_source(){
+  if(directory){
+    archive_close(&archive);
+    return;
+  }
+  if(filemap != NULL)
+    munmap(filemap, filesize);
+  close(file_fd);
 }
 
 void error (char *e){
@@ -0,0 +1,538 @@
+/*
+  transferbench.c
+  Throughput and Latency of Transfers over Loopback
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// constant values
+#define MAXPOINTS 16 // values of one dimension of the matrix
+#define MAXRUNS 15
+#define FILLBLOCK (1024*1024)
+#define STARTTIMEOUT 5000 // milliseconds a program may take to open its port
+#define EXITTIMEOUT 40000 // milliseconds the receiver may take to exit after the sender, it lingers for a second
+#define SEED 1 // of the file contents and of the impairment proxy
+#define LINESIZE 2048
+#define GB 1e9
+#define MINCPU 0.05 // seconds a side must have run in the baseline before its CPU time is compared, less is noise
+#define MINRATE (1024*1024) // bytes per second a run must reach on top of the time limit, or it failed
+
+// one point of the matrix, the median of its runs
+struct result {
+  char mode[8]; // gbn or sr
+  long size;
+  long window;
+  double loss; // percent, each way
+  int ok;
+  long goodput; // bits per second, as the sender measures it
+  long first_byte; // microseconds from the start of the sender until the first chunk is acknowledged
+  long wall; // microseconds from the start of the sender until it exits
+  double retransmits; // share of the packets sent that were retransmissions
+  double sender_cpu; // seconds of user and system time per GB of file
+  double receiver_cpu;
+};
+
+// function definitions
+void error (char *e);
+int parse_sizes(const char *list, long *values);
+int parse_numbers(const char *list, double *values);
+void make_file(const char *name, long size);
+void bench_point(struct result *r, const char *name, int runs);
+int run_once(struct result *r, const char *name);
+pid_t spawn(char **args, const char *log);
+int wait_port(int port, pid_t pid);
+int wait_child(pid_t pid, long msec, struct rusage *usage);
+void kill_child(pid_t pid);
+int read_metrics(const char *log, char *line, int size);
+double json_number(const char *json, const char *key);
+void write_result(FILE *out, struct result *r);
+void print_result(struct result *r);
+int compare_baseline(const char *path, struct result *results, int count, double tolerance);
+int by_goodput(const void *a, const void *b);
+double cpu_sec(struct rusage *usage);
+long now_usec();
+
+// global variables
+char bindir[4000]; // where sender, receiver and impair are
+char *datadir = "benchdata";
+char *mode = "gbn";
+int port = 9700;
+long limit = 60; // seconds one run may take, and one more for every MINRATE bytes of the file
+
+int main(int argc, char **argv){
+  struct result results[MAXPOINTS*MAXPOINTS*MAXPOINTS];
+  long sizes[MAXPOINTS];
+  double windows[MAXPOINTS];
+  double losses[MAXPOINTS];
+  char name[64];
+  char *size_list = "4K,256K,16M,128M"; // stop-and-wait at 5% loss moves 128 MB in well under a minute
+  char *window_list = "1,8,64,512";
+  char *loss_list = "0,1,5";
+  char *output = "bench.json";
+  char *baseline = "bench.baseline";
+  double tolerance = 10;
+  FILE *out;
+  int size_count;
+  int window_count;
+  int loss_count;
+  int runs = 3;
+  int count = 0;
+  int i;
+  int j;
+  int k;
+
+  // parse command line input
+  for(i=1; i<argc-1; i++){
+    if(strcmp(argv[i],"-s")==0) // file sizes, with K, M or G
+      size_list = argv[i+1];
+    else if(strcmp(argv[i],"-w")==0) // windows
+      window_list = argv[i+1];
+    else if(strcmp(argv[i],"-l")==0) // loss in percent
+      loss_list = argv[i+1];
+    else if(strcmp(argv[i],"-m")==0) // gbn or sr
+      mode = argv[i+1];
+    else if(strcmp(argv[i],"-n")==0) // runs of every point
+      runs = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-t")==0) // seconds one run may take
+      limit = atol(argv[i+1]);
+    else if(strcmp(argv[i],"-d")==0) // directory of the files
+      datadir = argv[i+1];
+    else if(strcmp(argv[i],"-p")==0) // port of the receiver, the proxy uses the next one
+      port = atoi(argv[i+1]);
+    else if(strcmp(argv[i],"-o")==0) // results
+      output = argv[i+1];
+    else if(strcmp(argv[i],"-b")==0) // results to compare with
+      baseline = argv[i+1];
+    else if(strcmp(argv[i],"-T")==0) // tolerance in percent
+      tolerance = atof(argv[i+1]);
+  }
+  size_count = parse_sizes(size_list, sizes);
+  window_count = parse_numbers(window_list, windows);
+  loss_count = parse_numbers(loss_list, losses);
+  if(size_count == 0 || window_count == 0 || loss_count == 0 || runs < 1 || runs > MAXRUNS || port <= 0
+     || (strcmp(mode,"gbn") != 0 && strcmp(mode,"sr") != 0)){
+    printf("\tUsage:\n\
+          <-s sizes> <-w windows> <-l loss%%> <-m gbn|sr> <-n runs> <-t seconds> <-d directory> <-p port>\n\
+          <-o results> <-b baseline> <-T tolerance%%>\n\
+          [required] <optional>, lists are separated by commas\n");
+    exit(1);
+  }
+  if(getcwd(bindir, sizeof(bindir)) == NULL)
+    error("Cannot find the programs!");
+  if(mkdir(datadir, 0755) < 0 && errno != EEXIST)
+    error("Cannot create the data directory!");
+  out = fopen(output, "w");
+  if(out == NULL)
+    error("Cannot open the results!");
+
+  printf("%-4s %6s %4s %5s %12s %10s %9s %7s %12s %12s\n",
+         "MODE","SIZE","N","LOSS","GOODPUT Mb/s","TTFB ms","WALL s","RETX %","SENDER s/GB","RECEIVER s/GB");
+  for(i=0; i<size_count; i++){
+    // the same bytes every time, so that runs compare
+    snprintf(name, sizeof(name), "bench.%ld", sizes[i]);
+    make_file(name, sizes[i]);
+    for(j=0; j<window_count; j++)
+      for(k=0; k<loss_count; k++){
+        memset(&results[count], 0, sizeof(struct result));
+        snprintf(results[count].mode, sizeof(results[count].mode), "%s", windows[j] == 1 ? "sw" : mode);
+        results[count].size = sizes[i];
+        results[count].window = windows[j];
+        results[count].loss = losses[k];
+        bench_point(&results[count], name, runs);
+        print_result(&results[count]);
+        write_result(out, &results[count]);
+        count++;
+      }
+  }
+  fclose(out);
+  printf("RESULTS IN %s\n", output);
+  return compare_baseline(baseline, results, count, tolerance) > 0;
+}
+
+int parse_sizes(const char *list, long *values){
+  // comma separated sizes in bytes, K, M and G are powers of 1024
+  const char *p = list;
+  char *end;
+  int count = 0;
+  while(*p && count < MAXPOINTS){
+    values[count] = strtol(p, &end, 10);
+    if(end == p || values[count] < 0)
+      return 0;
+    if(*end == 'K')
+      values[count] <<= 10, end++;
+    else if(*end == 'M')
+      values[count] <<= 20, end++;
+    else if(*end == 'G')
+      values[count] <<= 30, end++;
+    count++;
+    p = *end == ',' ? end+1 : end;
+    if(*end != ',' && *end != 0)
+      return 0;
+  }
+  return count;
+}
+
+int parse_numbers(const char *list, double *values){
+  const char *p = list;
+  char *end;
+  int count = 0;
+  while(*p && count < MAXPOINTS){
+    values[count] = strtod(p, &end);
+    if(end == p || values[count] < 0 || (*end != ',' && *end != 0))
+      return 0;
+    count++;
+    p = *end == ',' ? end+1 : end;
+  }
+  return count;
+}
+
+void make_file(const char *name, long size){
+  // fills the file with xorshift output, left in place for the next bench if it has the right size
+  char path[4096];
+  struct stat st;
+  uint64_t x = SEED * 0x9e3779b97f4a7c15ULL;
+  uint64_t *block;
+  long done;
+  int fd;
+  int n;
+  int i;
+  snprintf(path, sizeof(path), "%s/%s", datadir, name);
+  if(stat(path, &st) == 0 && st.st_size == size)
+    return;
+  block = malloc(FILLBLOCK);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(block == NULL || fd < 0)
+    error("Cannot create the file!");
+  for(done=0; done<size; done+=n){
+    for(i=0; i<FILLBLOCK/8; i++){
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      block[i] = x;
+    }
+    n = size-done < FILLBLOCK ? size-done : FILLBLOCK;
+    if(write(fd, block, n) != n)
+      error("Cannot write the file!");
+  }
+  close(fd);
+  free(block);
+}
+
+void bench_point(struct result *r, const char *name, int runs){
+  // runs one point of the matrix a few times and keeps the run with the median goodput
+  struct result run[MAXRUNS];
+  int i;
+  for(i=0; i<runs; i++){
+    run[i] = *r;
+    if(!run_once(&run[i], name)){
+      *r = run[i]; // a failed run fails the point
+      return;
+    }
+  }
+  qsort(run, runs, sizeof(struct result), by_goodput);
+  *r = run[runs/2];
+}
+
+int run_once(struct result *r, const char *name){
+  // receiver, the proxy if there is loss, then the sender, each with its own log in the data directory
+  struct rusage sender_usage;
+  struct rusage receiver_usage;
+  char window[32];
+  char receiver_port[16];
+  char sender_port[16];
+  char loss[32];
+  char seed[16];
+  char path[3][4096];
+  char line[LINESIZE];
+  char *receiver_args[] = {path[0], "-p", receiver_port, "-m", window, NULL};
+  char *impair_args[] = {path[1], "-p", sender_port, "-r", receiver_port, "-l", loss, "-s", seed, NULL};
+  char *sender_args[] = {path[2], "-p", sender_port, "-h", "127.0.0.1", "-f", (char *) name, "-m", window, NULL};
+  pid_t receiver;
+  pid_t impair = 0;
+  pid_t sender;
+  long start;
+  double packets;
+  int status;
+
+  snprintf(path[0], sizeof(path[0]), "%s/receiver", bindir);
+  snprintf(path[1], sizeof(path[1]), "%s/impair", bindir);
+  snprintf(path[2], sizeof(path[2]), "%s/sender", bindir);
+  snprintf(window, sizeof(window), strcmp(r->mode,"sr") == 0 ? "sr:%ld" : "%ld", r->window);
+  snprintf(receiver_port, sizeof(receiver_port), "%d", port);
+  snprintf(sender_port, sizeof(sender_port), "%d", r->loss > 0 ? port+1 : port);
+  snprintf(loss, sizeof(loss), "%g", r->loss);
+  snprintf(seed, sizeof(seed), "%d", SEED);
+  r->ok = 0;
+
+  // an earlier run that failed must not be resumed
+  snprintf(line, sizeof(line), "%s/%s.part", datadir, name);
+  unlink(line);
+  snprintf(line, sizeof(line), "%s/%s.part.map", datadir, name);
+  unlink(line);
+
+  receiver = spawn(receiver_args, "receiver.log");
+  if(!wait_port(port, receiver)){
+    kill_child(receiver);
+    return 0;
+  }
+  if(r->loss > 0){
+    impair = spawn(impair_args, "impair.log");
+    if(!wait_port(port+1, impair)){
+      kill_child(impair);
+      kill_child(receiver);
+      return 0;
+    }
+  }
+  start = now_usec();
+  sender = spawn(sender_args, "sender.log");
+  status = wait_child(sender, (limit + r->size / MINRATE)*1000, &sender_usage);
+  if(status != 0){
+    if(status < 0) // still running after the time limit
+      kill_child(sender);
+    if(impair > 0)
+      kill_child(impair);
+    kill_child(receiver);
+    return 0;
+  }
+  r->wall = now_usec() - start;
+  r->ok = wait_child(receiver, EXITTIMEOUT, &receiver_usage) == 0;
+  if(impair > 0)
+    kill_child(impair);
+  if(!r->ok)
+    kill_child(receiver);
+  snprintf(line, sizeof(line), "%s/%s%d", datadir, name, receiver); // the received file
+  unlink(line);
+  if(!r->ok || !read_metrics("sender.log", line, sizeof(line))){
+    r->ok = 0;
+    return 0;
+  }
+
+  r->goodput = json_number(line, "goodput_bps");
+  r->first_byte = json_number(line, "first_byte_us");
+  packets = json_number(line, "packets_sent");
+  r->retransmits = packets > 0 ? json_number(line, "retransmits") / packets : 0;
+  r->sender_cpu = r->size > 0 ? cpu_sec(&sender_usage) * GB / r->size : 0;
+  r->receiver_cpu = r->size > 0 ? cpu_sec(&receiver_usage) * GB / r->size : 0;
+  return 1;
+}
+
+pid_t spawn(char **args, const char *log){
+  // starts a program in the data directory with its output in log
+  sigset_t set;
+  pid_t pid = fork();
+  int fd;
+  if(pid < 0)
+    error("Cannot fork!");
+  if(pid == 0){
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &set, NULL); // blocked for wait_child, the programs must not inherit that
+    if(chdir(datadir) < 0)
+      _exit(127);
+    fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0){
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+    execv(args[0], args);
+    _exit(127);
+  }
+  return pid;
+}
+
+int wait_port(int port, pid_t pid){
+  // waits until a UDP socket is bound to port, or the program that should bind it is gone
+  char line[256];
+  unsigned local;
+  long start = now_usec();
+  FILE *f;
+  int found = 0;
+  while(!found && now_usec() - start < STARTTIMEOUT*1000L){
+    if(waitpid(pid, NULL, WNOHANG) != 0)
+      return 0;
+    f = fopen("/proc/net/udp", "r");
+    if(f == NULL)
+      error("Cannot read the UDP sockets!");
+    while(!found && fgets(line, sizeof(line), f) != NULL)
+      found = sscanf(line, " %*d: %*x:%x", &local) == 1 && local == (unsigned) port;
+    fclose(f);
+    if(!found)
+      usleep(1000);
+  }
+  return found;
+}
+
+int wait_child(pid_t pid, long msec, struct rusage *usage){
+  // 0 if the program exited with 0 within msec milliseconds, -1 if it did not exit, 1 if it failed
+  struct timespec ts;
+  sigset_t set;
+  long start = now_usec();
+  long left;
+  int status;
+  pid_t done;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  while((done = wait4(pid, &status, WNOHANG, usage)) == 0){
+    left = msec*1000 - (now_usec() - start);
+    if(left <= 0)
+      return -1;
+    ts.tv_sec = left / 1000000;
+    ts.tv_nsec = left % 1000000 * 1000;
+    sigtimedwait(&set, NULL, &ts);
+  }
+  if(done < 0)
+    return 1;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+void kill_child(pid_t pid){
+  kill(pid, SIGTERM);
+  if(wait_child(pid, 1000, NULL) < 0){
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+int read_metrics(const char *log, char *line, int size){
+  // finds the JSON of the METRICS line a program prints when it exits
+  char path[4096];
+  FILE *f;
+  int found = 0;
+  snprintf(path, sizeof(path), "%s/%s", datadir, log);
+  f = fopen(path, "r");
+  if(f == NULL)
+    return 0;
+  while(fgets(line, size, f) != NULL)
+    if(strncmp(line, "METRICS ", 8) == 0){
+      memmove(line, line+8, strlen(line+8)+1);
+      found = 1;
+      break;
+    }
+  fclose(f);
+  return found;
+}
+
+double json_number(const char *json, const char *key){
+  // value of the first "key": in json, 0 if there is none
+  char pattern[64];
+  const char *p;
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  p = strstr(json, pattern);
+  return p != NULL ? strtod(p+strlen(pattern), NULL) : 0;
+}
+
+void write_result(FILE *out, struct result *r){
+  fprintf(out, "{\"mode\":\"%s\",\"size\":%ld,\"window\":%ld,\"loss\":%g,\"ok\":%d,\"goodput_bps\":%ld,\"first_byte_us\":%ld,"
+          "\"wall_us\":%ld,\"retransmit_ratio\":%.6f,\"sender_cpu_s_per_gb\":%.4f,\"receiver_cpu_s_per_gb\":%.4f}\n",
+          r->mode, r->size, r->window, r->loss, r->ok, r->goodput, r->first_byte,
+          r->wall, r->retransmits, r->sender_cpu, r->receiver_cpu);
+  fflush(out);
+}
+
+void print_result(struct result *r){
+  char size[32];
+  if(r->size >= 1L << 30)
+    snprintf(size, sizeof(size), "%ldG", r->size >> 30);
+  else if(r->size >= 1L << 20)
+    snprintf(size, sizeof(size), "%ldM", r->size >> 20);
+  else if(r->size >= 1L << 10)
+    snprintf(size, sizeof(size), "%ldK", r->size >> 10);
+  else
+    snprintf(size, sizeof(size), "%ld", r->size);
+  if(!r->ok)
+    printf("%-4s %6s %4ld %4g%% FAILED, see %s/*.log\n", r->mode, size, r->window, r->loss, datadir);
+  else
+    printf("%-4s %6s %4ld %4g%% %12.1f %10.3f %9.3f %7.2f %12.2f %12.2f\n", r->mode, size, r->window, r->loss,
+           r->goodput/1e6, r->first_byte/1e3, r->wall/1e6, r->retransmits*100, r->sender_cpu, r->receiver_cpu);
+  fflush(stdout);
+}
+
+int compare_baseline(const char *path, struct result *results, int count, double tolerance){
+  // reports the points that got slower or more expensive than in the baseline, returns how many did,
+  // without a baseline there is nothing to compare and the results only stay in their file
+  char line[LINESIZE];
+  char mode[8];
+  const char *p;
+  double goodput;
+  double sender_cpu;
+  double receiver_cpu;
+  double slack = tolerance / 100;
+  FILE *f = fopen(path, "r");
+  int regressions = 0;
+  int compared = 0;
+  int i;
+  if(f == NULL){
+    printf("NO BASELINE IN %s, RESULTS SAVED, COPY THEM THERE TO KEEP THEM AS ONE\n", path);
+    return 0;
+  }
+  while(fgets(line, sizeof(line), f) != NULL){
+    p = strstr(line, "\"mode\":\"");
+    if(p == NULL || sscanf(p+8, "%7[^\"]", mode) != 1)
+      continue;
+    for(i=0; i<count; i++)
+      if(strcmp(results[i].mode, mode) == 0 && results[i].size == (long) json_number(line, "size")
+         && results[i].window == (long) json_number(line, "window") && fabs(results[i].loss - json_number(line, "loss")) < 1e-9)
+        break;
+    if(i == count)
+      continue;
+    compared++;
+    goodput = json_number(line, "goodput_bps");
+    sender_cpu = json_number(line, "sender_cpu_s_per_gb");
+    receiver_cpu = json_number(line, "receiver_cpu_s_per_gb");
+    if(!results[i].ok || json_number(line, "ok") == 0){ // a point that failed in the baseline has nothing to hold it to
+      printf("REGRESSION %s %ld N=%ld %g%%: FAILED%s\n", mode, results[i].size, results[i].window, results[i].loss,
+             results[i].ok ? " IN THE BASELINE" : "");
+      regressions++;
+    }
+    else if(results[i].goodput < goodput * (1-slack)
+            || (sender_cpu * results[i].size / GB >= MINCPU && results[i].sender_cpu > sender_cpu * (1+slack))
+            || (receiver_cpu * results[i].size / GB >= MINCPU && results[i].receiver_cpu > receiver_cpu * (1+slack))){
+      printf("REGRESSION %s %ld N=%ld %g%%: GOODPUT %.1f -> %.1f Mb/s, SENDER %.2f -> %.2f s/GB, RECEIVER %.2f -> %.2f s/GB\n",
+             mode, results[i].size, results[i].window, results[i].loss, goodput/1e6, results[i].goodput/1e6,
+             sender_cpu, results[i].sender_cpu, receiver_cpu, results[i].receiver_cpu);
+      regressions++;
+    }
+  }
+  fclose(f);
+  if(compared == 0)
+    printf("NO POINT OF THIS RUN IN %s, NOTHING WAS COMPARED\n", path);
+  printf("%d OF %d POINTS WORSE THAN %s BY MORE THAN %g%%\n", regressions, compared, path, tolerance);
+  return regressions;
+}
+
+int by_goodput(const void *a, const void *b){
+  const struct result *x = a;
+  const struct result *y = b;
+  return (x->goodput > y->goodput) - (x->goodput < y->goodput);
+}
+
+double cpu_sec(struct rusage *usage){
+  return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+}
+
+long now_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+void error (char *e){
+  // print error message and die
+  printf("%s\n",e);
+  exit(1);
+}
@@ -0,0 +1,362 @@
+/*
+  writer.c
+  Asynchronous Disk Writer of the Receiver
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "writer.h"
+
+void error (char *e);
+void writer_wait(struct writer *w, long i);
+void writer_swap(struct write_request *r, struct write_request *s);
+void *writer_thread(void *arg);
+long write_batch(struct writer *w, long tail, long head);
+void uring_write(struct writer *w, int runs, long *first, int *count, long *bytes);
+void finish_run(struct writer *w, long first, int count, long written);
+int uring_open(struct uring *u);
+void uring_close(struct uring *u);
+
+void writer_start(struct writer *w, int slotsize, void (*done)(struct write_request *r)){
+  // starts the writer thread with a ring of WRITERBYTES in slots of slotsize bytes
+  long i;
+  memset(w, 0, sizeof(*w));
+  w->slotsize = slotsize;
+  w->slots = WRITERBYTES / slotsize > MINWRITERSLOTS ? WRITERBYTES / slotsize : MINWRITERSLOTS;
+  w->ring = calloc(w->slots, sizeof(struct write_request));
+  w->buffers = malloc(w->slots * (long)slotsize);
+  w->iov = malloc(URINGENTRIES * MAXIOV * sizeof(struct iovec));
+  if(w->ring == NULL || w->buffers == NULL || w->iov == NULL)
+    error("Cannot create writer!");
+  for(i=0; i<w->slots; i++)
+    w->ring[i].data = w->buffers + i*slotsize;
+  w->done = done;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  pthread_cond_init(&w->drained, NULL);
+  if(uring_open(&w->uring) < 0)
+    printf("io_uring is not available, writing with pwritev\n");
+  if(pthread_create(&w->thread, NULL, writer_thread, w) != 0)
+    error("Cannot create writer!");
+  w->running = 1;
+}
+
+char *writer_buffer(struct writer *w){
+  // buffer of the next request, the network thread only waits if the writer is a whole ring behind,
+  // a buffer lent by writer_slot keeps its data and trades places with the next one that is not lent
+  struct write_request *r = &w->ring[w->head % w->slots];
+  long i;
+  writer_wait(w, 0);
+  for(i=1; r->lent; i++){
+    writer_wait(w, i);
+    writer_swap(r, &w->ring[(w->head + i) % w->slots]);
+  }
+  return r->data;
+}
+
+char *writer_slot(struct writer *w, int i){
+  // lends the buffer of the i-th request after head, so data can be received into the buffers of the next
+  // requests before it is known which of them are queued, see writer_write
+  struct write_request *r = &w->ring[(w->head + i) % w->slots];
+  writer_wait(w, i);
+  r->lent = 1;
+  return r->data;
+}
+
+void writer_wait(struct writer *w, long i){
+  // waits until the i-th request after head is free
+  if(w->head + i - __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) < w->slots)
+    return;
+  w->stalls++;
+  pthread_mutex_lock(&w->lock);
+  __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+  while(w->head + i - __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) >= w->slots)
+    pthread_cond_wait(&w->drained, &w->lock);
+  __atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void writer_swap(struct write_request *r, struct write_request *s){
+  // two requests the writer thread does not see yet trade their buffers
+  char *data = r->data;
+  int lent = r->lent;
+  r->data = s->data;
+  r->lent = s->lent;
+  s->data = data;
+  s->lent = lent;
+}
+
+void writer_queue(struct writer *w, int fd, long offset, int size, long chunk, int chunks, void *context){
+  // hands the buffer from writer_buffer to the writer thread, a request of size 0 writes nothing and is
+  // handed back once every request before it is, so the network thread can leave work on a file to the writer
+  struct write_request *r = &w->ring[w->head % w->slots];
+  r->lent = 0;
+  r->fd = fd;
+  r->offset = offset;
+  r->size = size;
+  r->chunk = chunk;
+  r->chunks = chunks;
+  r->context = context;
+  __atomic_store_n(&w->head, w->head + 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+void writer_write(struct writer *w, int fd, long offset, const char *data, int size, long chunk, int chunks, void *context){
+  // queues a copy of data, the caller may reuse its buffer right away, data received into a buffer lent by
+  // writer_slot is not copied, the buffer becomes the one of the request at head
+  struct write_request *r = &w->ring[w->head % w->slots];
+  long i;
+  for(i=0; i<MAXLENT && r->data != data; i++)
+    if(w->ring[(w->head + i) % w->slots].lent && w->ring[(w->head + i) % w->slots].data == data)
+      writer_swap(r, &w->ring[(w->head + i) % w->slots]);
+  if(r->data != data)
+    memcpy(writer_buffer(w), data, size);
+  writer_queue(w, fd, offset, size, chunk, chunks, context);
+}
+
+void writer_flush(struct writer *w){
+  // waits until everything queued is in the file and handed back, before the file is read or closed
+  if(!w->running)
+    return;
+  pthread_mutex_lock(&w->lock);
+  __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+  while(__atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) != w->head)
+    pthread_cond_wait(&w->drained, &w->lock);
+  __atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void writer_stop(struct writer *w){
+  // writes what is left and ends the writer thread, a failing write that exits from it skips this
+  if(!w->running || pthread_equal(pthread_self(), w->thread))
+    return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  w->running = 0;
+  if(w->requests > 0)
+    printf("WRITER: %ld BUFFERS IN %ld WRITES WITH %s, %ld STALLS\n",w->requests,w->writes,w->uring.fd >= 0 ? "IO_URING" : "PWRITEV",w->stalls);
+  uring_close(&w->uring);
+  free(w->ring);
+  free(w->buffers);
+  free(w->iov);
+}
+
+void *writer_thread(void *arg){
+  // writes the ring in batches and hands every request back once its data is in the file
+  struct writer *w = arg;
+  long tail = w->tail;
+  long head;
+  long end;
+  long i;
+  while(1){
+    head = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST);
+    if(head == tail){ // sleep until the network thread queues more or stops the writer
+      pthread_mutex_lock(&w->lock);
+      __atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+      while(__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail && !w->stop)
+        pthread_cond_wait(&w->wake, &w->lock);
+      __atomic_store_n(&w->idle, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&w->lock);
+      if(__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail)
+        return NULL;
+      continue;
+    }
+    end = write_batch(w, tail, head);
+    for(i=tail; i<end; i++)
+      if(w->done != NULL)
+        w->done(&w->ring[i % w->slots]);
+    w->requests += end - tail;
+    tail = end;
+    __atomic_store_n(&w->tail, tail, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST)){
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_broadcast(&w->drained);
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+long write_batch(struct writer *w, long tail, long head){
+  // writes the requests from tail on as runs of adjacent data, one vectored write per run,
+  // and returns the request it stopped at
+  long first[URINGENTRIES];
+  long bytes[URINGENTRIES];
+  int count[URINGENTRIES];
+  struct write_request *r;
+  struct write_request *prev;
+  struct iovec *iov;
+  long i = tail;
+  long n;
+  int runs = 0;
+  int k;
+
+  while(i < head && runs < URINGENTRIES){
+    first[runs] = i;
+    bytes[runs] = 0;
+    count[runs] = 0;
+    iov = w->iov + runs*MAXIOV;
+    prev = NULL;
+    while(i < head && count[runs] < MAXIOV){
+      r = &w->ring[i % w->slots];
+      if(r->size == 0 && prev == NULL){ // a request without data is only handed back, its fd may be closed
+        first[runs] = ++i;
+        continue;
+      }
+      if(prev != NULL && (r->size == 0 || r->fd != prev->fd || r->offset != prev->offset + prev->size))
+        break;
+      iov[count[runs]].iov_base = r->data;
+      iov[count[runs]].iov_len = r->size;
+      bytes[runs] += r->size;
+      count[runs]++;
+      prev = r;
+      i++;
+    }
+    if(count[runs] > 0)
+      runs++;
+  }
+
+  if(w->uring.fd >= 0)
+    uring_write(w, runs, first, count, bytes);
+  else
+    for(k=0; k<runs; k++){
+      r = &w->ring[first[k] % w->slots];
+      n = pwritev(r->fd, w->iov + k*MAXIOV, count[k], r->offset);
+      if(n < 0)
+        error("Cannot write file");
+      if(n < bytes[k])
+        finish_run(w, first[k], count[k], n);
+    }
+  w->writes += runs;
+  return i;
+}
+
+void uring_write(struct writer *w, int runs, long *first, int *count, long *bytes){
+  // submits one vectored write per run and waits until all of them are complete
+  struct uring *u = &w->uring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct write_request *r;
+  unsigned tail = *u->sq_tail;
+  unsigned head;
+  int submitted = 0;
+  int completed = 0;
+  int n;
+  int k;
+
+  for(k=0; k<runs; k++){
+    r = &w->ring[first[k] % w->slots];
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = r->fd;
+    sqe->off = r->offset;
+    sqe->addr = (unsigned long)(w->iov + k*MAXIOV);
+    sqe->len = count[k];
+    sqe->user_data = k;
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    tail++;
+  }
+  __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while(completed < runs){
+    n = syscall(__NR_io_uring_enter, u->fd, runs - submitted, runs - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(n < 0 && errno != EINTR)
+      error("Cannot write file");
+    if(n > 0)
+      submitted += n;
+    head = *u->cq_head;
+    while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)){
+      cqe = &u->cqes[head & *u->cq_mask];
+      k = cqe->user_data;
+      if(cqe->res < 0)
+        error("Cannot write file");
+      if(cqe->res < bytes[k])
+        finish_run(w, first[k], count[k], cqe->res);
+      head++;
+      completed++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+void finish_run(struct writer *w, long first, int count, long written){
+  // completes a short write of a run request by request
+  struct write_request *r;
+  long skip;
+  long n;
+  int i;
+  for(i=0; i<count; i++){
+    r = &w->ring[(first+i) % w->slots];
+    skip = written < r->size ? written : r->size;
+    written -= skip;
+    while(skip < r->size){
+      n = pwrite(r->fd, r->data+skip, r->size-skip, r->offset+skip);
+      if(n <= 0)
+        error("Cannot write file");
+      skip += n;
+    }
+  }
+}
+
+int uring_open(struct uring *u){
+  // maps the queues of a new io_uring instance, returns -1 if the kernel does not offer one
+  struct io_uring_params p;
+  char *sq;
+  char *cq;
+
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+  if(u->fd < 0)
+    return -1;
+  u->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  u->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP){ // both rings share one mapping
+    if(u->cq_size > u->sq_size)
+      u->sq_size = u->cq_size;
+    u->cq_size = 0;
+  }
+  u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = u->cq_size == 0 ? u->sq_ring : mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED){
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+  }
+  sq = u->sq_ring;
+  cq = u->cq_ring;
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+void uring_close(struct uring *u){
+  if(u->fd < 0)
+    return;
+  munmap(u->sqes, u->sqes_size);
+  if(u->cq_size > 0)
+    munmap(u->cq_ring, u->cq_size);
+  munmap(u->sq_ring, u->sq_size);
+  close(u->fd);
+  u->fd = -1;
+}
@@ -0,0 +1,82 @@
+/*
+  writer.h
+  Asynchronous Disk Writer of the Receiver
+*/
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+// constant values
+#define WRITERBYTES (16*1024*1024) // data the ring holds before the network thread has to wait
+#define MINWRITERSLOTS 64
+#define URINGENTRIES 64 // writes submitted together
+#define MAXIOV 64 // buffers coalesced into one write
+#define MAXLENT 64 // buffers after head writer_slot lends at once
+
+// data to be written at an offset of a file, with the chunks it covers
+struct write_request {
+  int fd;
+  long offset;
+  int size;
+  long chunk; // first chunk, handed back once the data is in the file
+  int chunks;
+  void *context;
+  char *data;
+  int lent; // data is received into it before it is queued, see writer_slot
+};
+
+// io_uring submission and completion queues, mapped from the kernel
+struct uring {
+  int fd; // -1 if io_uring is not available
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+// single producer single consumer ring: the network thread fills slots at head, the writer thread
+// writes them and moves tail, each side only stores its own index
+struct writer {
+  struct write_request *ring;
+  char *buffers;
+  long slots;
+  int slotsize;
+  long head;
+  long tail;
+  int idle; // the writer thread sleeps until head moves
+  int waiting; // the network thread sleeps until tail moves
+  int stop;
+  int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t drained;
+  void (*done)(struct write_request *r); // called on the writer thread once a request is in the file
+  struct uring uring;
+  struct iovec *iov;
+  long requests; // statistics
+  long writes;
+  long stalls;
+};
+
+void writer_start(struct writer *w, int slotsize, void (*done)(struct write_request *r));
+char *writer_buffer(struct writer *w);
+char *writer_slot(struct writer *w, int i);
+void writer_queue(struct writer *w, int fd, long offset, int size, long chunk, int chunks, void *context);
+void writer_write(struct writer *w, int fd, long offset, const char *data, int size, long chunk, int chunks, void *context);
+void writer_flush(struct writer *w);
+void writer_stop(struct writer *w);
+
+#endif